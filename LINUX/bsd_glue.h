@@ -208,6 +208,7 @@ struct thread;
 /* Atomic variables. */
 #define NM_ATOMIC_TEST_AND_SET(p)	test_and_set_bit(0, (p))
 #define NM_ATOMIC_CLEAR(p)		clear_bit(0, (p))
+#define NM_ATOMIC_CAS_PTR(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
 
 #define NM_ATOMIC_SET(p, v)             atomic_set(p, v)
 #define NM_ATOMIC_INC(p)                atomic_inc(p)
@@ -356,11 +357,14 @@ static inline int ilog2(uint64_t n)
 }
 #endif /* ilog2 */
 
-#define contigmalloc(sz, ty, flags, a, b, pgsz, c) ({		\
+#define contigmalloc(sz, ty, flags, a, b, pgsz, c)		\
+	contigmalloc_domain(sz, ty, NUMA_NO_NODE, flags, a, b, pgsz, c)
+
+#define contigmalloc_domain(sz, ty, node, flags, a, b, pgsz, c) ({	\
 	unsigned int order_ =					\
 		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
-	struct page *p_ = alloc_pages(GFP_ATOMIC | __GFP_ZERO,  \
-		order_);					\
+	struct page *p_ = alloc_pages_node(node,		\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
 	if (p_ != NULL) 					\
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
@@ -36,6 +36,13 @@
 #include <net/sch_generic.h>
 
 #include "netmap_linux_config.h"
+#ifdef CONFIG_X86_64
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#include <asm/fpu/api.h>	/* kernel_fpu_begin() */
+#else
+#include <asm/i387.h>
+#endif
+#endif
 
 void *
 nm_os_malloc(size_t size)
@@ -56,6 +63,18 @@ nm_os_free(void *addr){
 	kfree(addr);
 }
 
+void *
+nm_os_vmalloc(size_t size)
+{
+	return vzalloc(size);
+}
+
+void
+nm_os_vfree(void *addr)
+{
+	vfree(addr);
+}
+
 void
 nm_os_selinfo_init(NM_SELINFO_T *si)
 {
@@ -172,6 +191,20 @@ int nm_iommu_group_id(struct device *dev)
 }
 #endif /* HAVE_IOMMU */
 
+/* #################### NUMA ################## */
+/*
+ * Returns the NUMA node of the device, -1 if unknown.
+ */
+int nm_numa_node(struct device *dev)
+{
+	return dev ? dev_to_node(dev) : NUMA_NO_NODE;
+}
+
+int nm_numa_node_valid(int node)
+{
+	return node >= 0 && node < MAX_NUMNODES && node_online(node);
+}
+
 /* #################### VALE OFFLOADINGS SUPPORT ################## */
 
 /* Compute and return a raw checksum over (data, len), using 'cur_sum'
@@ -945,6 +978,140 @@ static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
 };
 
+#if defined(NETMAP_LINUX_HAVE_PMD_FAULT) || defined(NETMAP_LINUX_HAVE_HUGE_FAULT)
+/*
+ * Memory regions containing huge page clusters are mapped as pfns,
+ * using a single pmd for each aligned huge cluster and falling back
+ * to single pages for everything else.
+ * Older kernels ask for the pmd through .pmd_fault, newer ones
+ * through .huge_fault (see the PMD_FAULT and HUGE_FAULT tests in
+ * configure). Where neither is usable we keep the 4K mappings.
+ */
+
+/*
+ * Return the physical address of the huge cluster that can back
+ * the pmd containing address, or 0 if no pmd must be used.
+ */
+static unsigned long
+linux_netmap_huge_pa(struct vm_area_struct *vma, unsigned long address)
+{
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long addr = address & ~(NM_HUGE_SIZE - 1);
+	unsigned long off, pa;
+
+	if (addr < vma->vm_start || addr + NM_HUGE_SIZE > vma->vm_end)
+		return 0;
+	off = (addr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	if (!netmap_mem_ofs_is_huge(na->nm_mem, off))
+		return 0;
+	pa = netmap_mem_ofstophys(na->nm_mem, off);
+	if (pa & (NM_HUGE_SIZE - 1))
+		return 0;
+	ND("pmd fault off %lx -> phys addr %lx", off, pa);
+	return pa;
+}
+
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+static vm_fault_t
+linux_netmap_pfn_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long pa;
+
+	pa = netmap_mem_ofstophys(na->nm_mem, vmf->pgoff << PAGE_SHIFT);
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn(vma, vmf->address & PAGE_MASK,
+			pa >> PAGE_SHIFT);
+}
+
+static vm_fault_t
+linux_netmap_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	unsigned long pa;
+
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	pa = linux_netmap_huge_pa(vmf->vma, vmf->address);
+	if (pa == 0)
+		return VM_FAULT_FALLBACK;
+	return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(pa, 0),
+			vmf->flags & FAULT_FLAG_WRITE);
+}
+#else /* NETMAP_LINUX_HAVE_PMD_FAULT */
+static int
+linux_netmap_pfn_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long addr = vma->vm_start +
+		((vmf->pgoff - vma->vm_pgoff) << PAGE_SHIFT);
+	unsigned long pa;
+	int error;
+
+	pa = netmap_mem_ofstophys(na->nm_mem, vmf->pgoff << PAGE_SHIFT);
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	error = vm_insert_pfn(vma, addr, pa >> PAGE_SHIFT);
+	if (error == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (error && error != -EBUSY)
+		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+
+static int
+linux_netmap_pmd_fault(struct vm_area_struct *vma, unsigned long address,
+		pmd_t *pmd, unsigned int flags)
+{
+	unsigned long pa;
+
+	pa = linux_netmap_huge_pa(vma, address);
+	if (pa == 0)
+		return VM_FAULT_FALLBACK;
+	return vmf_insert_pfn_pmd(vma, address & ~(NM_HUGE_SIZE - 1), pmd,
+			phys_to_pfn_t(pa, 0), flags & FAULT_FLAG_WRITE);
+}
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
+
+static struct vm_operations_struct linux_netmap_huge_mmap_ops = {
+	.fault = linux_netmap_pfn_fault,
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+	.huge_fault = linux_netmap_huge_fault,
+#else
+	.pmd_fault = linux_netmap_pmd_fault,
+#endif
+};
+
+/*
+ * Place the mapping so that the huge clusters land on huge page
+ * boundaries in userspace too, otherwise no pmd can map them.
+ */
+static unsigned long
+linux_netmap_get_unmapped_area(struct file *f, unsigned long addr,
+		unsigned long len, unsigned long pgoff, unsigned long flags)
+{
+	struct netmap_priv_d *priv = f->private_data;
+	struct netmap_adapter *na = priv->np_na;
+	ssize_t hofs = -1;
+	unsigned long a;
+
+	if (priv->np_nifp != NULL && na != NULL)
+		hofs = netmap_mem_huge_ofs(na->nm_mem);
+	if (hofs < 0 || (flags & MAP_FIXED) || len < NM_HUGE_SIZE)
+		return current->mm->get_unmapped_area(f, addr, len,
+				pgoff, flags);
+	a = current->mm->get_unmapped_area(f, 0, len + NM_HUGE_SIZE,
+			pgoff, flags);
+	if (IS_ERR_VALUE(a))
+		return a;
+	return a + (((pgoff << PAGE_SHIFT) - hofs - a) & (NM_HUGE_SIZE - 1));
+}
+#endif /* NETMAP_LINUX_HAVE_PMD_FAULT || NETMAP_LINUX_HAVE_HUGE_FAULT */
+
 static int
 linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 {
@@ -991,6 +1158,16 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 		 */
 		vma->vm_private_data = priv;
 		vma->vm_ops = &linux_netmap_mmap_ops;
+#if defined(NETMAP_LINUX_HAVE_PMD_FAULT) || defined(NETMAP_LINUX_HAVE_HUGE_FAULT)
+		/* private writable mappings need struct pages for COW */
+		if ((memflags & NETMAP_MEM_HUGE) &&
+		    (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) !=
+		    VM_MAYWRITE) {
+			vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND |
+				VM_DONTDUMP | VM_HUGEPAGE;
+			vma->vm_ops = &linux_netmap_huge_mmap_ops;
+		}
+#endif /* NETMAP_LINUX_HAVE_PMD_FAULT || NETMAP_LINUX_HAVE_HUGE_FAULT */
 	}
 	return 0;
 }
@@ -1114,6 +1291,9 @@ static struct file_operations netmap_fops = {
     .owner = THIS_MODULE,
     .open = linux_netmap_open,
     .mmap = linux_netmap_mmap,
+#if defined(NETMAP_LINUX_HAVE_PMD_FAULT) || defined(NETMAP_LINUX_HAVE_HUGE_FAULT)
+    .get_unmapped_area = linux_netmap_get_unmapped_area,
+#endif
     LIN_IOCTL_NAME = linux_netmap_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = linux_netmap_compat_ioctl,
@@ -1202,7 +1382,7 @@ netmap_pernet_init(struct net *net)
 		return error;
 
 	ns->net = net;
-	ns->num_bridges = NM_BRIDGES;
+	ns->num_bridges = netmap_bdg_num_bridges();
 	ns->bridges = netmap_init_bridges2(ns->num_bridges);
 	if (ns->bridges == NULL) {
 		nm_bns_destroy(net, ns);
@@ -1270,6 +1450,54 @@ nm_os_ncpus(void)
 	return nr_cpu_ids;
 }
 
+uint64_t
+nm_os_cycles_freq(void)
+{
+#ifdef CONFIG_X86_TSC
+	return (uint64_t)tsc_khz * 1000;
+#else
+	return NSEC_PER_SEC;
+#endif
+}
+
+int
+nm_os_fpu_begin(void)
+{
+#ifdef CONFIG_X86_64
+	if (!irq_fpu_usable())
+		return 0;
+	kernel_fpu_begin();
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+nm_os_fpu_end(void)
+{
+#ifdef CONFIG_X86_64
+	kernel_fpu_end();
+#endif
+}
+
+/* the forwarding path may run in hard interrupt context, see mtx_lock() */
+int
+nm_os_intr_disable(u_long *s)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	*s = flags;
+	return 1;
+}
+
+void
+nm_os_intr_restore(u_long s)
+{
+	local_irq_restore((unsigned long)s);
+}
+
 /* kthread context */
 struct nm_kthread_ctx {
     /* files to exchange notifications */
@@ -2209,6 +2437,7 @@ EXPORT_SYMBOL(netmap_no_pendintr);	/* XXX mitigation - should go away */
 #ifdef WITH_VALE
 EXPORT_SYMBOL(netmap_bdg_ctl);		/* bridge configuration routine */
 EXPORT_SYMBOL(netmap_bdg_learning);	/* the default lookup function */
+EXPORT_SYMBOL(netmap_bdg_learning_batch);	/* and its batched version */
 EXPORT_SYMBOL(netmap_bdg_name);		/* the bridge the vp is attached to */
 #endif /* WITH_VALE */
 EXPORT_SYMBOL(netmap_disable_all_rings);
@@ -264,6 +264,19 @@ nm_os_free(void *addr)
     ExFreePoolWithTag(addr, /* M_DEVBUF */ 2);
 }
 
+/* the lookup tables are read at DISPATCH_LEVEL, so no paged pool */
+void *
+nm_os_vmalloc(size_t size)
+{
+    return nm_os_malloc(size);
+}
+
+void
+nm_os_vfree(void *addr)
+{
+    nm_os_free(addr);
+}
+
 void *
 nm_os_realloc(void *src, size_t size, size_t oldSize)
 {
@@ -1000,6 +1013,44 @@ nm_os_ncpus(void)
 	return 1;  // TODO
 }
 
+uint64_t
+nm_os_cycles_freq(void)
+{
+	LARGE_INTEGER freq;
+
+	KeQueryPerformanceCounter(&freq);
+	return freq.QuadPart;
+}
+
+/* the copy engine does not use the SIMD registers here */
+int
+nm_os_fpu_begin(void)
+{
+	return 0;
+}
+
+void
+nm_os_fpu_end(void)
+{
+}
+
+/* the forwarding path runs at most at DISPATCH_LEVEL */
+int
+nm_os_intr_disable(u_long *s)
+{
+	KIRQL irql;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	*s = irql;
+	return 1;
+}
+
+void
+nm_os_intr_restore(u_long s)
+{
+	KeLowerIrql((KIRQL)s);
+}
+
 int
 nm_os_mbuf_has_offld(struct mbuf *m)
 {
@@ -136,6 +136,8 @@ typedef ULONG 			vm_ooffset_t;
 #define destroy_dev(a)
 #define __user
 #define nm_iommu_group_id(dev)	0
+#define nm_numa_node(dev)	(-1)
+#define nm_numa_node_valid(node)	((node) == 0)
 
 
 /*
@@ -230,6 +232,7 @@ static void nm_os_selinfo_uninit(win_SELINFO *queue) { /* XXX nothing to do here
 
 #define mb				KeMemoryBarrier
 #define rmb				KeMemoryBarrier //XXX_ale: doesn't seems to exist just a read barrier
+#define wmb				KeMemoryBarrier
 
 /*
  *	TIME FUNCTIONS
@@ -374,6 +377,8 @@ PVOID send_up_to_stack(struct ifnet *ifp, struct mbuf *m, PVOID head);
 #define atomic_t			NM_ATOMIC_T
 #define NM_ATOMIC_TEST_AND_SET(p)       InterlockedBitTestAndSet(p,0)
 #define NM_ATOMIC_CLEAR(p)              InterlockedBitTestAndReset(p,0)
+#define NM_ATOMIC_CAS_PTR(p, o, n)	\
+	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
 #define refcount_acquire(_a)    	InterlockedExchangeAdd((atomic_t *)_a, 1)
 #define refcount_release(_a)    	(InterlockedDecrement((atomic_t *)_a) <= 0)
 #define NM_ATOMIC_SET(p, v)             InterlockedExchange(p, v)
@@ -39,6 +39,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>	/* apple needs sockaddr */
 #include <net/if.h>	/* ifreq */
+#include <arpa/inet.h>	/* inet_pton */
 #include <libgen.h>	/* basename */
 #include <stdlib.h>	/* atoi, free */
 
@@ -81,6 +82,188 @@ void parse_nmr_config(const char* conf, struct nmreq *nmr)
 	free(w);
 }
 
+/* split "port,a:b:c:d:e:f" into nr_name and nr_arg2/nr_arg3 */
+static int
+parse_port_mac(const char *name, struct nmreq *nmr)
+{
+	/* the address does not fit in nr_name */
+	const char *mac = name ? strchr(name, ',') : NULL;
+	unsigned int a[6];
+
+	if (mac == NULL || (size_t)(mac - name) >= sizeof(nmr->nr_name) ||
+	    sscanf(mac + 1, "%x:%x:%x:%x:%x:%x", &a[0], &a[1],
+	    &a[2], &a[3], &a[4], &a[5]) != 6)
+		return -1;
+	nmr->nr_name[mac - name] = '\0';
+	nmr->nr_arg2 = (a[0] & 0xff) << 8 | (a[1] & 0xff);
+	nmr->nr_arg3 = (a[2] & 0xff) << 24 | (a[3] & 0xff) << 16 |
+		(a[4] & 0xff) << 8 | (a[5] & 0xff);
+	return 0;
+}
+
+/* not an nr_cmd, routes go through NIOCCONFIG (see struct nm_lpm_req) */
+#define BDG_ROUTE	(-1)
+
+/*
+ * Add (NM_LPM_ADD) or remove (NM_LPM_DEL) a route of a switch
+ * with NETMAP_BDG_LPM. name is "port,prefix/len[,ring]".
+ */
+static int
+bdg_route(int fd, const char *name, int cmd)
+{
+	struct nm_ifreq ifr;
+	struct nm_lpm_req *lr = (struct nm_lpm_req *)ifr.data;
+	char buf[128], *prefix, *plen, *ring;
+	int max;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (name == NULL || strlen(name) >= sizeof(buf))
+		goto bad;
+	strcpy(buf, name);
+	prefix = strchr(buf, ',');
+	if (prefix == NULL || (size_t)(prefix - buf) >= sizeof(lr->lr_port))
+		goto bad;
+	*prefix++ = '\0';
+	ring = strchr(prefix, ',');
+	if (ring)
+		*ring++ = '\0';
+	plen = strchr(prefix, '/');
+	if (plen == NULL)
+		goto bad;
+	*plen++ = '\0';
+	if (inet_pton(AF_INET, prefix, lr->lr_addr) == 1) {
+		lr->lr_af = 4;
+		max = 32;
+	} else if (inet_pton(AF_INET6, prefix, lr->lr_addr) == 1) {
+		lr->lr_af = 6;
+		max = 128;
+	} else {
+		goto bad;
+	}
+	if (atoi(plen) < 0 || atoi(plen) > max)
+		goto bad;
+	lr->lr_cmd = cmd;
+	lr->lr_plen = atoi(plen);
+	lr->lr_ring = ring ? atoi(ring) : NM_LPM_ANY_RING;
+	strcpy(lr->lr_port, buf);
+	strcpy(ifr.nifr_name, buf);
+	if (ioctl(fd, NIOCCONFIG, &ifr) == -1) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+bad:
+	D("invalid route %s", name ? name : "");
+	return -1;
+}
+
+/* not an nr_cmd, flows go through NIOCCONFIG (see struct nm_flow_req) */
+#define BDG_FLOWS	(-2)
+
+/*
+ * Add (NM_FLOW_ADD) or remove (NM_FLOW_DEL) the flows read from the
+ * standard input, one per line:
+ *	proto src sport dst dport [fwd|drop|mirror [ring]]
+ * of a switch with NETMAP_BDG_FLOW, with a single request.
+ * name is "port[,mirror]" to add flows, the switch to remove them.
+ */
+static int
+bdg_flows(int fd, const char *name, int cmd)
+{
+	struct nm_ifreq ifr;
+	struct nm_flow_req *fq = (struct nm_flow_req *)ifr.data;
+	struct nm_flow_rule *r, *rules = NULL;
+	char line[256], proto[16], src[64], dst[64], act[16], *mirror;
+	u_int n = 0, max = 0, sport, dport, ring;
+	int error = -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (name == NULL || strlen(name) >= sizeof(line))
+		goto bad_name;
+	strcpy(line, name);
+	mirror = strchr(line, ',');
+	if (mirror)
+		*mirror++ = '\0';
+	if (strlen(line) >= sizeof(fq->fq_port) ||
+	    (mirror && strlen(mirror) >= sizeof(fq->fq_mirror)))
+		goto bad_name;
+	strcpy(ifr.nifr_name, line);
+	if (cmd == NM_FLOW_ADD) {
+		strcpy(fq->fq_port, line);
+		if (mirror)
+			strcpy(fq->fq_mirror, mirror);
+	}
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		strcpy(act, "fwd");
+		ring = NM_FLOW_ANY_RING;
+		if (sscanf(line, "%15s %63s %u %63s %u %15s %u", proto, src,
+		    &sport, dst, &dport, act, &ring) < 5 ||
+		    sport > 0xffff || dport > 0xffff || ring > 0xff)
+			goto bad_line;
+		if (n == max) {
+			max = max ? 2 * max : 1024;
+			r = realloc(rules, max * sizeof(*r));
+			if (r == NULL) {
+				D("out of memory");
+				goto out;
+			}
+			rules = r;
+		}
+		r = rules + n;
+		memset(r, 0, sizeof(*r));
+		if (!strcmp(proto, "tcp"))
+			r->fr_proto = 6;
+		else if (!strcmp(proto, "udp"))
+			r->fr_proto = 17;
+		else if (!strcmp(proto, "sctp"))
+			r->fr_proto = 132;
+		else
+			r->fr_proto = atoi(proto);
+		if (inet_pton(AF_INET, src, r->fr_src) == 1 &&
+		    inet_pton(AF_INET, dst, r->fr_dst) == 1)
+			r->fr_af = 4;
+		else if (inet_pton(AF_INET6, src, r->fr_src) == 1 &&
+		    inet_pton(AF_INET6, dst, r->fr_dst) == 1)
+			r->fr_af = 6;
+		else
+			goto bad_line;
+		r->fr_sport = htons(sport);
+		r->fr_dport = htons(dport);
+		if (!strcmp(act, "fwd"))
+			r->fr_action = NM_FLOW_FWD;
+		else if (!strcmp(act, "drop"))
+			r->fr_action = NM_FLOW_DROP;
+		else if (!strcmp(act, "mirror"))
+			r->fr_action = NM_FLOW_MIRROR;
+		else
+			goto bad_line;
+		r->fr_ring = ring;
+		n++;
+	}
+	fq->fq_cmd = cmd;
+	fq->fq_count = n;
+	fq->fq_rules = (uintptr_t)rules;
+	if (ioctl(fd, NIOCCONFIG, &ifr) == -1) {
+		D("failed after %u of %u flows", fq->fq_count, n);
+		perror(name);
+	} else {
+		error = 0;
+	}
+	goto out;
+
+bad_line:
+	D("invalid flow %s", line);
+	goto out;
+bad_name:
+	D("invalid port %s", name ? name : "");
+out:
+	free(rules);
+	return error;
+}
+
 static int
 bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 {
@@ -161,6 +344,8 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 		 *                first queue in the case of REG_ONE_NIC
 		 *   nr_tx_rings: (REG_ONE_NIC only) indicates the
 		 *                number of CPU cores or the last queue
+		 *   nr_rx_rings: (4th field only) idle polls before
+		 *                the threads back off and then sleep
 		 */
 		nmr.nr_flags |= nmr.nr_tx_slots ?
 			NR_REG_ONE_NIC : NR_REG_ALL_NIC;
@@ -170,6 +355,17 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 			nmr.nr_arg1 = 1;
 		else
 			nmr.nr_arg1 = nmr.nr_tx_rings;
+		if (nmr_config) {
+			const char *c = nmr_config;
+			int commas = 0;
+
+			while ((c = strchr(c, ',')) != NULL) {
+				commas++;
+				c++;
+			}
+			if (commas == 3)
+				nmr.nr_arg3 = nmr.nr_rx_rings;
+		}
 
 		error = ioctl(fd, NIOCREGIF, &nmr);
 		if (!error)
@@ -182,6 +378,121 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 				"couldn't start" : "couldn't stop", error);
 		break;
 
+	case NETMAP_BDG_RXHASH:
+		nmr.nr_arg1 = nr_arg;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to set rx hashing on %s", name);
+			perror(name);
+		} else
+			ND("rx hashing %s on %s", nr_arg ? "on" : "off", name);
+		break;
+
+	case NETMAP_BDG_MCAST:
+		nmr.nr_arg1 = nr_arg;
+		if ((nr_arg == NETMAP_BDG_MCAST_JOIN ||
+		    nr_arg == NETMAP_BDG_MCAST_LEAVE) &&
+		    parse_port_mac(name, &nmr)) {
+			D("invalid port,group %s", name);
+			error = -1;
+			break;
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to update the multicast groups with %s", name);
+			perror(name);
+		}
+		break;
+
+	case NETMAP_BDG_FDB:
+		nmr.nr_arg1 = nr_arg;
+		if ((nr_arg == NETMAP_BDG_FDB_ADD ||
+		    nr_arg == NETMAP_BDG_FDB_DEL) &&
+		    parse_port_mac(name, &nmr)) {
+			D("invalid port,address %s", name);
+			error = -1;
+			break;
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to update the forwarding table with %s", name);
+			perror(name);
+		}
+		break;
+
+	case NETMAP_BDG_PRIO:
+		/* -C weight, in nr_tx_slots */
+		nmr.nr_arg1 = nr_arg;
+		nmr.nr_arg2 = nmr.nr_tx_slots;
+		nmr.nr_tx_slots = nmr.nr_rx_slots = 0;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to set priority forwarding on %s", name);
+			perror(name);
+		}
+		break;
+
+	case NETMAP_BDG_DEFER:
+		nmr.nr_arg1 = nr_arg;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to set deferred forwarding on %s", name);
+			perror(name);
+		}
+		break;
+
+	case NETMAP_BDG_LPM:
+		nmr.nr_arg1 = nr_arg;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to set the routing of %s", name);
+			perror(name);
+		}
+		break;
+
+	case BDG_ROUTE:
+		error = bdg_route(fd, name, nr_arg);
+		break;
+
+	case NETMAP_BDG_FLOW:
+		nmr.nr_arg1 = nr_arg;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to set the flow lookup of %s", name);
+			perror(name);
+		}
+		break;
+
+	case BDG_FLOWS:
+		error = bdg_flows(fd, name, nr_arg);
+		break;
+
+	case NETMAP_BDG_SHAPE:
+		/* -C rate[,burst[,ring]] was parsed as slots and rings:
+		 *   nr_tx_slots: rate in slots per second, 0 for no limit
+		 *   nr_rx_slots: burst in slots (if given)
+		 *   nr_tx_rings: the ring to limit (if given), otherwise
+		 *                all the rings of the port together
+		 */
+		nmr.nr_arg3 = nmr.nr_tx_slots;
+		nmr.nr_arg2 = 0;
+		nmr.nr_flags = NR_REG_ALL_NIC;
+		if (nmr_config && strchr(nmr_config, ',')) {
+			nmr.nr_arg2 = nmr.nr_rx_slots;
+			if (strchr(strchr(nmr_config, ',') + 1, ',')) {
+				nmr.nr_flags = NR_REG_ONE_NIC;
+				nmr.nr_ringid = nmr.nr_tx_rings;
+			}
+		}
+		nmr.nr_tx_slots = nmr.nr_rx_slots = 0;
+		nmr.nr_tx_rings = nmr.nr_rx_rings = 0;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to set the rate limit of %s", name);
+			perror(name);
+		}
+		break;
+
 	default: /* GINFO */
 		nmr.nr_cmd = nmr.nr_arg1 = nmr.nr_arg2 = 0;
 		error = ioctl(fd, NIOCGINFO, &nmr);
@@ -217,17 +528,46 @@ usage:
 			"\t-r interface	interface name to be deleted\n"
 			"\t-l list all or specified bridge's interfaces (default)\n"
 			"\t-C string ring/slot setting of an interface creating by -n\n"
-			"\t-p interface start polling. Additional -C x,y,z configures\n"
+			"\t-p interface start polling. Additional -C x,y,z[,w] configures\n"
 			"\t\t x: 0 (REG_ALL_NIC) or 1 (REG_ONE_NIC),\n"
 			"\t\t y: CPU core id for ALL_NIC and core/ring for ONE_NIC\n"
 			"\t\t z: (ONE_NIC only) num of total cores/rings\n"
+			"\t\t w: idle polls before backing off (0: always spin)\n"
 			"\t-P interface stop polling\n"
 			"\t-m memid to use when creating a new interface\n"
+			"\t-s bridge spread flows over the rx rings of the ports\n"
+			"\t-S bridge deliver to the same ring as the source (default)\n"
+			"\t-j interface,group subscribe to a multicast group\n"
+			"\t-J interface,group unsubscribe from a multicast group\n"
+			"\t-i bridge enable IGMP/MLD snooping\n"
+			"\t-I bridge disable IGMP/MLD snooping (default)\n"
+			"\t-t interface limit the rate to the interface. -C x,y,z gives\n"
+			"\t\t x: the rate in slots per second, 0 for no limit,\n"
+			"\t\t y: (optional) the burst size in slots,\n"
+			"\t\t z: (optional) the rx ring to limit, otherwise all\n"
+			"\t-q bridge deliver high priority frames first,\n"
+			"\t\t-C x serves x of them for each normal one (0: strict)\n"
+			"\t-Q bridge deliver frames in order (default)\n"
+			"\t-e interface forward from per-cpu workers\n"
+			"\t-E interface forward from the interrupt (default)\n"
+			"\t-f interface,address send address to interface (static)\n"
+			"\t-F bridge,address remove a static address\n"
+			"\t-k interface do not learn the addresses of interface\n"
+			"\t-K interface learn the addresses of interface (default)\n"
+			"\t-u bridge forward IP frames by route, the rest by MAC\n"
+			"\t-U bridge forward by MAC only, dropping the routes (default)\n"
+			"\t-R interface,prefix/len[,ring] add a route to interface\n"
+			"\t-X bridge,prefix/len remove a route\n"
+			"\t-w bridge forward IP frames by flow, the rest by MAC\n"
+			"\t-W bridge forward by MAC only, dropping the flows (default)\n"
+			"\t-o interface[,interface] add the flows read from stdin as\n"
+			"\t\t proto src sport dst dport [fwd|drop|mirror [ring]]\n"
+			"\t-O bridge remove the flows read from stdin\n"
 			"", command);
 		return 0;
 	}
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:s:S:j:J:i:I:t:q:Q:e:E:f:F:k:K:u:U:R:X:w:W:o:O:")) != -1) {
 		if (ch != 'C' && ch != 'm')
 			name = optarg; /* default */
 		switch (ch) {
@@ -268,6 +608,97 @@ usage:
 		case 'm':
 			nr_arg2 = atoi(optarg);
 			break;
+		case 's':
+			nr_cmd = NETMAP_BDG_RXHASH;
+			nr_arg = 1;
+			break;
+		case 'S':
+			nr_cmd = NETMAP_BDG_RXHASH;
+			nr_arg = 0;
+			break;
+		case 'j':
+			nr_cmd = NETMAP_BDG_MCAST;
+			nr_arg = NETMAP_BDG_MCAST_JOIN;
+			break;
+		case 'J':
+			nr_cmd = NETMAP_BDG_MCAST;
+			nr_arg = NETMAP_BDG_MCAST_LEAVE;
+			break;
+		case 'i':
+			nr_cmd = NETMAP_BDG_MCAST;
+			nr_arg = NETMAP_BDG_MCAST_SNOOP;
+			break;
+		case 'I':
+			nr_cmd = NETMAP_BDG_MCAST;
+			nr_arg = NETMAP_BDG_MCAST_NOSNOOP;
+			break;
+		case 't':
+			nr_cmd = NETMAP_BDG_SHAPE;
+			break;
+		case 'q':
+			nr_cmd = NETMAP_BDG_PRIO;
+			nr_arg = 1;
+			break;
+		case 'Q':
+			nr_cmd = NETMAP_BDG_PRIO;
+			nr_arg = 0;
+			break;
+		case 'e':
+			nr_cmd = NETMAP_BDG_DEFER;
+			nr_arg = 1;
+			break;
+		case 'E':
+			nr_cmd = NETMAP_BDG_DEFER;
+			nr_arg = 0;
+			break;
+		case 'f':
+			nr_cmd = NETMAP_BDG_FDB;
+			nr_arg = NETMAP_BDG_FDB_ADD;
+			break;
+		case 'F':
+			nr_cmd = NETMAP_BDG_FDB;
+			nr_arg = NETMAP_BDG_FDB_DEL;
+			break;
+		case 'k':
+			nr_cmd = NETMAP_BDG_FDB;
+			nr_arg = NETMAP_BDG_FDB_NOLEARN;
+			break;
+		case 'K':
+			nr_cmd = NETMAP_BDG_FDB;
+			nr_arg = NETMAP_BDG_FDB_LEARN;
+			break;
+		case 'u':
+			nr_cmd = NETMAP_BDG_LPM;
+			nr_arg = 1;
+			break;
+		case 'U':
+			nr_cmd = NETMAP_BDG_LPM;
+			nr_arg = 0;
+			break;
+		case 'R':
+			nr_cmd = BDG_ROUTE;
+			nr_arg = NM_LPM_ADD;
+			break;
+		case 'X':
+			nr_cmd = BDG_ROUTE;
+			nr_arg = NM_LPM_DEL;
+			break;
+		case 'w':
+			nr_cmd = NETMAP_BDG_FLOW;
+			nr_arg = 1;
+			break;
+		case 'W':
+			nr_cmd = NETMAP_BDG_FLOW;
+			nr_arg = 0;
+			break;
+		case 'o':
+			nr_cmd = BDG_FLOWS;
+			nr_arg = NM_FLOW_ADD;
+			break;
+		case 'O':
+			nr_cmd = BDG_FLOWS;
+			nr_arg = NM_FLOW_DEL;
+			break;
 		}
 	}
 	if (optind != argc) {
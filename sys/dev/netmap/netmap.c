@@ -522,6 +522,12 @@ int netmap_generic_rings = 1;
 /* Non-zero if ptnet devices are allowed to use virtio-net headers. */
 int ptnet_vnet_hdr = 1;
 
+/* Widest SIMD copy routine to use (see nm_copy_init()), and minimum
+ * length of the frames copied with non-temporal stores (0: never).
+ */
+int netmap_copy_simd = 1;
+int netmap_copy_nt = 0;
+
 /*
  * SYSCTL calls are grouped between SYSBEGIN and SYSEND to be emulated
  * in some other operating systems
@@ -548,11 +554,219 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txqdisc, CTLFLAG_RW, &netmap_generic_txqdisc, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_vnet_hdr, CTLFLAG_RW, &ptnet_vnet_hdr, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, copy_simd, CTLFLAG_RW, &netmap_copy_simd, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, copy_nt, CTLFLAG_RW, &netmap_copy_nt, 0 , "");
 
 SYSEND;
 
 NMG_LOCK_T	netmap_global_lock;
 
+/*
+ * Copy engine, used by VALE and the monitors. nm_copy_init() picks
+ * the routines from cpuid when the module is loaded:
+ * - rep movsb on cpus with fast short strings (ERMS), otherwise an
+ *   unrolled loop of 64 bit words;
+ * - AVX2, or AVX-512 with copy_simd=2 (it may lower the clock of
+ *   the core), for the sections delimited by nm_copy_begin() and
+ *   nm_copy_end(), which pay the cost of saving the SIMD state once
+ *   for a batch of packets;
+ * - movnti for frames of at least copy_nt bytes, which are usually
+ *   read on another core and would only evict our working set.
+ * The checksumming copies (used by the offloadings in VALE) copy
+ * exactly len bytes and return the sum of the 32 bit words of the
+ * data, in memory order, added to 'sum'.
+ */
+static void
+nm_copy_words(const void *_src, void *_dst, int l)
+{
+	const uint64_t *src = _src;
+	uint64_t *dst = _dst;
+
+	if (unlikely(l >= 1024)) {
+		memcpy(dst, src, l);
+		return;
+	}
+	for (; likely(l > 0); l-=64) {
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+	}
+}
+
+static uint64_t
+nm_csum_copy_words(const void *_src, void *_dst, int l, uint64_t sum)
+{
+	const uint8_t *src = _src;
+	uint8_t *dst = _dst;
+	uint64_t w;
+	uint32_t t;
+
+	for (; l >= 8; l -= 8, src += 8, dst += 8) {
+		memcpy(&w, src, 8);
+		memcpy(dst, &w, 8);
+		sum += (uint32_t)w + (w >> 32);
+	}
+	if (l > 0) {
+		/* pad the last word with zeros */
+		w = 0;
+		memcpy(&w, src, l);
+		memcpy(dst, src, l);
+		t = (uint32_t)w;
+		sum += t + (w >> 32);
+	}
+	return sum;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static void
+nm_cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	*a = leaf;
+	*c = 0;
+	__asm__ __volatile__("cpuid"
+		: "+a" (*a), "=b" (*b), "+c" (*c), "=d" (*d));
+}
+
+static void
+nm_copy_erms(const void *src, void *dst, int l)
+{
+	size_t n = (l + 63) & ~63;
+
+	__asm__ __volatile__("rep movsb"
+		: "+D" (dst), "+S" (src), "+c" (n) : : "memory");
+}
+
+static void
+nm_copy_movnti(const void *_src, void *_dst, int l)
+{
+	const uint64_t *src = _src;
+	uint64_t *dst = _dst;
+	int i;
+
+	for (; likely(l > 0); l -= 64, src += 8, dst += 8) {
+		for (i = 0; i < 8; i++)
+			__asm__ __volatile__("movnti %1, %0"
+				: "=m" (dst[i]) : "r" (src[i]));
+	}
+	/* order the stores with the ones that publish the slots */
+	__asm__ __volatile__("sfence" : : : "memory");
+}
+
+/* the SIMD registers need no clobbers, the kernel never uses them */
+static void
+nm_copy_avx2(const void *src, void *dst, int l)
+{
+	for (; likely(l > 0); l -= 64) {
+		__asm__ __volatile__(
+			"vmovdqu (%0), %%ymm0\n\t"
+			"vmovdqu 32(%0), %%ymm1\n\t"
+			"vmovdqu %%ymm0, (%1)\n\t"
+			"vmovdqu %%ymm1, 32(%1)\n\t"
+			: : "r" (src), "r" (dst) : "memory");
+		src = (const char *)src + 64;
+		dst = (char *)dst + 64;
+	}
+}
+
+/* 64 byte blocks with AVX2, the 32 bit words are widened to 64 bits
+ * and summed in four lanes; the tail goes to nm_csum_copy_words()
+ */
+static uint64_t
+nm_csum_copy_avx2(const void *src, void *dst, int l, uint64_t sum)
+{
+	long n = l & ~63;
+	uint64_t s = 0;
+
+	if (n > 0) {
+		__asm__ __volatile__(
+			"vpxor %%ymm4, %%ymm4, %%ymm4\n\t"
+			"vpxor %%ymm5, %%ymm5, %%ymm5\n\t"
+			"1:\n\t"
+			"vmovdqu (%1), %%ymm0\n\t"
+			"vmovdqu 32(%1), %%ymm1\n\t"
+			"vmovdqu %%ymm0, (%2)\n\t"
+			"vmovdqu %%ymm1, 32(%2)\n\t"
+			"vpunpckldq %%ymm4, %%ymm0, %%ymm2\n\t"
+			"vpunpckhdq %%ymm4, %%ymm0, %%ymm3\n\t"
+			"vpaddq %%ymm2, %%ymm5, %%ymm5\n\t"
+			"vpaddq %%ymm3, %%ymm5, %%ymm5\n\t"
+			"vpunpckldq %%ymm4, %%ymm1, %%ymm2\n\t"
+			"vpunpckhdq %%ymm4, %%ymm1, %%ymm3\n\t"
+			"vpaddq %%ymm2, %%ymm5, %%ymm5\n\t"
+			"vpaddq %%ymm3, %%ymm5, %%ymm5\n\t"
+			"add $64, %1\n\t"
+			"add $64, %2\n\t"
+			"sub $64, %3\n\t"
+			"jnz 1b\n\t"
+			"vextracti128 $1, %%ymm5, %%xmm2\n\t"
+			"vpaddq %%xmm2, %%xmm5, %%xmm5\n\t"
+			"vpshufd $0x4e, %%xmm5, %%xmm2\n\t"
+			"vpaddq %%xmm2, %%xmm5, %%xmm5\n\t"
+			"vmovq %%xmm5, %0\n\t"
+			: "=r" (s), "+r" (src), "+r" (dst), "+r" (n)
+			: : "memory", "cc");
+	}
+	return nm_csum_copy_words(src, dst, l & 63, sum + s);
+}
+
+static void
+nm_copy_avx512(const void *src, void *dst, int l)
+{
+	for (; likely(l > 0); l -= 64) {
+		__asm__ __volatile__(
+			"vmovdqu64 (%0), %%zmm0\n\t"
+			"vmovdqu64 %%zmm0, (%1)\n\t"
+			: : "r" (src), "r" (dst) : "memory");
+		src = (const char *)src + 64;
+		dst = (char *)dst + 64;
+	}
+}
+#endif /* __x86_64__ && __GNUC__ */
+
+nm_copy_fn_t nm_copy_plain = nm_copy_words;
+nm_copy_fn_t nm_copy_simd = NULL;
+nm_copy_fn_t nm_copy_nt = NULL;
+nm_csum_copy_fn_t nm_csum_copy_plain = nm_csum_copy_words;
+nm_csum_copy_fn_t nm_csum_copy_simd = NULL;
+
+void
+nm_copy_init(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	uint32_t a, b, c, d, xcr0 = 0;
+	int ymm, zmm;
+
+	nm_cpuid(1, &a, &b, &c, &d);
+	if (c & (1U << 27)) { /* OSXSAVE, we can read XCR0 */
+		__asm__ __volatile__("xgetbv"
+			: "=a" (xcr0), "=d" (d) : "c" (0));
+	}
+	/* the OS saves the YMM (and ZMM) state */
+	ymm = (xcr0 & 0x6) == 0x6;
+	zmm = (xcr0 & 0xe6) == 0xe6;
+
+	nm_copy_nt = nm_copy_movnti; /* SSE2 is always there */
+	nm_cpuid(7, &a, &b, &c, &d);
+	if (b & (1U << 9))
+		nm_copy_plain = nm_copy_erms;
+	if (netmap_copy_simd >= 2 && zmm && (b & (1U << 16)))
+		nm_copy_simd = nm_copy_avx512;
+	else if (netmap_copy_simd >= 1 && ymm && (b & (1U << 5)))
+		nm_copy_simd = nm_copy_avx2;
+	if (netmap_copy_simd >= 1 && ymm && (b & (1U << 5)))
+		nm_csum_copy_simd = nm_csum_copy_avx2;
+	D("copy engine: %s, %s",
+		nm_copy_plain == nm_copy_erms ? "erms" : "words",
+		nm_copy_simd == nm_copy_avx512 ? "avx512" :
+		(nm_copy_simd == nm_copy_avx2 ? "avx2" : "no simd"));
+#endif
+}
+
 /*
  * mark the ring as stopped, and run through the locks
  * to make sure other users get to see it.
@@ -2046,6 +2260,12 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 	error = netmap_set_ringid(priv, ringid, flags);
 	if (error)
 		goto err;
+	if (flags & NR_NUMA_NODE) {
+		error = netmap_mem_set_node(na->nm_mem,
+				NR_NUMA_NODE_GET(flags));
+		if (error)
+			goto err;
+	}
 	error = netmap_mem_finalize(na->nm_mem, na);
 	if (error)
 		goto err;
@@ -2191,10 +2411,12 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 	struct netmap_kring *krings;
 	int sync_flags;
 	enum txrx t;
+	u_int version = NETMAP_API; /* of the caller */
 
 	if (cmd == NIOCGINFO || cmd == NIOCREGIF) {
 		/* truncate name */
 		nmr->nr_name[sizeof(nmr->nr_name) - 1] = '\0';
+		version = nmr->nr_version;
 		if (nmr->nr_version != NETMAP_API) {
 			D("API mismatch for %s got %d need %d",
 				nmr->nr_name,
@@ -2267,7 +2489,15 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				|| i == NETMAP_BDG_NEWIF
 				|| i == NETMAP_BDG_DELIF
 				|| i == NETMAP_BDG_POLLING_ON
-				|| i == NETMAP_BDG_POLLING_OFF) {
+				|| i == NETMAP_BDG_POLLING_OFF
+				|| i == NETMAP_BDG_RXHASH
+				|| i == NETMAP_BDG_MCAST
+				|| i == NETMAP_BDG_SHAPE
+				|| i == NETMAP_BDG_PRIO
+				|| i == NETMAP_BDG_DEFER
+				|| i == NETMAP_BDG_FDB
+				|| i == NETMAP_BDG_LPM
+				|| i == NETMAP_BDG_FLOW) {
 			/* possibly attach/detach NIC and VALE switch */
 			error = netmap_bdg_ctl(nmr, NULL);
 			break;
@@ -2292,7 +2522,26 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			NMG_LOCK();
 			if (priv->np_na && priv->np_na->nm_mem) {
 				struct netmap_mem_d *nmd = priv->np_na->nm_mem;
-				error = netmap_mem_pools_info_get(nmr, nmd);
+				error = netmap_mem_pools_info_get(nmr, nmd,
+						version);
+			} else {
+				error = EINVAL;
+			}
+			NMG_UNLOCK();
+			break;
+		} else if (i == NETMAP_MEM_RESIZE) {
+			/* grow or shrink the buffers of the memory region */
+			NMG_LOCK();
+			if (priv->np_na && priv->np_na->nm_mem) {
+				struct netmap_mem_d *nmd = priv->np_na->nm_mem;
+				u_int nbufs = nmr->nr_arg3;
+
+				error = netmap_mem_resize(nmd, &nbufs);
+				if (!error) {
+					nmr->nr_arg3 = nbufs;
+					error = netmap_mem_get_info(nmd,
+						&nmr->nr_memsize, NULL, NULL);
+				}
 			} else {
 				error = EINVAL;
 			}
@@ -3348,6 +3597,7 @@ netmap_init(void)
 	int error;
 
 	NMG_LOCK_INIT();
+	nm_copy_init();
 
 	error = netmap_mem_init();
 	if (error != 0)
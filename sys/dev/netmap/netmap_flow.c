@@ -0,0 +1,722 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * Exact match 5-tuple lookup for VALE switches (NETMAP_BDG_FLOW).
+ *
+ * Flows are keyed by addresses, protocol and ports, and each one
+ * has an action: forward to a port (and optionally a ring), drop,
+ * or forward to a port and mirror to another one. Frames of flows
+ * not in the table, and non-IP frames, go through the learning
+ * bridge.
+ *
+ * The table is a hash with buckets of NM_FLOW_WAYS entries. Each
+ * key hashes to two buckets and is stored in the less loaded one;
+ * if both are full, entries are moved to their other bucket as in
+ * cuckoo hashing, which keeps the table usable up to a high load.
+ * Next to the entries, an array holds the hash of
+ * each entry (0 if free), so that the forwarding path only touches
+ * the entry that matches. The batched lookup prefetches the hashes
+ * of both buckets of 16 frames before looking at them.
+ *
+ * Entries are changed by the control path under NMG_LOCK and read
+ * without locks. Each entry has a sequence number, odd while the
+ * entry is being written, that the readers check before and after
+ * reading it: a frame that races with an update of its own flow
+ * is handled as a miss and goes through the learning bridge.
+ * Moved entries are copied to their new place before the old one
+ * is reused.
+ *
+ * Mirrored flows go to a multicast group of the switch made of the
+ * two ports (see netmap_bdg_mirror()), so they are delivered like
+ * multicast traffic, on ring 0 of both ports unless the switch
+ * spreads the traffic with NETMAP_BDG_RXHASH. Each entry holds a
+ * reference on its group, dropped when the entry is removed or
+ * replaced.
+ *
+ * Rules are loaded in batches through NIOCCONFIG: struct nm_flow_req
+ * points to an array of struct nm_flow_rule in user memory.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/sockio.h>
+#include <sys/malloc.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_FLOW_WAYS		4	/* entries per bucket */
+#define NM_FLOW_MAXENTRIES	(1U << 24)
+#define NM_FLOW_CHUNK		64	/* rules copied in at once */
+#define NM_FLOW_MAX_KICKS	32	/* max entries moved for an insert */
+
+/* the key, as extracted from the frames or the rules */
+struct nm_flow_key {
+	uint32_t	fk_src[4];	/* IPv4 addresses use the first word */
+	uint32_t	fk_dst[4];
+	uint16_t	fk_sport;	/* network byte order */
+	uint16_t	fk_dport;
+	uint8_t		fk_proto;
+	uint8_t		fk_af;		/* 4 or 6 */
+	uint16_t	fk_pad;
+};
+
+/*
+ * One cache line (64 bytes, keep fe_pad in sync with the fields).
+ * The array comes from nm_os_vmalloc(), which is page aligned,
+ * so every entry sits in its own line.
+ */
+struct nm_flow_ent {
+	volatile uint32_t fe_seq;	/* odd while the entry changes */
+	struct nm_flow_key fe_key;
+	uint16_t	fe_dst;		/* port, group or NM_BDG_NOPORT */
+	uint8_t		fe_ring;	/* NM_FLOW_ANY_RING: keep the default */
+	uint8_t		fe_action;
+	uint16_t	fe_port;	/* ports of the rule, for the purge */
+	uint16_t	fe_mirror;
+	uint32_t	fe_pad[3];
+};
+
+struct nm_flow {
+	uint32_t	*hash;		/* nbuckets * NM_FLOW_WAYS */
+	struct nm_flow_ent *ent;	/* nbuckets * NM_FLOW_WAYS */
+	u_int		mask;		/* nbuckets - 1 */
+	u_int		used;
+	struct nm_bridge *bdg;		/* owner of the mirror groups */
+};
+
+void
+nm_flow_destroy(struct nm_flow *t)
+{
+	u_int i;
+
+	if (t == NULL)
+		return;
+	if (t->hash && t->ent) {
+		for (i = 0; i < (t->mask + 1) * NM_FLOW_WAYS; i++) {
+			if (t->hash[i] && t->ent[i].fe_action == NM_FLOW_MIRROR)
+				netmap_bdg_mirror_put(t->bdg, t->ent[i].fe_dst);
+		}
+	}
+	if (t->hash)
+		nm_os_vfree(t->hash);
+	if (t->ent)
+		nm_os_vfree(t->ent);
+	nm_os_free(t);
+}
+
+/* Allocate an empty table of b for about nentries flows. May sleep. */
+struct nm_flow *
+nm_flow_create(struct nm_bridge *b, u_int nentries)
+{
+	struct nm_flow *t;
+	u_int n = NM_FLOW_WAYS * 2;
+
+	if (nentries > NM_FLOW_MAXENTRIES)
+		nentries = NM_FLOW_MAXENTRIES;
+	while (n < nentries)
+		n <<= 1;
+	t = nm_os_malloc(sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->mask = n / NM_FLOW_WAYS - 1;
+	t->bdg = b;
+	t->hash = nm_os_vmalloc(sizeof(uint32_t) * n);
+	t->ent = nm_os_vmalloc(sizeof(struct nm_flow_ent) * n);
+	if (t->hash == NULL || t->ent == NULL) {
+		D("cannot allocate a flow table of %u entries", n);
+		nm_flow_destroy(t);
+		return NULL;
+	}
+	return t;
+}
+
+static inline uint32_t
+nm_flow_hash(const struct nm_flow_key *k)
+{
+	const uint32_t *w = (const uint32_t *)k;
+	uint32_t h = 0x9e3779b9;
+	u_int i;
+
+	for (i = 0; i < sizeof(*k) / sizeof(*w); i++) {
+		h ^= w[i] * 0xcc9e2d51;
+		h = ((h << 13) | (h >> 19)) * 5 + 0xe6546b64;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h ? h : 1; /* 0 marks free entries */
+}
+
+/* first entry of one of the two buckets of hash h */
+static inline u_int
+nm_flow_bucket(struct nm_flow *t, uint32_t h, int which)
+{
+	u_int i = h & t->mask;
+
+	if (which) {
+		u_int i2 = ((h >> 16) | (h << 16)) & t->mask;
+		i = (i2 == i) ? i ^ 1 : i2;
+	}
+	return i * NM_FLOW_WAYS;
+}
+
+static inline int
+nm_flow_key_eq(const struct nm_flow_key *a, const struct nm_flow_key *b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/* index of the entry for k, or -1. Control path only. */
+static int
+nm_flow_find(struct nm_flow *t, const struct nm_flow_key *k, uint32_t h)
+{
+	u_int w, i, j;
+
+	for (w = 0; w < 2; w++) {
+		i = nm_flow_bucket(t, h, w);
+		for (j = i; j < i + NM_FLOW_WAYS; j++) {
+			if (t->hash[j] == h && nm_flow_key_eq(&t->ent[j].fe_key, k))
+				return j;
+		}
+	}
+	return -1;
+}
+
+/* the writer side of the sequence number of entry e */
+static inline void
+nm_flow_write_begin(struct nm_flow_ent *e)
+{
+	e->fe_seq++;
+	wmb();
+}
+
+static inline void
+nm_flow_write_end(struct nm_flow_ent *e)
+{
+	wmb();
+	e->fe_seq++;
+}
+
+/* copy entry from to the free entry to */
+static void
+nm_flow_move(struct nm_flow *t, u_int from, u_int to)
+{
+	struct nm_flow_ent *f = t->ent + from, *e = t->ent + to;
+
+	nm_flow_write_begin(e);
+	e->fe_key = f->fe_key;
+	e->fe_dst = f->fe_dst;
+	e->fe_ring = f->fe_ring;
+	e->fe_action = f->fe_action;
+	e->fe_port = f->fe_port;
+	e->fe_mirror = f->fe_mirror;
+	nm_flow_write_end(e);
+	t->hash[to] = t->hash[from];
+}
+
+/*
+ * Make room in the full bucket starting at b: look for a chain of
+ * entries, each one to be moved to its other bucket, that ends in a
+ * free entry, then move them starting from the end, so that every
+ * entry is copied before its place is taken.
+ * Return the entry freed in b, or -1.
+ */
+static int
+nm_flow_kick(struct nm_flow *t, u_int b, uint32_t seed)
+{
+	u_int path[NM_FLOW_MAX_KICKS];
+	u_int n, i, w, j = 0, k, alt;
+
+	for (n = 0; n < NM_FLOW_MAX_KICKS; n++) {
+		/* a pseudo-random way not already in the chain */
+		for (w = 0; w < NM_FLOW_WAYS; w++) {
+			j = b + (seed + n + w) % NM_FLOW_WAYS;
+			for (i = 0; i < n && path[i] != j; i++)
+				;
+			if (i == n)
+				break;
+		}
+		if (w == NM_FLOW_WAYS)
+			return -1;
+		path[n] = j;
+		alt = nm_flow_bucket(t, t->hash[j], 0);
+		if (alt == b)
+			alt = nm_flow_bucket(t, t->hash[j], 1);
+		for (k = alt; k < alt + NM_FLOW_WAYS; k++) {
+			if (t->hash[k] == 0)
+				goto found;
+		}
+		b = alt;
+	}
+	return -1;
+
+found:
+	for (;;) {
+		nm_flow_move(t, path[n], k);
+		k = path[n];
+		if (n-- == 0)
+			return k;
+	}
+}
+
+static int
+nm_flow_add(struct nm_flow *t, const struct nm_flow_key *k, u_int action,
+		u_int ring, u_int dst, u_int port, u_int mirror)
+{
+	uint32_t h = nm_flow_hash(k);
+	struct nm_flow_ent *e;
+	int i = nm_flow_find(t, k, h);
+	u_int old = NM_BDG_NOPORT;
+
+	if (i >= 0 && t->ent[i].fe_action == NM_FLOW_MIRROR)
+		old = t->ent[i].fe_dst; /* replaced below */
+	if (i < 0) {
+		u_int w, j, n[2], f[2];
+
+		/* the free entry of the less loaded bucket */
+		for (w = 0; w < 2; w++) {
+			u_int b = nm_flow_bucket(t, h, w);
+
+			n[w] = 0;
+			f[w] = b;
+			for (j = b + NM_FLOW_WAYS; j-- > b; ) {
+				if (t->hash[j])
+					n[w]++;
+				else
+					f[w] = j;
+			}
+		}
+		if (n[0] < NM_FLOW_WAYS || n[1] < NM_FLOW_WAYS)
+			i = f[n[1] < n[0]];
+		else if ((i = nm_flow_kick(t, f[0], h)) < 0 &&
+			 (i = nm_flow_kick(t, f[1], h >> 8)) < 0)
+			return ENOSPC;
+		t->used++;
+	}
+	e = t->ent + i;
+	nm_flow_write_begin(e);
+	e->fe_key = *k;
+	e->fe_dst = dst;
+	e->fe_ring = ring;
+	e->fe_action = action;
+	e->fe_port = port;
+	e->fe_mirror = mirror;
+	nm_flow_write_end(e);
+	t->hash[i] = h;
+	if (old != NM_BDG_NOPORT)
+		netmap_bdg_mirror_put(t->bdg, old);
+	return 0;
+}
+
+static void
+nm_flow_clear(struct nm_flow *t, u_int i)
+{
+	struct nm_flow_ent *e = t->ent + i;
+
+	t->hash[i] = 0;
+	nm_flow_write_begin(e);
+	bzero(&e->fe_key, sizeof(e->fe_key));
+	nm_flow_write_end(e);
+	t->used--;
+	if (e->fe_action == NM_FLOW_MIRROR)
+		netmap_bdg_mirror_put(t->bdg, e->fe_dst);
+}
+
+static int
+nm_flow_del(struct nm_flow *t, const struct nm_flow_key *k)
+{
+	int i = nm_flow_find(t, k, nm_flow_hash(k));
+
+	if (i < 0)
+		return ENOENT;
+	nm_flow_clear(t, i);
+	return 0;
+}
+
+/* remove all the flows, or those that use port (if port >= 0) */
+static void
+nm_flow_flush(struct nm_flow *t, int port)
+{
+	u_int i;
+
+	for (i = 0; i < (t->mask + 1) * NM_FLOW_WAYS; i++) {
+		struct nm_flow_ent *e = t->ent + i;
+
+		if (t->hash[i] && (port < 0 || e->fe_port == port ||
+		    (e->fe_action == NM_FLOW_MIRROR && e->fe_mirror == port)))
+			nm_flow_clear(t, i);
+	}
+}
+
+/*
+ * Remove the flows to a port which is leaving the switch.
+ * Called with NMG_LOCK held.
+ */
+void
+nm_flow_purge(struct nm_flow *t, u_int port)
+{
+	nm_flow_flush(t, port);
+}
+
+/* key of a rule coming from userspace, or EINVAL */
+static int
+nm_flow_rule_key(const struct nm_flow_rule *r, struct nm_flow_key *k)
+{
+	bzero(k, sizeof(*k));
+	if (r->fr_af == 4) {
+		memcpy(k->fk_src, r->fr_src, 4);
+		memcpy(k->fk_dst, r->fr_dst, 4);
+	} else if (r->fr_af == 6) {
+		memcpy(k->fk_src, r->fr_src, 16);
+		memcpy(k->fk_dst, r->fr_dst, 16);
+	} else {
+		return EINVAL;
+	}
+	k->fk_af = r->fr_af;
+	k->fk_proto = r->fr_proto;
+	/* only these protocols have ports in the key */
+	if (r->fr_proto == 6 || r->fr_proto == 17 || r->fr_proto == 132) {
+		k->fk_sport = r->fr_sport;
+		k->fk_dport = r->fr_dport;
+	}
+	return 0;
+}
+
+/*
+ * Process a struct nm_flow_req received with NIOCCONFIG. On return
+ * fq_count holds the number of rules that were processed, which is
+ * less than requested if an error occurred.
+ * Called with NMG_LOCK held.
+ */
+int
+nm_flow_config(struct nm_bridge *b, struct nm_flow *t, struct nm_ifreq *ifr)
+{
+	struct nm_flow_req *fq = (struct nm_flow_req *)ifr->data;
+	struct nm_flow_rule *r;
+	struct nm_flow_key k;
+	const char *src = (const char *)(uintptr_t)fq->fq_rules;
+	u_int count = fq->fq_count, done = 0, i, n;
+	int port = NM_BDG_NOPORT, mirror = NM_BDG_NOPORT, error = 0;
+
+	NMG_LOCK_ASSERT();
+	fq->fq_count = 0;
+	switch (fq->fq_cmd) {
+	case NM_FLOW_FLUSH:
+		nm_flow_flush(t, -1);
+		return 0;
+	case NM_FLOW_ADD:
+	case NM_FLOW_DEL:
+		break;
+	default:
+		return EINVAL;
+	}
+	fq->fq_port[sizeof(fq->fq_port) - 1] = '\0';
+	fq->fq_mirror[sizeof(fq->fq_mirror) - 1] = '\0';
+	if (fq->fq_cmd == NM_FLOW_ADD && fq->fq_port[0]) {
+		port = netmap_bdg_port(b, fq->fq_port);
+		if (port < 0)
+			return ENXIO;
+	}
+	if (fq->fq_cmd == NM_FLOW_ADD && fq->fq_mirror[0]) {
+		mirror = netmap_bdg_port(b, fq->fq_mirror);
+		if (mirror < 0 || mirror == port || port == NM_BDG_NOPORT)
+			return ENXIO;
+	}
+
+	r = nm_os_malloc(sizeof(*r) * NM_FLOW_CHUNK);
+	if (r == NULL)
+		return ENOMEM;
+	while (done < count && !error) {
+		n = count - done;
+		if (n > NM_FLOW_CHUNK)
+			n = NM_FLOW_CHUNK;
+		if (copyin(src + done * sizeof(*r), r, n * sizeof(*r))) {
+			error = EFAULT;
+			break;
+		}
+		for (i = 0; i < n; i++, done++) {
+			u_int dst = NM_BDG_NOPORT, ring = r[i].fr_ring;
+			u_int group = NM_BDG_NOPORT;
+
+			error = nm_flow_rule_key(r + i, &k);
+			if (error)
+				break;
+			if (fq->fq_cmd == NM_FLOW_DEL) {
+				/* a batch may remove flows already gone */
+				(void)nm_flow_del(t, &k);
+				continue;
+			}
+			switch (r[i].fr_action) {
+			case NM_FLOW_FWD:
+				dst = port;
+				break;
+			case NM_FLOW_DROP:
+				break;
+			case NM_FLOW_MIRROR:
+				/* the group is only created when used, and
+				 * each entry holds a reference on it
+				 */
+				if (mirror == NM_BDG_NOPORT) {
+					error = ENXIO;
+					break;
+				}
+				error = netmap_bdg_mirror(b, port, mirror,
+						&group);
+				dst = group;
+				ring = NM_FLOW_ANY_RING;
+				break;
+			default:
+				error = EINVAL;
+				break;
+			}
+			if (!error && r[i].fr_action != NM_FLOW_DROP &&
+			    dst == NM_BDG_NOPORT)
+				error = ENXIO; /* no port in the request */
+			if (!error && ring != NM_FLOW_ANY_RING &&
+			    ring >= NM_BDG_MAXRINGS)
+				error = EINVAL;
+			if (!error)
+				error = nm_flow_add(t, &k, r[i].fr_action,
+					ring, dst, dst == NM_BDG_NOPORT ?
+					NM_BDG_NOPORT : port, mirror);
+			if (error) {
+				if (group != NM_BDG_NOPORT)
+					netmap_bdg_mirror_put(b, group);
+				break;
+			}
+		}
+	}
+	nm_os_free(r);
+	fq->fq_count = done;
+	if (error)
+		RD(1, "flow rule %u of %u: error %d", done, count, error);
+	return error;
+}
+
+/*
+ * The key of an IPv4 or IPv6 frame, or -1. As for the rx hash, the
+ * headers must be in the first fragment and IPv6 extension headers
+ * are not followed. IP fragments, the first one too (MF is in the
+ * test), have no ports, so all the pieces of a datagram match the
+ * same flow.
+ */
+static inline int
+nm_flow_key_get(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		struct nm_flow_key *k)
+{
+	const uint8_t *buf = ft->ft_buf + na->up.virt_hdr_len;
+	int len = (int)ft->ft_len - (int)na->up.virt_hdr_len;
+	int l2 = 14, l4 = 0;
+	uint16_t ethtype;
+
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14 + 20)
+		return -1;
+	ethtype = (buf[12] << 8) | buf[13];
+	if (ethtype == 0x8100) { /* 802.1Q */
+		ethtype = (buf[16] << 8) | buf[17];
+		l2 = 18;
+	}
+	bzero(k, sizeof(*k));
+	if (ethtype == 0x0800 && len >= l2 + 20 && (buf[l2] >> 4) == 4) {
+		const uint8_t *ip = buf + l2;
+
+		k->fk_af = 4;
+		k->fk_proto = ip[9];
+		memcpy(k->fk_src, ip + 12, 4);
+		memcpy(k->fk_dst, ip + 16, 4);
+		if ((ip[6] & 0x3f) == 0 && ip[7] == 0)
+			l4 = l2 + (ip[0] & 0xf) * 4;
+	} else if (ethtype == 0x86dd && len >= l2 + 40) {
+		const uint8_t *ip6 = buf + l2;
+
+		k->fk_af = 6;
+		k->fk_proto = ip6[6];
+		memcpy(k->fk_src, ip6 + 8, 16);
+		memcpy(k->fk_dst, ip6 + 24, 16);
+		l4 = l2 + 40;
+	} else {
+		return -1;
+	}
+	if ((k->fk_proto == 6 || k->fk_proto == 17 || k->fk_proto == 132) &&
+	    l4 && len >= l4 + 4) {
+		memcpy(&k->fk_sport, buf + l4, 2);
+		memcpy(&k->fk_dport, buf + l4 + 2, 2);
+	}
+	return 0;
+}
+
+/*
+ * Look for k in the two buckets starting at b0 and b1. On a hit,
+ * return 1 and the destination in *dst and possibly *dst_ring.
+ */
+static inline int
+nm_flow_match(struct nm_flow *t, const struct nm_flow_key *k, uint32_t h,
+		u_int b0, u_int b1, u_int *dst, uint8_t *dst_ring)
+{
+	u_int j, w;
+
+	for (w = 0; w < 2 * NM_FLOW_WAYS; w++) {
+		struct nm_flow_ent *e;
+		uint32_t seq;
+		u_int d, r;
+
+		j = w < NM_FLOW_WAYS ? b0 + w : b1 + w - NM_FLOW_WAYS;
+		if (t->hash[j] != h)
+			continue;
+		e = t->ent + j;
+		seq = e->fe_seq;
+		if (seq & 1)
+			continue; /* being written */
+		rmb();
+		if (!nm_flow_key_eq(&e->fe_key, k))
+			continue;
+		d = e->fe_dst;
+		r = e->fe_ring;
+		rmb();
+		if (e->fe_seq != seq)
+			continue;
+		if (r != NM_FLOW_ANY_RING)
+			*dst_ring = r;
+		*dst = d;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Lookup function (see bdg_lookup_fn_t). Frames of unknown flows
+ * go to netmap_bdg_learning().
+ */
+u_int
+nm_flow_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na)
+{
+	struct nm_flow *t = netmap_bdg_flow(na->na_bdg);
+	struct nm_flow_key k;
+	uint32_t h;
+	u_int dst;
+
+	if (nm_flow_key_get(ft, na, &k) == 0) {
+		h = nm_flow_hash(&k);
+		if (nm_flow_match(t, &k, h, nm_flow_bucket(t, h, 0),
+				nm_flow_bucket(t, h, 1), &dst, dst_ring))
+			return dst;
+	}
+	return netmap_bdg_learning(ft, dst_ring, na);
+}
+
+/*
+ * Batched lookup (see bdg_lookup_batch_fn_t). Frames are parsed and
+ * hashed in groups of NM_FLOW_BATCH, and the hashes of their buckets
+ * prefetched, before the table is searched.
+ */
+#define NM_FLOW_BATCH	16
+
+void
+nm_flow_lookup_batch(struct nm_bdg_fwd *ft, u_int n, uint16_t *dst_port,
+		uint8_t *dst_ring, struct netmap_vp_adapter *na)
+{
+	struct nm_flow *t = netmap_bdg_flow(na->na_bdg);
+	struct {
+		struct nm_flow_key k;
+		uint32_t h;
+		u_int b0, b1;
+		uint16_t idx;
+		uint8_t ip;
+	} lk[NM_FLOW_BATCH];
+	u_int i = 0, k, cnt;
+
+	while (i < n) {
+		/* stage 1: parse, hash and prefetch */
+		for (cnt = 0; i < n && cnt < NM_FLOW_BATCH;
+				i += ft[i].ft_frags) {
+			dst_port[i] = NM_BDG_NOPORT;
+			if (unlikely(na->up.virt_hdr_len > ft[i].ft_len))
+				continue;
+			lk[cnt].idx = i;
+			lk[cnt].ip = nm_flow_key_get(ft + i, na, &lk[cnt].k) == 0;
+			if (lk[cnt].ip) {
+				uint32_t h = nm_flow_hash(&lk[cnt].k);
+
+				lk[cnt].h = h;
+				lk[cnt].b0 = nm_flow_bucket(t, h, 0);
+				lk[cnt].b1 = nm_flow_bucket(t, h, 1);
+				__builtin_prefetch(t->hash + lk[cnt].b0);
+				__builtin_prefetch(t->hash + lk[cnt].b1);
+			}
+			cnt++;
+		}
+		/* stage 2: resolve */
+		for (k = 0; k < cnt; k++) {
+			u_int j = lk[k].idx, dst;
+
+			if (!lk[k].ip || !nm_flow_match(t, &lk[k].k, lk[k].h,
+					lk[k].b0, lk[k].b1, &dst, &dst_ring[j]))
+				dst = netmap_bdg_learning(ft + j, &dst_ring[j],
+						na);
+			dst_port[j] = dst;
+		}
+	}
+}
+
+#endif /* WITH_VALE */
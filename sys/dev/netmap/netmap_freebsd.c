@@ -64,6 +64,13 @@
 #include <machine/bus.h>        /* bus_dmamap_* */
 #include <netinet/in.h>		/* in6_cksum_pseudo() */
 #include <machine/in_cksum.h>  /* in_pseudo(), in_cksum_hdr() */
+#if defined(__amd64__) || defined(__i386__)
+#include <machine/clock.h>	/* tsc_freq */
+#endif
+#if defined(__amd64__)
+#include <machine/fpu.h>	/* fpu_kern_enter() */
+#include <machine/pcb.h>	/* PCB_KERNFPU */
+#endif
 
 #include <net/netmap.h>
 #include <dev/netmap/netmap_kern.h>
@@ -107,6 +114,18 @@ nm_os_free(void *addr)
 	free(addr, M_DEVBUF);
 }
 
+void *
+nm_os_vmalloc(size_t size)
+{
+	return malloc(size, M_DEVBUF, M_WAITOK | M_ZERO);
+}
+
+void
+nm_os_vfree(void *addr)
+{
+	free(addr, M_DEVBUF);
+}
+
 void
 nm_os_ifnet_lock(void)
 {
@@ -1002,6 +1021,58 @@ nm_os_ncpus(void)
 	return mp_maxid + 1;
 }
 
+uint64_t
+nm_os_cycles_freq(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	return atomic_load_acq_64(&tsc_freq);
+#else
+	return 1000000000;
+#endif
+}
+
+int
+nm_os_fpu_begin(void)
+{
+#if defined(__amd64__) && __FreeBSD_version >= 1100000
+	/* NOCTX: no save area, runs in a critical section. It cannot
+	 * nest, nor be used by threads that own the FPU already.
+	 */
+	if (is_fpu_kern_thread(0) ||
+	    (curthread->td_pcb->pcb_flags & PCB_KERNFPU))
+		return 0;
+	fpu_kern_enter(curthread, NULL, FPU_KERN_NORMAL | FPU_KERN_NOCTX);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+nm_os_fpu_end(void)
+{
+#if defined(__amd64__) && __FreeBSD_version >= 1100000
+	fpu_kern_leave(curthread, NULL);
+#endif
+}
+
+/*
+ * The forwarding path runs in interrupt threads and takes MTX_DEF
+ * locks, so it cannot be kept out with a critical section.
+ */
+int
+nm_os_intr_disable(u_long *s)
+{
+	(void)s;
+	return 0;
+}
+
+void
+nm_os_intr_restore(u_long s)
+{
+	(void)s;
+}
+
 struct nm_kthread_ctx {
 	struct thread *user_td;		/* thread user-space (kthread creator) to send ioctl */
 	struct ptnetmap_cfgentry_bhyve	cfg;
@@ -103,6 +103,8 @@
 #include <machine/atomic.h>
 #define NM_ATOMIC_TEST_AND_SET(p)       (!atomic_cmpset_acq_int((p), 0, 1))
 #define NM_ATOMIC_CLEAR(p)              atomic_store_rel_int((p), 0)
+#define NM_ATOMIC_CAS_PTR(p, o, n)	\
+	atomic_cmpset_ptr((volatile uintptr_t *)(p), (uintptr_t)(o), (uintptr_t)(n))
 
 #if __FreeBSD_version >= 1100030
 #define	WNA(_ifp)	(_ifp)->if_netmap
@@ -140,6 +142,15 @@ struct hrtimer {
 #define NM_BNS_GET(b)
 #define NM_BNS_PUT(b)
 
+#if defined(__amd64__) || defined(__i386__)
+#include <machine/cpufunc.h>
+#define nm_os_cycles()		rdtsc()
+#else
+#define nm_os_cycles()		((uint64_t)sbttons(sbinuptime()))
+#endif
+#define nm_os_pause()		cpu_spinwait()
+#define nm_os_curcpu()		curcpu
+
 #elif defined (linux)
 
 #define	NM_LOCK_T	safe_spinlock_t	// see bsd_glue.h
@@ -165,6 +176,14 @@ struct hrtimer {
 #define NM_MTX_UNLOCK(m)	mutex_unlock(&(m))
 #define NM_MTX_ASSERT(m)	mutex_is_locked(&(m))
 
+#ifdef CONFIG_X86_TSC
+#define nm_os_cycles()		((uint64_t)get_cycles())
+#else
+#define nm_os_cycles()		((uint64_t)ktime_get_ns())
+#endif
+#define nm_os_pause()		cpu_relax()
+#define nm_os_curcpu()		raw_smp_processor_id()
+
 #ifndef DEV_NETMAP
 #define DEV_NETMAP
 #endif /* DEV_NETMAP */
@@ -192,6 +211,10 @@ struct hrtimer {
 #define NM_MTX_UNLOCK(m)	KeReleaseGuardedMutex(&(m))
 #define NM_MTX_ASSERT(m)	assert(&m.Count>0)
 
+#define nm_os_cycles()		((uint64_t)KeQueryPerformanceCounter(NULL).QuadPart)
+#define nm_os_pause()		YieldProcessor()
+#define nm_os_curcpu()		KeGetCurrentProcessorNumber()
+
 //These linknames are for the NDIS driver
 #define NETMAP_NDIS_LINKNAME_STRING             L"\\DosDevices\\NMAPNDIS"
 #define NETMAP_NDIS_NTDEVICE_STRING             L"\\Device\\NMAPNDIS"
@@ -267,6 +290,7 @@ typedef struct hrtimer{
 
 struct netmap_adapter;
 struct nm_bdg_fwd;
+struct nm_bdg_xfer;
 struct nm_bridge;
 struct netmap_priv_d;
 
@@ -294,6 +318,9 @@ void netmap_undo_zombie(struct ifnet *);
 void *nm_os_malloc(size_t);
 void *nm_os_realloc(void *, size_t new_size, size_t old_size);
 void nm_os_free(void *);
+/* large zeroed allocations, may sleep */
+void *nm_os_vmalloc(size_t);
+void nm_os_vfree(void *);
 
 /* passes a packet up to the host stack.
  * If the packet is sent (or dropped) immediately it returns NULL,
@@ -446,10 +473,21 @@ struct netmap_kring {
 
 	/* The following fields are for VALE switch support */
 	struct nm_bdg_fwd *nkr_ft;
+	uint32_t	nkr_ft_ports;	/* bridge ports nkr_ft can serve */
 	uint32_t	*nkr_leases;
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
+	NM_ATOMIC_T	nkr_deferred;	/* (bwrap rx) queued to a worker */
+	/* senders waiting for their packets to be delivered, and
+	 * whether one of them is delivering (see nm_bdg_fanin())
+	 */
+	struct nm_bdg_xfer * volatile nkr_fanin;
+	NM_ATOMIC_T	nkr_fanin_busy;
 	uint32_t	nkr_lease_idx;
+	/* incremented when a txsync enters and leaves the VALE
+	 * forwarding path (odd while inside), see nm_bdg_publish()
+	 */
+	volatile uint32_t nkr_bdg_epoch;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -877,8 +915,12 @@ struct netmap_vp_adapter {	/* VALE software port */
 
 	/* Maximum Frame Size, used in bdg_mismatch_datapath() */
 	u_int mfs;
-	/* Last source MAC on this port */
+	/* Last source MAC on this port, and when it was learned */
 	uint64_t last_smac;
+	uint32_t last_smac_ts;
+	int bdg_nolearn;	/* no source learning (NETMAP_BDG_FDB) */
+	/* egress shaping, NULL if off (see netmap_vale.c) */
+	struct nm_bdg_shaper * volatile bdg_shaper;
 };
 
 
@@ -995,6 +1037,7 @@ struct netmap_bwrap_adapter {
 	 */
 	struct netmap_priv_d *na_kpriv;
 	struct nm_bdg_polling_state *na_polling_state;
+	int na_defer;	/* forward from the per-cpu workers */
 };
 int netmap_bwrap_attach(const char *name, struct netmap_adapter *);
 int netmap_vi_create(struct nmreq *, int);
@@ -1420,30 +1463,85 @@ int netmap_get_hw_na(struct ifnet *ifp,
  * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports,
  * NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 for unknown.
  * XXX in practice "unknown" might be handled same as broadcast.
+ *
+ * Modules register their callbacks with NETMAP_BDG_REGOPS and
+ * nr_arg3 = NM_BDG_OPS_VERSION, which changes with the values
+ * above and the layout of struct netmap_bdg_ops. Version 2 raised
+ * NM_BDG_MAXPORTS from 254 to 4094, so NM_BDG_BROADCAST and
+ * NM_BDG_NOPORT moved, and added lookup_batch; modules built for
+ * the previous values are refused.
  */
+#define NM_BDG_OPS_VERSION	2
 typedef u_int (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
 		struct netmap_vp_adapter *);
+/*
+ * The optional batched lookup receives the whole batch of n slots
+ * and, for each packet starting at slot i, stores the destination
+ * port in dst_port[i] with the same meaning as the return value
+ * of bdg_lookup_fn_t. dst_ring[i] is preset to the source ring
+ * and may be overwritten. If set, it is used instead of lookup.
+ */
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *);
 typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
+	bdg_lookup_batch_fn_t lookup_batch;
 };
 
 u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *);
+void netmap_bdg_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *);
 
-#define	NM_BRIDGES		8	/* number of bridges */
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+#define	NM_BRIDGES		8	/* default number of bridges */
+#define	NM_BDG_MAXPORTS		4094	/* up to 4094 */
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
+#define	NM_BDG_MAXRINGS		16	/* XXX unclear how many. */
+
+/* longest prefix match lookup (NETMAP_BDG_LPM), see netmap_lpm.c */
+struct nm_lpm;
+struct nm_lpm *nm_lpm_create(u_int ngroups, u_int nroutes);
+void nm_lpm_destroy(struct nm_lpm *);
+void nm_lpm_purge(struct nm_lpm *, u_int port);
+int nm_lpm_config(struct nm_bridge *, struct nm_lpm *, struct nm_ifreq *);
+u_int nm_lpm_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *);
+void nm_lpm_lookup_batch(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *);
+struct nm_lpm *netmap_bdg_lpm(struct nm_bridge *);
+void netmap_bdg_wait_senders(struct nm_bridge *);
+int netmap_bdg_port(struct nm_bridge *, const char *name);
+
+/* 5-tuple flow lookup (NETMAP_BDG_FLOW), see netmap_flow.c */
+struct nm_flow;
+struct nm_flow *nm_flow_create(struct nm_bridge *, u_int nentries);
+void nm_flow_destroy(struct nm_flow *);
+void nm_flow_purge(struct nm_flow *, u_int port);
+int nm_flow_config(struct nm_bridge *, struct nm_flow *, struct nm_ifreq *);
+u_int nm_flow_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *);
+void nm_flow_lookup_batch(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *);
+struct nm_flow *netmap_bdg_flow(struct nm_bridge *);
+int netmap_bdg_mirror(struct nm_bridge *, u_int port, u_int mirror,
+		u_int *dst);
+void netmap_bdg_mirror_put(struct nm_bridge *, u_int dst);
 
 /* these are redefined in case of no VALE support */
 int netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na,
 		struct netmap_mem_d *nmd, int create);
 struct nm_bridge *netmap_init_bridges2(u_int);
 void netmap_uninit_bridges2(struct nm_bridge *, u_int);
+u_int netmap_bdg_num_bridges(void);
 int netmap_init_bridges(void);
 void netmap_uninit_bridges(void);
 int netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops);
@@ -1489,7 +1587,7 @@ void netmap_bns_getbridges(struct nm_bridge **, u_int *);
 #define netmap_bns_get()
 #define netmap_bns_put(_1)
 #define netmap_bns_getbridges(b, n) \
-	do { *b = nm_bridges; *n = NM_BRIDGES; } while (0)
+	do { *b = nm_bridges; *n = nm_num_bridges; } while (0)
 #endif
 
 /* Various prototypes */
@@ -1595,6 +1693,10 @@ extern int netmap_generic_txqdisc;
  * Returns -ENOMEM in case the domain is different */
 #define nm_iommu_group_id(dev) (0)
 
+/* the memory is not placed on a given NUMA node */
+#define nm_numa_node(dev)	(-1)
+#define nm_numa_node_valid(node)	((node) == 0)
+
 /* Callback invoked by the dma machinery after a successful dmamap_load */
 static void netmap_dmamap_cb(__unused void *arg,
     __unused bus_dma_segment_t * segs, __unused int nseg, __unused int error)
@@ -1638,6 +1740,8 @@ netmap_reload_map(struct netmap_adapter *na,
 #else /* linux */
 
 int nm_iommu_group_id(bus_dma_tag_t dev);
+int nm_numa_node(struct device *dev);
+int nm_numa_node_valid(int node);
 #include <linux/dma-mapping.h>
 
 static inline void
@@ -1930,6 +2034,13 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
 
 /* Shared declarations for the VALE switch. */
 
+#define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
+#define NM_MULTISEG		64	/* max size of a chain of bufs */
+/* actual size of the tables */
+#define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NM_MULTISEG)
+/* NM_FT_NULL terminates a list of slots in the ft */
+#define NM_FT_NULL		NM_BDG_BATCH_MAX
+
 /*
  * Each transmit queue accumulates a batch of packets into
  * a structure before forwarding. Packets to the same
@@ -1939,7 +2050,7 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
-	uint8_t _ft_port;	/* dst port (unused) */
+	uint8_t ft_group;	/* multicast group + 1, 0 for broadcast */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
@@ -2024,11 +2135,20 @@ void nm_os_csum_tcpudp_ipv6(struct nm_ipv6hdr *ip6h, void *data,
 		      size_t datalen, uint16_t *check);
 uint16_t nm_os_csum_fold(rawsum_t cur_sum);
 
+struct nm_copy_ctx;
 void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   struct netmap_vp_adapter *dst_na,
 			   const struct nm_bdg_fwd *ft_p,
 			   struct netmap_ring *dst_ring,
-			   u_int *j, u_int lim, u_int *howmany);
+			   u_int *j, u_int lim, u_int *howmany,
+			   struct nm_copy_ctx *cc);
+u_int bdg_gro_datapath(struct netmap_vp_adapter *dst_na,
+		       const struct nm_bdg_fwd *ft,
+		       const struct nm_bdg_fwd *ft_p,
+		       u_int *next, u_int max_segs,
+		       struct netmap_ring *dst_ring,
+		       u_int *j, u_int lim, u_int *howmany,
+		       struct nm_copy_ctx *cc);
 
 /* persistent virtual port routines */
 int nm_os_vi_persist(const char *, struct ifnet **);
@@ -2059,6 +2179,108 @@ void nm_os_kthread_wakeup_worker(struct nm_kthread *nmk);
 void nm_os_kthread_send_irq(struct nm_kthread *);
 void nm_os_kthread_set_affinity(struct nm_kthread *, int);
 u_int nm_os_ncpus(void);
+/* rate of the cheap clock nm_os_cycles(), the TSC where available */
+uint64_t nm_os_cycles_freq(void);
+/* enter (if possible, returning 1) and leave a section that can use
+ * the SIMD registers
+ */
+int nm_os_fpu_begin(void);
+void nm_os_fpu_end(void);
+/* enter (if possible, returning 1) and leave a section where the
+ * forwarding path cannot run on this CPU, i.e. where we cannot be
+ * preempted by interrupts, softirqs or DPCs. s saves the state.
+ */
+int nm_os_intr_disable(u_long *s);
+void nm_os_intr_restore(u_long s);
+
+/*
+ * Copy engine for packet buffers, set up by nm_copy_init() (netmap.c).
+ * The routines round the length up to a multiple of 64 bytes, so both
+ * buffers must have room for that, and must not overlap.
+ * The SIMD routine is only used between nm_copy_begin() and
+ * nm_copy_end(), where we cannot sleep (e.g. in copyin()).
+ */
+typedef void (*nm_copy_fn_t)(const void *src, void *dst, int len);
+extern nm_copy_fn_t nm_copy_plain;	/* no SIMD registers */
+extern nm_copy_fn_t nm_copy_simd;	/* NULL if not available */
+extern nm_copy_fn_t nm_copy_nt;		/* non-temporal, may be NULL */
+/* copy exactly len bytes, returning sum plus the sum of the 32 bit
+ * words of the data (see nm_csum_fold64())
+ */
+typedef uint64_t (*nm_csum_copy_fn_t)(const void *src, void *dst, int len,
+		uint64_t sum);
+extern nm_csum_copy_fn_t nm_csum_copy_plain;
+extern nm_csum_copy_fn_t nm_csum_copy_simd;	/* NULL if not available */
+extern int netmap_copy_simd;
+extern int netmap_copy_nt;
+void nm_copy_init(void);
+
+struct nm_copy_ctx {
+	nm_copy_fn_t copy;	/* nm_copy_simd or nm_copy_plain */
+	nm_csum_copy_fn_t csum_copy;
+	int simd;		/* in a SIMD section */
+};
+
+/* a context with the plain routines, outside a SIMD section */
+static inline void
+nm_copy_ctx_init(struct nm_copy_ctx *cc)
+{
+	cc->copy = nm_copy_plain;
+	cc->csum_copy = nm_csum_copy_plain;
+	cc->simd = 0;
+}
+
+static inline void
+nm_copy_begin(struct nm_copy_ctx *cc)
+{
+	nm_copy_ctx_init(cc);
+	if (netmap_copy_simd && (nm_copy_simd || nm_csum_copy_simd) &&
+	    nm_os_fpu_begin()) {
+		cc->simd = 1;
+		if (nm_copy_simd)
+			cc->copy = nm_copy_simd;
+		if (nm_csum_copy_simd)
+			cc->csum_copy = nm_csum_copy_simd;
+	}
+}
+
+static inline void
+nm_copy_end(struct nm_copy_ctx *cc)
+{
+	if (cc->simd) {
+		nm_os_fpu_end();
+		cc->simd = 0;
+	}
+	cc->copy = nm_copy_plain;
+	cc->csum_copy = nm_csum_copy_plain;
+}
+
+static inline uint64_t
+nm_csum_copy(struct nm_copy_ctx *cc, const void *src, void *dst, int len,
+		uint64_t sum)
+{
+	return cc->csum_copy(src, dst, len, sum);
+}
+
+/* fold a sum of words in memory order to 16 bits, also in memory order */
+static inline uint16_t
+nm_csum_fold64(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+static inline void
+nm_copy(struct nm_copy_ctx *cc, const void *src, void *dst, int len)
+{
+	if (unlikely(netmap_copy_nt && len >= netmap_copy_nt) && nm_copy_nt)
+		nm_copy_nt(src, dst, len);
+	else
+		cc->copy(src, dst, len);
+}
 
 #ifdef WITH_PTNETMAP_HOST
 /*
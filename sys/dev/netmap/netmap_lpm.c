@@ -0,0 +1,650 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * Longest prefix match lookup for VALE switches (NETMAP_BDG_LPM).
+ *
+ * IPv4 uses a DIR-24-8 table: tbl24 is indexed by the first 24 bits
+ * of the destination, and the entries of prefixes longer than /24
+ * point to a group of 256 entries indexed by the last byte.
+ * IPv6 uses the same scheme as a multibit trie, with a first level
+ * of 16 bits and groups of 8 bits below it, so a lookup takes one
+ * memory access per byte past the longest prefix in its subtree.
+ * Groups come from a pool allocated with the table.
+ *
+ * An entry holds either a next hop and the length of the prefix it
+ * belongs to, or the index of a group. The length tells which entries
+ * a route owns, so that adding or removing a route only rewrites
+ * those; a removed route is replaced by the longest route covering
+ * it, found in the list of routes kept for the control path.
+ *
+ * The forwarding path reads the tables without locks. Entries are
+ * single words and groups are filled before being linked, so a
+ * lookup racing with an update finds either the old or the new route.
+ * When a route is removed, a group whose entries are all the same
+ * route again is folded back into the entry above it and released.
+ * Released groups are only reused once the senders of the switch have
+ * left the forwarding path (see nm_lpm_reclaim()), so a reader can
+ * not find one reused under it. Updates run under NMG_LOCK.
+ *
+ * Frames that are not IPv4 or IPv6 unicast, or have no route, go
+ * through the learning bridge, so ARP and neighbor discovery between
+ * the ports keep working. Frames are not modified (no TTL decrement
+ * or MAC rewrite): the lookup only selects the port and ring.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/sockio.h>
+#include <sys/malloc.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+/*
+ * Table entries. Next hops store the prefix length plus one,
+ * so that 0 means no route and /0 (the default route) can be told
+ * apart from it.
+ */
+#define NM_LPM_GROUP		0x80000000U	/* entry points to a group */
+#define NM_LPM_DEPTH(e)		(((e) >> 16) & 0xff)	/* plen + 1 */
+#define NM_LPM_IDX(e)		((e) & 0xffff)	/* next hop or group */
+#define NM_LPM_ENT(plen, nh)	((((uint32_t)(plen) + 1) << 16) | (nh))
+
+#define NM_LPM_GROUP_BITS	8	/* entries per group: 256 */
+#define NM_LPM_MAXGROUPS	65536	/* fits NM_LPM_IDX */
+#define NM_LPM_MAXNH		4096	/* distinct (port, ring) pairs */
+#define NM_LPM_MAXLEVELS	15	/* groups below the first level */
+
+struct nm_lpm_nh {
+	uint16_t	port;
+	uint8_t		ring;	/* NM_LPM_ANY_RING: keep the default */
+	uint8_t		pad;
+};
+
+/* a route, as seen by the control path */
+struct nm_lpm_rule {
+	uint8_t		addr[16];	/* masked to plen */
+	uint8_t		af;		/* 4 or 6, 0 if free */
+	uint8_t		plen;
+	uint16_t	nh;
+};
+
+struct nm_lpm {
+	uint32_t	*tbl24;		/* IPv4, 1 << 24 entries */
+	uint32_t	*tbl16;		/* IPv6, 1 << 16 entries */
+	uint32_t	*groups;	/* ngroups groups */
+	u_int		ngroups;
+	u_int		groups_used;	/* high water mark */
+	uint16_t	*gfree;		/* free groups, then released ones */
+	u_int		gfree_n;
+	u_int		grel_n;
+	struct nm_lpm_nh *nh;		/* NM_LPM_MAXNH */
+	u_int		nh_used;
+	struct nm_lpm_rule *rules;
+	u_int		nrules;
+	u_int		rules_used;	/* high water mark */
+};
+
+/* first level of each family */
+static inline uint32_t *
+nm_lpm_root(struct nm_lpm *t, int af, u_int *bits)
+{
+	*bits = (af == 4) ? 24 : 16;
+	return (af == 4) ? t->tbl24 : t->tbl16;
+}
+
+static inline uint32_t *
+nm_lpm_group(struct nm_lpm *t, uint32_t e)
+{
+	return t->groups + (NM_LPM_IDX(e) << NM_LPM_GROUP_BITS);
+}
+
+void
+nm_lpm_destroy(struct nm_lpm *t)
+{
+	if (t == NULL)
+		return;
+	if (t->tbl24)
+		nm_os_vfree(t->tbl24);
+	if (t->tbl16)
+		nm_os_vfree(t->tbl16);
+	if (t->groups)
+		nm_os_vfree(t->groups);
+	if (t->gfree)
+		nm_os_vfree(t->gfree);
+	if (t->nh)
+		nm_os_vfree(t->nh);
+	if (t->rules)
+		nm_os_vfree(t->rules);
+	nm_os_free(t);
+}
+
+/*
+ * Allocate an empty table with room for ngroups groups and nrules
+ * routes. May sleep.
+ */
+struct nm_lpm *
+nm_lpm_create(u_int ngroups, u_int nrules)
+{
+	struct nm_lpm *t;
+
+	if (ngroups > NM_LPM_MAXGROUPS)
+		ngroups = NM_LPM_MAXGROUPS;
+	t = nm_os_malloc(sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->ngroups = ngroups;
+	t->nrules = nrules;
+	t->tbl24 = nm_os_vmalloc(sizeof(uint32_t) << 24);
+	t->tbl16 = nm_os_vmalloc(sizeof(uint32_t) << 16);
+	t->groups = nm_os_vmalloc((sizeof(uint32_t) << NM_LPM_GROUP_BITS) *
+			(ngroups ? ngroups : 1));
+	t->gfree = nm_os_vmalloc(sizeof(uint16_t) * (ngroups ? ngroups : 1));
+	t->nh = nm_os_vmalloc(sizeof(struct nm_lpm_nh) * NM_LPM_MAXNH);
+	t->rules = nm_os_vmalloc(sizeof(struct nm_lpm_rule) *
+			(nrules ? nrules : 1));
+	if (t->tbl24 == NULL || t->tbl16 == NULL || t->groups == NULL ||
+	    t->gfree == NULL || t->nh == NULL || t->rules == NULL) {
+		D("cannot allocate the lpm tables");
+		nm_lpm_destroy(t);
+		return NULL;
+	}
+	return t;
+}
+
+/* index of a free group, or -1 */
+static int
+nm_lpm_group_get(struct nm_lpm *t)
+{
+	u_int g;
+
+	if (t->gfree_n > 0) {
+		g = t->gfree[--t->gfree_n];
+		/* keep the released groups right after the free ones */
+		t->gfree[t->gfree_n] = t->gfree[t->gfree_n + t->grel_n];
+		return g;
+	}
+	if (t->groups_used == t->ngroups)
+		return -1;
+	return t->groups_used++;
+}
+
+/*
+ * Fold the group linked by *e back into it if all its entries are
+ * the same route, and release the group.
+ */
+static void
+nm_lpm_fold(struct nm_lpm *t, uint32_t *e)
+{
+	uint32_t v = *e, *g;
+	int i;
+
+	if (!(v & NM_LPM_GROUP))
+		return;
+	g = nm_lpm_group(t, v);
+	if (g[0] & NM_LPM_GROUP)
+		return;
+	for (i = 1; i < (1 << NM_LPM_GROUP_BITS); i++) {
+		if (g[i] != g[0])
+			return;
+	}
+	*e = g[0];
+	/* readers may still be walking the group */
+	t->gfree[t->gfree_n + t->grel_n++] = NM_LPM_IDX(v);
+}
+
+/*
+ * Make the released groups free, once no reader can be using them.
+ * Only done when we may run out, as it waits for the senders.
+ */
+static void
+nm_lpm_reclaim(struct nm_bridge *b, struct nm_lpm *t)
+{
+	if (t->grel_n == 0 ||
+	    t->gfree_n + t->ngroups - t->groups_used >= NM_LPM_MAXLEVELS)
+		return;
+	netmap_bdg_wait_senders(b);
+	t->gfree_n += t->grel_n;
+	t->grel_n = 0;
+}
+
+/*
+ * Set *e to ent if it belongs to a shorter prefix (del == 0), or if
+ * it belongs to the prefix being removed, whose depth is del.
+ * Groups below e get the same treatment, and on removal are folded
+ * if they no longer hold longer prefixes.
+ */
+static void
+nm_lpm_set(struct nm_lpm *t, uint32_t *e, uint32_t ent, u_int del)
+{
+	uint32_t v = *e;
+	int i;
+
+	if (v & NM_LPM_GROUP) {
+		uint32_t *g = nm_lpm_group(t, v);
+
+		for (i = 0; i < (1 << NM_LPM_GROUP_BITS); i++)
+			nm_lpm_set(t, g + i, ent, del);
+		if (del)
+			nm_lpm_fold(t, e);
+	} else if (del ? NM_LPM_DEPTH(v) == del :
+			NM_LPM_DEPTH(v) <= NM_LPM_DEPTH(ent)) {
+		*e = ent;
+	}
+}
+
+/* bits [off, off + n) of addr, n <= 24 */
+static inline u_int
+nm_lpm_bits(const uint8_t *addr, u_int off, u_int n)
+{
+	u_int i, v = 0;
+
+	for (i = off / 8; i < (off + n) / 8; i++)
+		v = (v << 8) | addr[i];
+	return v;
+}
+
+/*
+ * Install ent on the entries covered by addr/plen, which must
+ * be a prefix of the given family. With del != 0, only replace
+ * the entries of the route of depth del (i.e. remove it), and fold
+ * the groups on the way that are left with a single route.
+ */
+static int
+nm_lpm_apply(struct nm_lpm *t, int af, const uint8_t *addr, u_int plen,
+		uint32_t ent, u_int del)
+{
+	u_int bits, off = 0, idx, i, n, depth = 0;
+	uint32_t *tbl = nm_lpm_root(t, af, &bits);
+	uint32_t *path[NM_LPM_MAXLEVELS];
+
+	for (;;) {
+		idx = nm_lpm_bits(addr, off, bits);
+		if (plen <= off + bits) {
+			n = 1U << (off + bits - plen);
+			idx &= ~(n - 1);
+			for (i = 0; i < n; i++)
+				nm_lpm_set(t, tbl + idx + i, ent, del);
+			break;
+		}
+		if (!(tbl[idx] & NM_LPM_GROUP)) {
+			uint32_t *g;
+			int gi;
+
+			/* nothing below, but the groups on the way may
+			 * have been left by an add that failed
+			 */
+			if (del)
+				break;
+			gi = nm_lpm_group_get(t);
+			if (gi < 0) {
+				RD(1, "out of lpm groups");
+				return ENOSPC;
+			}
+			g = t->groups + (gi << NM_LPM_GROUP_BITS);
+			/* the route above covers the whole group */
+			for (i = 0; i < (1 << NM_LPM_GROUP_BITS); i++)
+				g[i] = tbl[idx];
+			wmb(); /* fill the group before linking it */
+			tbl[idx] = NM_LPM_GROUP | gi;
+		}
+		path[depth++] = tbl + idx;
+		tbl = nm_lpm_group(t, tbl[idx]);
+		off += bits;
+		bits = NM_LPM_GROUP_BITS;
+	}
+	while (del && depth > 0)
+		nm_lpm_fold(t, path[--depth]);
+	return 0;
+}
+
+/* whether addr/plen is within the route r */
+static int
+nm_lpm_covers(const struct nm_lpm_rule *r, int af, const uint8_t *addr,
+		u_int plen)
+{
+	u_int i, n = r->plen;
+
+	if (r->af != af || n > plen)
+		return 0;
+	for (i = 0; i < n / 8; i++) {
+		if (r->addr[i] != addr[i])
+			return 0;
+	}
+	return (n % 8) == 0 ||
+		((r->addr[i] ^ addr[i]) & (0xff << (8 - n % 8))) == 0;
+}
+
+/* index of the next hop for port/ring, allocated if needed */
+static int
+nm_lpm_nh_get(struct nm_lpm *t, u_int port, u_int ring)
+{
+	u_int i;
+
+	for (i = 0; i < t->nh_used; i++) {
+		if (t->nh[i].port == port && t->nh[i].ring == ring)
+			return i;
+	}
+	if (t->nh_used == NM_LPM_MAXNH)
+		return -1;
+	t->nh[i].port = port;
+	t->nh[i].ring = ring;
+	t->nh_used++;
+	return i;
+}
+
+static int
+nm_lpm_add(struct nm_lpm *t, int af, const uint8_t *addr, u_int plen,
+		u_int port, u_int ring)
+{
+	struct nm_lpm_rule *r, *free_r = NULL;
+	u_int i;
+	int nh;
+
+	nh = nm_lpm_nh_get(t, port, ring);
+	if (nh < 0)
+		return ENOSPC;
+	for (i = 0; i < t->rules_used; i++) {
+		r = t->rules + i;
+		if (r->af == 0) {
+			if (free_r == NULL)
+				free_r = r;
+		} else if (r->plen == plen && nm_lpm_covers(r, af, addr, plen)) {
+			free_r = r; /* same prefix, replace it */
+			break;
+		}
+	}
+	if (free_r == NULL) {
+		if (t->rules_used == t->nrules)
+			return ENOSPC;
+		free_r = t->rules + t->rules_used++;
+	}
+	memcpy(free_r->addr, addr, sizeof(free_r->addr));
+	free_r->af = af;
+	free_r->plen = plen;
+	free_r->nh = nh;
+	/* on failure the route stays in the list, so that it can be
+	 * removed (the entries it did reach are correct)
+	 */
+	return nm_lpm_apply(t, af, addr, plen, NM_LPM_ENT(plen, nh), 0);
+}
+
+static int
+nm_lpm_del(struct nm_lpm *t, int af, const uint8_t *addr, u_int plen)
+{
+	struct nm_lpm_rule *r, *del = NULL, *cover = NULL;
+	u_int i;
+
+	for (i = 0; i < t->rules_used; i++) {
+		r = t->rules + i;
+		if (!nm_lpm_covers(r, af, addr, plen))
+			continue;
+		if (r->plen == plen)
+			del = r;
+		else if (cover == NULL || r->plen > cover->plen)
+			cover = r;
+	}
+	if (del == NULL)
+		return ENOENT;
+	del->af = 0;
+	return nm_lpm_apply(t, af, addr, plen,
+		cover ? NM_LPM_ENT(cover->plen, cover->nh) : 0, plen + 1);
+}
+
+/*
+ * Remove the routes to a port which is leaving the switch.
+ * Called with NMG_LOCK held.
+ */
+void
+nm_lpm_purge(struct nm_lpm *t, u_int port)
+{
+	u_int i;
+
+	for (i = 0; i < t->rules_used; i++) {
+		struct nm_lpm_rule *r = t->rules + i;
+
+		if (r->af && t->nh[r->nh].port == port)
+			nm_lpm_del(t, r->af, r->addr, r->plen);
+	}
+}
+
+/*
+ * Process a struct nm_lpm_req received with NIOCCONFIG.
+ * Called with NMG_LOCK held.
+ */
+int
+nm_lpm_config(struct nm_bridge *b, struct nm_lpm *t, struct nm_ifreq *ifr)
+{
+	struct nm_lpm_req *lr = (struct nm_lpm_req *)ifr->data;
+	uint8_t addr[16];
+	u_int i, plen = lr->lr_plen;
+	int port;
+
+	NMG_LOCK_ASSERT();
+	if ((lr->lr_af != 4 && lr->lr_af != 6) ||
+	    plen > (lr->lr_af == 4 ? 32 : 128))
+		return EINVAL;
+	/* only keep the bits of the prefix */
+	bzero(addr, sizeof(addr));
+	for (i = 0; i < plen / 8; i++)
+		addr[i] = lr->lr_addr[i];
+	if (plen % 8)
+		addr[i] = lr->lr_addr[i] & (0xff << (8 - plen % 8));
+
+	switch (lr->lr_cmd) {
+	case NM_LPM_ADD:
+		if (lr->lr_ring != NM_LPM_ANY_RING &&
+		    lr->lr_ring >= NM_BDG_MAXRINGS)
+			return EINVAL;
+		lr->lr_port[sizeof(lr->lr_port) - 1] = '\0';
+		port = netmap_bdg_port(b, lr->lr_port);
+		if (port < 0)
+			return ENXIO;
+		nm_lpm_reclaim(b, t);
+		return nm_lpm_add(t, lr->lr_af, addr, plen, port, lr->lr_ring);
+
+	case NM_LPM_DEL:
+		return nm_lpm_del(t, lr->lr_af, addr, plen);
+
+	default:
+		return EINVAL;
+	}
+}
+
+/*
+ * The destination address of an IPv4 or IPv6 unicast frame, and its
+ * family in *af, or NULL. Like the rx hash, we only look at frames
+ * whose headers are in the first fragment.
+ */
+static inline const uint8_t *
+nm_lpm_dst(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na, int *af)
+{
+	const uint8_t *buf = ft->ft_buf + na->up.virt_hdr_len;
+	int len = (int)ft->ft_len - (int)na->up.virt_hdr_len;
+	int l2 = 14;
+	uint16_t ethtype;
+
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14 + 20 || (buf[0] & 1))
+		return NULL;
+	ethtype = (buf[12] << 8) | buf[13];
+	if (ethtype == 0x8100) { /* 802.1Q */
+		ethtype = (buf[16] << 8) | buf[17];
+		l2 = 18;
+	}
+	if (ethtype == 0x0800 && len >= l2 + 20 && (buf[l2] >> 4) == 4) {
+		*af = 4;
+		return buf + l2 + 16;
+	}
+	if (ethtype == 0x86dd && len >= l2 + 40) {
+		*af = 6;
+		return buf + l2 + 24;
+	}
+	return NULL;
+}
+
+/* first level entry for the address */
+static inline uint32_t *
+nm_lpm_first(struct nm_lpm *t, int af, const uint8_t *a)
+{
+	return (af == 4) ? t->tbl24 + ((a[0] << 16) | (a[1] << 8) | a[2]) :
+		t->tbl16 + ((a[0] << 8) | a[1]);
+}
+
+/* walk the groups below the first level entry e */
+static inline uint32_t
+nm_lpm_walk(struct nm_lpm *t, int af, const uint8_t *a, uint32_t e)
+{
+	u_int i = (af == 4) ? 3 : 2, n = (af == 4) ? 4 : 16;
+
+	for (; (e & NM_LPM_GROUP) && i < n; i++)
+		e = nm_lpm_group(t, e)[a[i]];
+	return e;
+}
+
+/* port and ring for entry e, or NM_BDG_NOPORT if there is no route */
+static inline u_int
+nm_lpm_result(struct nm_lpm *t, uint32_t e, uint8_t *dst_ring)
+{
+	struct nm_lpm_nh *nh;
+
+	if (NM_LPM_DEPTH(e) == 0)
+		return NM_BDG_NOPORT;
+	nh = t->nh + NM_LPM_IDX(e);
+	if (nh->ring != NM_LPM_ANY_RING)
+		*dst_ring = nh->ring;
+	return nh->port;
+}
+
+/*
+ * Lookup function (see bdg_lookup_fn_t). Frames without a route
+ * go to netmap_bdg_learning().
+ */
+u_int
+nm_lpm_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na)
+{
+	struct nm_lpm *t = netmap_bdg_lpm(na->na_bdg);
+	const uint8_t *a;
+	u_int dst = NM_BDG_NOPORT;
+	int af;
+
+	a = nm_lpm_dst(ft, na, &af);
+	if (a != NULL)
+		dst = nm_lpm_result(t, nm_lpm_walk(t, af, a,
+				*nm_lpm_first(t, af, a)), dst_ring);
+	if (dst == NM_BDG_NOPORT)
+		dst = netmap_bdg_learning(ft, dst_ring, na);
+	return dst;
+}
+
+/*
+ * Batched lookup (see bdg_lookup_batch_fn_t). As in the learning
+ * bridge, frames are parsed in groups of NM_LPM_BATCH and their
+ * first level entries prefetched before the tables are walked.
+ */
+#define NM_LPM_BATCH	16
+
+void
+nm_lpm_lookup_batch(struct nm_bdg_fwd *ft, u_int n, uint16_t *dst_port,
+		uint8_t *dst_ring, struct netmap_vp_adapter *na)
+{
+	struct nm_lpm *t = netmap_bdg_lpm(na->na_bdg);
+	struct {
+		const uint8_t *a;
+		uint32_t *e;
+		uint16_t idx;
+		uint8_t af;
+	} lk[NM_LPM_BATCH];
+	u_int i = 0, k, cnt;
+
+	while (i < n) {
+		/* stage 1: parse and prefetch */
+		for (cnt = 0; i < n && cnt < NM_LPM_BATCH;
+				i += ft[i].ft_frags) {
+			int af;
+
+			dst_port[i] = NM_BDG_NOPORT;
+			if (unlikely(na->up.virt_hdr_len > ft[i].ft_len))
+				continue;
+			lk[cnt].idx = i;
+			lk[cnt].a = nm_lpm_dst(ft + i, na, &af);
+			if (lk[cnt].a != NULL) {
+				lk[cnt].af = af;
+				lk[cnt].e = nm_lpm_first(t, af, lk[cnt].a);
+				__builtin_prefetch(lk[cnt].e);
+			}
+			cnt++;
+		}
+		/* stage 2: resolve */
+		for (k = 0; k < cnt; k++) {
+			u_int j = lk[k].idx, dst = NM_BDG_NOPORT;
+
+			if (lk[k].a != NULL)
+				dst = nm_lpm_result(t, nm_lpm_walk(t, lk[k].af,
+					lk[k].a, *lk[k].e), &dst_ring[j]);
+			if (dst == NM_BDG_NOPORT)
+				dst = netmap_bdg_learning(ft + j, &dst_ring[j],
+						na);
+			dst_port[j] = dst;
+		}
+	}
+}
+
+#endif /* WITH_VALE */
@@ -87,11 +87,30 @@ enum {
 struct netmap_obj_params {
 	u_int size;
 	u_int num;
+	u_int huge;	/* clusters backed by huge pages if possible */
+	u_int max_num;	/* room for growth, see netmap_mem_resize() */
 
 	u_int last_size;
 	u_int last_num;
+	u_int last_huge;
+	u_int last_max_num;
 };
 
+/*
+ * Per-CPU cache (magazine) of the indexes of free buffers, see
+ * netmap_buf_malloc().
+ */
+struct netmap_obj_mag {
+	NM_LOCK_T lock;
+	u_int n;		/* cached indexes */
+	uint32_t *idx;		/* magsize entries, the top is used first */
+}
+#ifdef _WIN32
+__declspec(align(64));
+#else
+__attribute__((__aligned__(64)));
+#endif
+
 struct netmap_obj_pool {
 	char name[NETMAP_POOL_MAX_NAMSZ];	/* name of the allocator */
 
@@ -104,9 +123,18 @@ struct netmap_obj_pool {
 
 	u_int objfree;          /* number of free objects. */
 
-	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
+	struct lut_entry *lut;  /* virt,phys addresses, _maxtotal entries */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
+	uint32_t *freelist;	/* stack of the indexes of free objects,
+				 * objfree entries, the top is allocated
+				 * first */
+	struct netmap_obj_mag *mags; /* per-CPU caches of free objects */
+	u_int nmags;		/* number of magazines */
+	u_int magsize;		/* capacity of each magazine */
+	uint8_t *cached;	/* one byte per object, set if in a magazine */
+	u_int retired;		/* clusters past numclusters taken out of
+				 * service by netmap_obj_shrink() */
 	/* ---------------------------------------------------*/
 
 	/* limits */
@@ -121,10 +149,14 @@ struct netmap_obj_pool {
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
 	u_int _numclusters;	/* number of clusters */
+	u_int _huge;		/* each cluster is a huge page */
+	int _node;		/* NUMA node of the memory, -1 if any */
+	u_int _maxtotal;	/* objects the pool can grow to */
 
 	/* requested values */
 	u_int r_objtotal;
 	u_int r_objsize;
+	u_int r_maxtotal;
 };
 
 #define NMA_LOCK_T		NM_MTX_T
@@ -156,6 +188,7 @@ struct netmap_mem_d {
 	u_int flags;
 #define NETMAP_MEM_FINALIZED	0x1	/* preallocation done */
 #define NETMAP_MEM_HIDDEN	0x8	/* beeing prepared */
+#define NETMAP_MEM_NODESET	0x20	/* nm_node set by the user */
 	int lasterr;		/* last error for curr config */
 	int active;		/* active users */
 	int refcount;
@@ -164,6 +197,7 @@ struct netmap_mem_d {
 
 	nm_memid_t nm_id;	/* allocator identifier */
 	int nm_grp;	/* iommu groupd id */
+	int nm_node;	/* NUMA node for the memory, -1 if any */
 
 	/* list of all existing allocators, sorted by nm_id */
 	struct netmap_mem_d *prev, *next;
@@ -230,7 +264,9 @@ NMD_DEFNACB(void, rings_delete);
 static int netmap_mem_map(struct netmap_obj_pool *, struct netmap_adapter *);
 static int netmap_mem_unmap(struct netmap_obj_pool *, struct netmap_adapter *);
 static int nm_mem_assign_group(struct netmap_mem_d *, struct device *);
+static void nm_mem_assign_node(struct netmap_mem_d *, struct device *);
 static void nm_mem_release_id(struct netmap_mem_d *);
+static void netmap_obj_release_retired(struct netmap_obj_pool *);
 
 nm_memid_t
 netmap_mem_get_id(struct netmap_mem_d *nmd)
@@ -284,6 +320,7 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	if (nm_mem_assign_group(nmd, na->pdev) < 0) {
 		return ENOMEM;
 	} else {
+		nm_mem_assign_node(nmd, na->pdev);
 		NMA_LOCK(nmd);
 		nmd->lasterr = nmd->ops->nmd_finalize(nmd);
 		NMA_UNLOCK(nmd);
@@ -295,6 +332,40 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	return nmd->lasterr;
 }
 
+/*
+ * Mark as free all the objects of p, from index 'first' on, that
+ * have memory, and rebuild the stack of free indexes so that the
+ * lowest indexes are allocated first.
+ */
+static void
+netmap_obj_init_free(struct netmap_obj_pool *p, u_int first)
+{
+	int i; /* must be signed */
+
+	if (p->bitmap == NULL || p->freelist == NULL) {
+		/* XXX This check is a workaround that prevents a
+		 * NULL pointer crash which currently happens only
+		 * with ptnetmap guests.
+		 * Removed shared-info --> is the bug still there? */
+		return;
+	}
+	memset(p->bitmap, 0, sizeof(uint32_t) * p->bitmap_slots);
+	p->objfree = 0;
+	for (i = 0; p->mags != NULL && i < (int)p->nmags; i++) {
+		mtx_lock(&p->mags[i].lock);
+		p->mags[i].n = 0;
+		mtx_unlock(&p->mags[i].lock);
+	}
+	if (p->cached != NULL)
+		memset(p->cached, 0, p->objtotal);
+	for (i = (int)p->objtotal - 1; i >= (int)first; i--) {
+		if (p->lut[i].vaddr == NULL)
+			continue;
+		p->bitmap[ (i>>5) ] |=  ( 1 << (i & 31) );
+		p->freelist[p->objfree++] = i;
+	}
+}
+
 void
 netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
@@ -309,43 +380,13 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 		 * reclaimed.
 		 */
 		for (i = 0; i < NETMAP_POOLS_NR; i++) {
-			struct netmap_obj_pool *p;
-			u_int j;
-
-			p = &nmd->pools[i];
-			p->objfree = p->objtotal;
+			netmap_obj_release_retired(&nmd->pools[i]);
 			/*
-			 * Reproduce the net effect of the M_ZERO malloc()
-			 * and marking of free entries in the bitmap that
-			 * occur in finalize_obj_allocator()
+			 * Per netmap_mem_finalize_all(),
+			 * buffers 0 and 1 are reserved
 			 */
-			memset(p->bitmap,
-			    '\0',
-			    sizeof(uint32_t) * ((p->objtotal + 31) / 32));
-
-			/*
-			 * Set all the bits in the bitmap that have
-			 * corresponding buffers to 1 to indicate they are
-			 * free.
-			 */
-			for (j = 0; j < p->objtotal; j++) {
-				if (p->lut[j].vaddr != NULL) {
-					p->bitmap[ (j>>5) ] |=  ( 1 << (j & 31) );
-				}
-			}
-		}
-
-		/*
-		 * Per netmap_mem_finalize_all(),
-		 * buffers 0 and 1 are reserved
-		 */
-		nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
-		if (nmd->pools[NETMAP_BUF_POOL].bitmap) {
-			/* XXX This check is a workaround that prevents a
-			 * NULL pointer crash which currently happens only
-			 * with ptnetmap guests.
-			 * Removed shared-info --> is the bug still there? */
-			nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
+			netmap_obj_init_free(&nmd->pools[i],
+				i == NETMAP_BUF_POOL ? 2 : 0);
 		}
 	}
 	nmd->ops->nmd_deref(nmd);
@@ -354,12 +395,15 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 }
 
 
-/* accessor functions */
+/*
+ * accessor functions. The lookup table covers the room for growth,
+ * so that the copies kept by the adapters survive netmap_mem_resize().
+ */
 static int
 netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 {
 	lut->lut = nmd->pools[NETMAP_BUF_POOL].lut;
-	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
+	lut->objtotal = nmd->pools[NETMAP_BUF_POOL]._maxtotal;
 	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
 
 	return 0;
@@ -429,6 +473,7 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.nm_node = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -468,6 +513,7 @@ static const struct netmap_mem_d nm_blueprint = {
 	},
 
 	.nm_grp = -1,
+	.nm_node = -1,
 
 	.flags = NETMAP_MEM_PRIVATE,
 
@@ -495,6 +541,15 @@ static const struct netmap_mem_d nm_blueprint = {
 	SYSCTL_INT(_dev_netmap, OID_AUTO, priv_##name##_num, \
 	    CTLFLAG_RW, &netmap_min_priv_params[id].num, 0, \
 	    "Default number of private netmap " STRINGIFY(name) "s");	\
+	SYSCTL_INT(_dev_netmap, OID_AUTO, name##_huge, \
+	    CTLFLAG_RW, &nm_mem.params[id].huge, 0, \
+	    "Back netmap " STRINGIFY(name) "s with huge pages"); \
+	SYSCTL_INT(_dev_netmap, OID_AUTO, name##_curr_huge, \
+	    CTLFLAG_RD, &nm_mem.pools[id]._huge, 0, \
+	    "Netmap " STRINGIFY(name) "s are in huge pages"); \
+	SYSCTL_INT(_dev_netmap, OID_AUTO, priv_##name##_huge, \
+	    CTLFLAG_RW, &netmap_min_priv_params[id].huge, 0, \
+	    "Back private netmap " STRINGIFY(name) "s with huge pages"); \
 	SYSEND
 
 SYSCTL_DECL(_dev_netmap);
@@ -502,6 +557,15 @@ DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
 
+SYSBEGIN(mem2_growth);
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_max_num,
+    CTLFLAG_RW, &nm_mem.params[NETMAP_BUF_POOL].max_num, 0,
+    "Number of netmap bufs the pool can grow to");
+SYSCTL_INT(_dev_netmap, OID_AUTO, priv_buf_max_num,
+    CTLFLAG_RW, &netmap_min_priv_params[NETMAP_BUF_POOL].max_num, 0,
+    "Number of private netmap bufs the pool can grow to");
+SYSEND;
+
 /* call with nm_mem_list_lock held */
 static int
 nm_mem_assign_id_locked(struct netmap_mem_d *nmd)
@@ -599,6 +663,48 @@ nm_mem_assign_group(struct netmap_mem_d *nmd, struct device *dev)
 	return err;
 }
 
+/*
+ * Unless the user chose one, the memory goes on the NUMA node of
+ * the device of the first active user. Devices with no node (e.g.,
+ * VALE ports) are happy with whatever node the memory is on.
+ */
+static void
+nm_mem_assign_node(struct netmap_mem_d *nmd, struct device *dev)
+{
+	int node = nm_numa_node(dev);
+
+	NMA_LOCK(nmd);
+	if (node >= 0 && !nmd->active && !(nmd->flags & NETMAP_MEM_NODESET)) {
+		if (netmap_verbose && nmd->nm_node != node)
+			D("%s: numa node %d", nmd->name, node);
+		nmd->nm_node = node;
+	}
+	NMA_UNLOCK(nmd);
+}
+
+/*
+ * Bind the memory of nmd to a NUMA node. The memory moves there the
+ * next time it is allocated, so this fails if it is in use on a
+ * different node.
+ */
+int
+netmap_mem_set_node(struct netmap_mem_d *nmd, int node)
+{
+	int error = 0;
+
+	if (!nm_numa_node_valid(node))
+		return EINVAL;
+	NMA_LOCK(nmd);
+	if (nmd->active && nmd->nm_node != node) {
+		error = EBUSY;
+	} else {
+		nmd->nm_node = node;
+		nmd->flags |= NETMAP_MEM_NODESET;
+	}
+	NMA_UNLOCK(nmd);
+	return error;
+}
+
 /*
  * First, find the allocator that contains the requested offset,
  * then locate the cluster through a lookup table.
@@ -646,6 +752,55 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 #endif
 }
 
+/*
+ * Offset in the memory of nmd of the first cluster backed by a huge
+ * page, or -1 if there is none. The other ones follow at multiples
+ * of NM_HUGE_SIZE.
+ */
+ssize_t
+netmap_mem_huge_ofs(struct netmap_mem_d *nmd)
+{
+	ssize_t ofs = 0, ret = -1;
+	int i;
+
+	NMA_LOCK(nmd);
+	if (nmd->flags & NETMAP_MEM_HUGE) {
+		for (i = 0; i < NETMAP_POOLS_NR; i++) {
+			if (nmd->pools[i]._huge) {
+				ret = ofs;
+				break;
+			}
+			ofs += nmd->pools[i].memtotal;
+		}
+	}
+	NMA_UNLOCK(nmd);
+	return ret;
+}
+
+/*
+ * Nonzero if [offset, offset + NM_HUGE_SIZE) in the memory of nmd
+ * is a cluster backed by a huge page.
+ */
+int
+netmap_mem_ofs_is_huge(struct netmap_mem_d *nmd, vm_ooffset_t offset)
+{
+	struct netmap_obj_pool *p = nmd->pools;
+	int i, ret = 0;
+
+	NMA_LOCK(nmd);
+	if (nmd->flags & NETMAP_MEM_HUGE) {
+		for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
+			if (offset >= p[i].memtotal)
+				continue;
+			ret = p[i]._huge && offset % NM_HUGE_SIZE == 0 &&
+				p[i].lut[offset / p[i]._objsize].vaddr != NULL;
+			break;
+		}
+	}
+	NMA_UNLOCK(nmd);
+	return ret;
+}
+
 #ifdef _WIN32
 
 /*
@@ -753,14 +908,20 @@ netmap_mem2_get_info(struct netmap_mem_d* nmd, u_int* size, u_int *memflags,
 	if (error)
 		goto out;
 	if (size) {
+		struct netmap_obj_pool *p = nmd->pools + NETMAP_BUF_POOL;
+
 		if (nmd->flags & NETMAP_MEM_FINALIZED) {
 			*size = nmd->nm_totalsize;
+			/* the room for the growth of the buffers */
+			*size += (p->_maxtotal / p->_clustentries -
+				p->numclusters) * p->_clustsize;
 		} else {
 			int i;
 			*size = 0;
 			for (i = 0; i < NETMAP_POOLS_NR; i++) {
-				struct netmap_obj_pool *p = nmd->pools + i;
-				*size += (p->_numclusters * p->_clustsize);
+				p = nmd->pools + i;
+				*size += (p->_maxtotal / p->_clustentries *
+					p->_clustsize);
 			}
 		}
 	}
@@ -821,15 +982,41 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 }
 
 /*
- * report the index, and use start position as a hint,
- * otherwise buffer allocation becomes terribly expensive.
+ * Allocation and release of objects pop and push their indexes on
+ * p->freelist, so they take constant time whatever the occupancy
+ * of the pool. The bitmap keeps the state of each object to catch
+ * double frees.
+ */
+
+/*
+ * allocate up to n objects, storing their indexes in index[].
+ * Returns the number of objects allocated.
+ */
+static u_int
+netmap_obj_malloc_batch(struct netmap_obj_pool *p, uint32_t *index, u_int n)
+{
+	u_int k;
+
+	if (n > p->objfree)
+		n = p->objfree;
+	for (k = 0; k < n; k++) {
+		uint32_t i = p->freelist[--p->objfree];
+
+		p->bitmap[ (i>>5) ] &=  ~( 1 << (i & 31) );
+		index[k] = i;
+	}
+	ND("%s allocator: allocated %u objects, %u free", p->name, n,
+		p->objfree);
+	return n;
+}
+
+/*
+ * allocate one object and report its index.
  */
 static void *
-netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_t *index)
+netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *index)
 {
-	uint32_t i = 0;			/* index in the bitmap */
-	uint32_t mask, j = 0;		/* slot counter */
-	void *vaddr = NULL;
+	uint32_t i;
 
 	if (len > p->_objsize) {
 		D("%s request size %d too large", p->name, len);
@@ -837,36 +1024,13 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 		return NULL;
 	}
 
-	if (p->objfree == 0) {
+	if (netmap_obj_malloc_batch(p, &i, 1) == 0) {
 		D("no more %s objects", p->name);
 		return NULL;
 	}
-	if (start)
-		i = *start;
-
-	/* termination is guaranteed by p->free, but better check bounds on i */
-	while (vaddr == NULL && i < p->bitmap_slots)  {
-		uint32_t cur = p->bitmap[i];
-		if (cur == 0) { /* bitmask is fully used */
-			i++;
-			continue;
-		}
-		/* locate a slot */
-		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
-			;
-
-		p->bitmap[i] &= ~mask; /* mark object as in use */
-		p->objfree--;
-
-		vaddr = p->lut[i * 32 + j].vaddr;
-		if (index)
-			*index = i * 32 + j;
-	}
-	ND("%s allocator: allocated object @ [%d][%d]: vaddr %p",p->name, i, j, vaddr);
-
-	if (start)
-		*start = i;
-	return vaddr;
+	if (index)
+		*index = i;
+	return p->lut[i].vaddr;
 }
 
 
@@ -885,16 +1049,165 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 	}
 	ptr = &p->bitmap[j / 32];
 	mask = (1 << (j % 32));
-	if (*ptr & mask) {
+	if ((*ptr & mask) || (p->cached != NULL && p->cached[j])) {
 		D("ouch, double free on buffer %d", j);
 		return 1;
 	} else {
 		*ptr |= mask;
-		p->objfree++;
+		p->freelist[p->objfree++] = j;
 		return 0;
 	}
 }
 
+/*
+ * free n objects by index. Returns the number of invalid indexes.
+ */
+static u_int
+netmap_obj_free_batch(struct netmap_obj_pool *p, const uint32_t *index,
+		u_int n)
+{
+	u_int k, err = 0;
+
+	for (k = 0; k < n; k++)
+		err += netmap_obj_free(p, index[k]);
+	return err;
+}
+
+/*
+ * Buffers are allocated and released through per-CPU magazines, so
+ * that most requests only take the lock of the magazine of the
+ * current CPU instead of NMA_LOCK. A magazine is refilled from the
+ * pool, or flushed to it, half of its capacity at a time. Buffers in
+ * a magazine are still marked as allocated in the bitmap, which only
+ * changes with NMA_LOCK held, and have their byte in p->cached set to
+ * catch double frees. Lock order: NMA_LOCK, then magazines.
+ */
+#define netmap_obj_mag(p)	(&(p)->mags[nm_os_curcpu() % (p)->nmags])
+
+/*
+ * Magazines are sized so that at most 1/NM_MAG_SHARE of the objects
+ * are cached by the CPUs, and only used if they hold at least
+ * NM_MAG_MIN objects.
+ */
+#define NM_MAG_SHARE	8
+#define NM_MAG_MIN	16
+#define NM_MAG_MAX	256
+
+/* take up to n objects from magazine m, with its lock held */
+static u_int
+netmap_obj_mag_pop(struct netmap_obj_pool *p, struct netmap_obj_mag *m,
+		uint32_t *index, u_int n)
+{
+	u_int k;
+
+	for (k = 0; k < n && m->n > 0; k++) {
+		index[k] = m->idx[--m->n];
+		p->cached[index[k]] = 0;
+	}
+	return k;
+}
+
+/*
+ * put up to n objects in magazine m, with its lock held. Stops at the
+ * first invalid index or double free, leaving it to the pool.
+ */
+static u_int
+netmap_obj_mag_push(struct netmap_obj_pool *p, struct netmap_obj_mag *m,
+		const uint32_t *index, u_int n)
+{
+	u_int k;
+
+	for (k = 0; k < n && m->n < p->magsize; k++) {
+		uint32_t j = index[k];
+
+		if (j >= p->objtotal || p->cached[j] ||
+		    (p->bitmap[j >> 5] & (1U << (j & 31))))
+			break;
+		p->cached[j] = 1;
+		m->idx[m->n++] = j;
+	}
+	return k;
+}
+
+/*
+ * allocate up to n buffers, storing their indexes in index[].
+ * 'locked' tells if the caller holds NMA_LOCK.
+ * Returns the number of buffers allocated.
+ */
+static u_int
+netmap_buf_malloc(struct netmap_mem_d *nmd, uint32_t *index, u_int n,
+		int locked)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_mag *m = NULL;
+	uint32_t fill[NM_MAG_MAX / 2];
+	u_int i, k = 0;
+
+	if (p->mags != NULL) {
+		m = netmap_obj_mag(p);
+		mtx_lock(&m->lock);
+		k = netmap_obj_mag_pop(p, m, index, n);
+		mtx_unlock(&m->lock);
+		if (k == n)
+			return n;
+	}
+	if (!locked)
+		NMA_LOCK(nmd);
+	k += netmap_obj_malloc_batch(p, index + k, n - k);
+	for (i = 0; m != NULL && i < p->nmags && k < n; i++) {
+		/* the pool is dry, what is left is in the magazines */
+		mtx_lock(&p->mags[i].lock);
+		k += netmap_obj_mag_pop(p, &p->mags[i], index + k, n - k);
+		mtx_unlock(&p->mags[i].lock);
+	}
+	if (m != NULL && k == n) {
+		/* refill half of the magazine for the next requests */
+		i = netmap_obj_malloc_batch(p, fill, p->magsize / 2);
+		mtx_lock(&m->lock);
+		k = netmap_obj_mag_push(p, m, fill, i);
+		mtx_unlock(&m->lock);
+		netmap_obj_free_batch(p, fill + k, i - k);
+		k = n;
+	}
+	if (!locked)
+		NMA_UNLOCK(nmd);
+	return k;
+}
+
+/*
+ * release n buffers by index. 'locked' tells if the caller holds
+ * NMA_LOCK. Returns the number of invalid indexes.
+ */
+static u_int
+netmap_buf_free(struct netmap_mem_d *nmd, const uint32_t *index, u_int n,
+		int locked)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_mag *m = NULL;
+	uint32_t flush[NM_MAG_MAX / 2];
+	u_int k = 0, f = 0, err;
+
+	if (p->mags != NULL) {
+		m = netmap_obj_mag(p);
+		mtx_lock(&m->lock);
+		k = netmap_obj_mag_push(p, m, index, n);
+		if (k < n && m->n == p->magsize) {
+			/* full, flush half of it */
+			f = netmap_obj_mag_pop(p, m, flush, p->magsize / 2);
+		}
+		mtx_unlock(&m->lock);
+		if (k == n)
+			return 0;
+	}
+	if (!locked)
+		NMA_LOCK(nmd);
+	err = netmap_obj_free_batch(p, index + k, n - k);
+	netmap_obj_free_batch(p, flush, f);
+	if (!locked)
+		NMA_UNLOCK(nmd);
+	return err;
+}
+
 /*
  * free by address. This is slow but is only used for a few
  * objects (rings, nifp)
@@ -924,12 +1237,12 @@ netmap_obj_free_va(struct netmap_obj_pool *p, void *vaddr)
 #define netmap_mem_bufsize(n)	\
 	((n)->pools[NETMAP_BUF_POOL]._objsize)
 
-#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL, NULL)
+#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL)
 #define netmap_if_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_IF_POOL], (v))
-#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL, NULL)
+#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL)
 #define netmap_ring_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_RING_POOL], (v))
-#define netmap_buf_malloc(n, _pos, _index)			\
-	netmap_obj_malloc(&(n)->pools[NETMAP_BUF_POOL], netmap_mem_bufsize(n), _pos, _index)
+/* objects allocated or freed at once by the batch functions */
+#define NM_OBJ_BATCH	64
 
 
 #if 0 // XXX unused
@@ -946,25 +1259,28 @@ uint32_t
 netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
-
-	NMA_LOCK(nmd);
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t index[NM_OBJ_BATCH];
+	uint32_t i, j, m, want;
 
 	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
-			D("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
+	for (i = 0 ; i < n; i += m) {
+		want = n - i < NM_OBJ_BATCH ? n - i : NM_OBJ_BATCH;
+		m = netmap_buf_malloc(nmd, index, want, 0);
+		for (j = 0; j < m; j++) {
+			uint32_t *b = p->lut[index[j]].vaddr;
+
+			ND(5, "allocate buffer %d -> %d", index[j], *head);
+			*b = *head; /* link to previous head */
+			*head = index[j];
+		}
+		if (m < want) {
+			D("no more buffers after %d of %d", i + m, n);
+			i += m;
 			break;
 		}
-		ND(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
 	}
 
-	NMA_UNLOCK(nmd);
-
 	return i;
 }
 
@@ -974,17 +1290,23 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
         struct lut_entry *lut = na->na_lut.lut;
 	struct netmap_mem_d *nmd = na->nm_mem;
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	uint32_t i, cur, *buf;
+	uint32_t index[NM_OBJ_BATCH];
+	uint32_t i, m = 0, *buf;
 
 	ND("freeing the extra list");
 	for (i = 0; head >=2 && head < p->objtotal; i++) {
-		cur = head;
+		index[m++] = head;
 		buf = lut[head].vaddr;
 		head = *buf;
 		*buf = 0;
-		if (netmap_obj_free(p, cur))
-			break;
+		if (m == NM_OBJ_BATCH) {
+			if (netmap_buf_free(nmd, index, m, 1))
+				break;
+			m = 0;
+		}
 	}
+	if (m > 0)
+		netmap_buf_free(nmd, index, m, 1);
 	if (head != 0)
 		D("breaking with head %d", head);
 	if (netmap_verbose)
@@ -992,36 +1314,35 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 }
 
 
+static void netmap_free_bufs(struct netmap_mem_d *, struct netmap_slot *,
+		u_int);
+
 /* Return nonzero on error */
 static int
 netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 {
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	u_int i = 0;	/* slot counter */
-	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
-
-	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
-			D("no more buffers after %d of %d", i, n);
-			goto cleanup;
+	uint32_t index[NM_OBJ_BATCH];	/* buffer indexes */
+	u_int i, j, m, want;	/* slot counters */
+
+	for (i = 0; i < n; i += m) {
+		want = n - i < NM_OBJ_BATCH ? n - i : NM_OBJ_BATCH;
+		m = netmap_buf_malloc(nmd, index, want, 1);
+		for (j = 0; j < m; j++) {
+			slot[i + j].buf_idx = index[j];
+			slot[i + j].len = p->_objsize;
+			slot[i + j].flags = 0;
+		}
+		if (m < want) {
+			D("no more buffers, %d needed, %d available", n, i + m);
+			netmap_free_bufs(nmd, slot, i + m);
+			bzero(slot, n * sizeof(slot[0]));
+			return (ENOMEM);
 		}
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
 	}
 
-	ND("allocated %d buffers, %d available, first at %d", n, p->objfree, pos);
+	ND("allocated %d buffers, %d available", n, p->objfree);
 	return (0);
-
-cleanup:
-	while (i > 0) {
-		i--;
-		netmap_obj_free(p, slot[i].buf_idx);
-	}
-	bzero(slot, n * sizeof(slot[0]));
-	return (ENOMEM);
 }
 
 static void
@@ -1038,28 +1359,30 @@ netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
 }
 
 
-static void
-netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
-{
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-
-	if (i < 2 || i >= p->objtotal) {
-		D("Cannot free buf#%d: should be in [2, %d[", i, p->objtotal);
-		return;
-	}
-	netmap_obj_free(p, i);
-}
-
-
 static void
 netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 {
-	u_int i;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t index[NM_OBJ_BATCH];
+	u_int i, m = 0;
 
 	for (i = 0; i < n; i++) {
-		if (slot[i].buf_idx > 2)
-			netmap_free_buf(nmd, slot[i].buf_idx);
+		uint32_t idx = slot[i].buf_idx;
+
+		if (idx <= 2)
+			continue;
+		if (idx >= p->objtotal) {
+			D("Cannot free buf#%d: should be in [2, %d[", idx,
+				p->objtotal);
+			continue;
+		}
+		index[m++] = idx;
+		if (m == NM_OBJ_BATCH) {
+			netmap_buf_free(nmd, index, m, 1);
+			m = 0;
+		}
 	}
+	netmap_buf_free(nmd, index, m, 1);
 }
 
 static void
@@ -1068,9 +1391,24 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 
 	if (p == NULL)
 		return;
+	if (p->mags) {
+		u_int i;
+
+		for (i = 0; i < p->nmags; i++)
+			mtx_destroy(&p->mags[i].lock);
+		nm_os_vfree(p->mags[0].idx);
+		nm_os_vfree(p->cached);
+		nm_os_free(p->mags);
+	}
+	p->mags = NULL;
+	p->cached = NULL;
+	p->nmags = p->magsize = 0;
 	if (p->bitmap)
 		nm_os_free(p->bitmap);
 	p->bitmap = NULL;
+	if (p->freelist)
+		nm_os_vfree(p->freelist);
+	p->freelist = NULL;
 	if (p->lut) {
 		u_int i;
 
@@ -1080,7 +1418,8 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 		 * addresses are stored at multiples of p->_clusterentries
 		 * in the lut.
 		 */
-		for (i = 0; i < p->objtotal; i += p->_clustentries) {
+		for (i = 0; i < p->objtotal + p->retired * p->_clustentries;
+				i += p->_clustentries) {
 			if (p->lut[i].vaddr)
 				contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
 		}
@@ -1095,6 +1434,7 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	p->objtotal = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
+	p->retired = 0;
 	p->objfree = 0;
 }
 
@@ -1123,7 +1463,8 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+		u_int maxtotal, u_int objsize, u_int huge)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1132,6 +1473,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	/* we store the current request, so we can
 	 * detect configuration changes later */
 	p->r_objtotal = objtotal;
+	p->r_maxtotal = maxtotal;
 	p->r_objsize = objsize;
 
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
@@ -1178,6 +1520,21 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 		D("unsupported allocation for %d bytes", objsize);
 		return EINVAL;
 	}
+	/*
+	 * With huge pages, a cluster is exactly one huge page, so that
+	 * it can be mapped as such (see netmap_mem_ofs_is_huge()).
+	 */
+	p->_huge = 0;
+	if (huge) {
+		if (NM_HUGE_SIZE <= MAX_CLUSTSIZE &&
+		    NM_HUGE_SIZE % objsize == 0) {
+			clustentries = NM_HUGE_SIZE / objsize;
+			p->_huge = 1;
+		} else {
+			D("%s: %d bytes objects do not fill huge pages,"
+				" using normal clusters", p->name, objsize);
+		}
+	}
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
 	if (netmap_verbose)
@@ -1196,22 +1553,99 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	p->_objsize = objsize;
 	p->_objtotal = p->_numclusters * clustentries;
 
+	/*
+	 * Room for netmap_mem_resize() to add clusters, also whole.
+	 * On Windows the user mapping is built once and for all by
+	 * win32_build_user_vm_map(), so the pools cannot grow.
+	 */
+#ifdef _WIN32
+	maxtotal = 0;
+#endif
+	if (maxtotal > p->nummax) {
+		D("%s: cannot grow to %d objects, max %d", p->name,
+			maxtotal, p->nummax);
+		maxtotal = p->nummax;
+	}
+	p->_maxtotal = p->_objtotal;
+	if (maxtotal > p->_maxtotal)
+		p->_maxtotal = (maxtotal + clustentries - 1) /
+			clustentries * clustentries;
+
 	return 0;
 }
 
 static struct lut_entry *
-nm_alloc_lut(u_int nobj)
+nm_alloc_lut(u_int nobj, int node)
 {
 	size_t n = sizeof(struct lut_entry) * nobj;
 	struct lut_entry *lut;
 #ifdef linux
-	lut = vmalloc(n);
+	lut = vmalloc_node(n, node);
 #else
+	(void)node;
 	lut = nm_os_malloc(n);
 #endif
 	return lut;
 }
 
+/* the free lists are freed with nm_os_vfree() */
+static uint32_t *
+nm_alloc_freelist(u_int nobj, int node)
+{
+	size_t n = sizeof(uint32_t) * nobj;
+#ifdef linux
+	return vzalloc_node(n, node);
+#else
+	(void)node;
+	return nm_os_vmalloc(n);
+#endif
+}
+
+static void
+netmap_obj_mags_create(struct netmap_obj_pool *p)
+{
+	u_int i, ncpus = nm_os_ncpus(), size;
+	uint32_t *idx;
+
+	size = p->objtotal / (NM_MAG_SHARE * ncpus);
+	if (size > NM_MAG_MAX)
+		size = NM_MAG_MAX;
+	size &= ~1U;
+	if (size < NM_MAG_MIN)
+		return;
+	p->mags = nm_os_malloc(sizeof(*p->mags) * ncpus);
+	idx = nm_alloc_freelist(size * ncpus, p->_node);
+	/* zeroed, rounded up to whole uint32_t */
+	p->cached = (uint8_t *)nm_alloc_freelist((p->_maxtotal + 3) / 4,
+			p->_node);
+	if (p->mags == NULL || idx == NULL || p->cached == NULL) {
+		D("no per-cpu caches for '%s'", p->name);
+		if (p->mags)
+			nm_os_free(p->mags);
+		if (idx)
+			nm_os_vfree(idx);
+		if (p->cached)
+			nm_os_vfree(p->cached);
+		p->mags = NULL;
+		p->cached = NULL;
+		return;
+	}
+	for (i = 0; i < ncpus; i++) {
+		mtx_init(&p->mags[i].lock, "nm_mag_lock", NULL, MTX_DEF);
+		p->mags[i].n = 0;
+		p->mags[i].idx = idx + i * size;
+	}
+	p->nmags = ncpus;
+	p->magsize = size;
+	ND("%s: %u magazines of %u objects", p->name, ncpus, size);
+}
+
+#ifndef linux
+/* the other OSes do not place the clusters on a given node */
+#define contigmalloc_domain(sz, ty, node, flags, lo, hi, al, b)	\
+	contigmalloc(sz, ty, flags, lo, hi, al, b)
+#endif /* !linux */
+
 /* call with NMA_LOCK held */
 static int
 netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
@@ -1223,14 +1657,15 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	/* the tables have room for netmap_mem_resize() */
+	p->lut = nm_alloc_lut(p->_maxtotal, p->_node);
 	if (p->lut == NULL) {
 		D("Unable to create lookup table for '%s'", p->name);
 		goto clean;
 	}
 
 	/* Allocate the bitmap */
-	n = (p->objtotal + 31) / 32;
+	n = (p->_maxtotal + 31) / 32;
 	p->bitmap = nm_os_malloc(sizeof(uint32_t) * n);
 	if (p->bitmap == NULL) {
 		D("Unable to create bitmap (%d entries) for allocator '%s'", (int)n,
@@ -1239,8 +1674,16 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	}
 	p->bitmap_slots = n;
 
+	/* the stack of free indexes */
+	p->freelist = nm_alloc_freelist(p->_maxtotal, p->_node);
+	if (p->freelist == NULL) {
+		D("Unable to create free list for allocator '%s'", p->name);
+		goto clean;
+	}
+
 	/*
-	 * Allocate clusters, init pointers and bitmap
+	 * Allocate clusters and init pointers, the bitmap and the free
+	 * list are set by netmap_obj_init_free()
 	 */
 
 	n = p->_clustsize;
@@ -1255,8 +1698,22 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = contigmalloc_domain(n, M_NETMAP, p->_node,
+		    M_NOWAIT | M_ZERO, (size_t)0, -1UL,
+		    p->_huge ? NM_HUGE_SIZE : PAGE_SIZE, 0);
+		if (clust == NULL && p->_huge) {
+			/*
+			 * No huge pages, start again with the normal
+			 * clusters.
+			 */
+			D("Unable to get huge pages for '%s' allocator,"
+			    " using normal clusters", p->name);
+			netmap_reset_obj_allocator(p);
+			if (netmap_config_obj_allocator(p, p->r_objtotal,
+					p->r_maxtotal, p->r_objsize, 0))
+				return ENOMEM;
+			return netmap_finalize_obj_allocator(p);
+		}
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -1268,7 +1725,6 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 				goto out;
 			lim = i / 2;
 			for (i--; i >= lim; i--) {
-				p->bitmap[ (i>>5) ] &=  ~( 1 << (i & 31) );
 				if (i % p->_clustentries == 0 && p->lut[i].vaddr)
 					contigfree(p->lut[i].vaddr,
 						n, M_NETMAP);
@@ -1281,7 +1737,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			break;
 		}
 		/*
-		 * Set bitmap and lut state for all buffers in the current
+		 * Set lut state for all buffers in the current
 		 * cluster.
 		 *
 		 * [i, lim) is the set of buffer indexes that cover the
@@ -1292,7 +1748,6 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * of p->_objsize.
 		 */
 		for (; i < lim; i++, clust += p->_objsize) {
-			p->bitmap[ (i>>5) ] |=  ( 1 << (i & 31) );
 			p->lut[i].vaddr = clust;
 			p->lut[i].paddr = vtophys(clust);
 		}
@@ -1301,6 +1756,9 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	p->memtotal = p->numclusters * p->_clustsize;
 	if (p->objfree == 0)
 		goto clean;
+	/* the objects that do not exist (yet) alias object 0 */
+	for (i = p->objtotal; i < (int)p->_maxtotal; i++)
+		p->lut[i] = p->lut[0];
 	if (netmap_verbose)
 		D("Pre-allocated %d clusters (%d/%dKB) for '%s'",
 		    p->numclusters, p->_clustsize >> 10,
@@ -1313,6 +1771,178 @@ clean:
 	return ENOMEM;
 }
 
+/*
+ * Online resizing of the buffer pool, which is the last one in the
+ * memory region, so that clusters can come and go at its end without
+ * moving the others. The lookup table, bitmap and free list already
+ * have room for p->_maxtotal objects, and the entries past the last
+ * cluster alias object 0, like the indexes out of range in NMB().
+ */
+
+/* move the objects in the magazines back to the pool, with NMA_LOCK held */
+static void
+netmap_obj_mags_drain(struct netmap_obj_pool *p)
+{
+	uint32_t idx[NM_MAG_MAX / 2];
+	u_int i, n;
+
+	for (i = 0; i < p->nmags; i++) {
+		do {
+			mtx_lock(&p->mags[i].lock);
+			n = netmap_obj_mag_pop(p, &p->mags[i], idx,
+					NM_MAG_MAX / 2);
+			mtx_unlock(&p->mags[i].lock);
+			netmap_obj_free_batch(p, idx, n);
+		} while (n > 0);
+	}
+}
+
+/* add clusters at the end of p until it has n objects, with NMA_LOCK held */
+static void
+netmap_obj_grow(struct netmap_obj_pool *p, u_int n)
+{
+	u_int i, lim;
+	char *clust;
+
+	if (n > p->_maxtotal)
+		n = p->_maxtotal;
+	while (p->objtotal < n) {
+		lim = p->objtotal + p->_clustentries;
+		if (p->retired > 0) {
+			/* still allocated, see netmap_obj_shrink() */
+			p->retired--;
+		} else {
+			clust = contigmalloc_domain(p->_clustsize, M_NETMAP,
+			    p->_node, M_NOWAIT | M_ZERO, (size_t)0, -1UL,
+			    p->_huge ? NM_HUGE_SIZE : PAGE_SIZE, 0);
+			if (clust == NULL) {
+				D("Unable to add a cluster to '%s' allocator",
+				    p->name);
+				break;
+			}
+			for (i = p->objtotal; i < lim; i++) {
+				p->lut[i].vaddr = clust;
+				p->lut[i].paddr = vtophys(clust);
+				clust += p->_objsize;
+			}
+		}
+		/* the lowest new index is allocated first */
+		for (i = lim; i > p->objtotal; i--) {
+			p->bitmap[ ((i - 1)>>5) ] |=  ( 1 << ((i - 1) & 31) );
+			p->freelist[p->objfree++] = i - 1;
+		}
+		p->objtotal = lim;
+		p->numclusters++;
+		p->memtotal += p->_clustsize;
+	}
+}
+
+/*
+ * Take out of service the clusters at the end of p whose objects
+ * are all free, down to n objects, with NMA_LOCK held. Their memory
+ * is only released by netmap_obj_release_retired() when the pool
+ * falls out of use, since a device or a sync in progress may still
+ * reference it through indexes put in the rings by userspace.
+ */
+static void
+netmap_obj_shrink(struct netmap_obj_pool *p, u_int n)
+{
+	u_int i, k, lim = p->objtotal;
+
+	netmap_obj_mags_drain(p);
+	/* the first cluster holds the reserved objects */
+	while (lim > p->_clustentries && lim - p->_clustentries >= n) {
+		for (i = lim - p->_clustentries; i < lim; i++) {
+			if (!(p->bitmap[ (i>>5) ] & ( 1 << (i & 31) )))
+				break;
+		}
+		if (i < lim)
+			break;
+		lim -= p->_clustentries;
+	}
+	if (lim == p->objtotal)
+		return;
+	for (i = k = 0; i < p->objfree; i++) {
+		uint32_t j = p->freelist[i];
+
+		if (j < lim)
+			p->freelist[k++] = j;
+		else
+			p->bitmap[ (j>>5) ] &=  ~( 1 << (j & 31) );
+	}
+	p->objfree = k;
+	k = (p->objtotal - lim) / p->_clustentries;
+	p->retired += k;
+	p->numclusters -= k;
+	p->memtotal -= k * p->_clustsize;
+	p->objtotal = lim;
+}
+
+/* free the clusters taken out of service, the pool must be unused */
+static void
+netmap_obj_release_retired(struct netmap_obj_pool *p)
+{
+	u_int i, j, lim = p->objtotal + p->retired * p->_clustentries;
+	char *clust;
+
+	for (i = p->objtotal; i < lim; i += p->_clustentries) {
+		clust = p->lut[i].vaddr;
+		for (j = i; j < i + p->_clustentries; j++)
+			p->lut[j] = p->lut[0];
+		contigfree(clust, p->_clustsize, M_NETMAP);
+	}
+	p->retired = 0;
+}
+
+/*
+ * Grow or shrink the buffer pool of nmd towards *nbufs buffers (0
+ * just reports the current number), and return the actual number in
+ * *nbufs. The pool cannot grow past the buf_max_num parameter, nor
+ * shrink below the buffers in use. The size of the memory region
+ * reported by netmap_mem_get_info() includes the room for growth,
+ * so the mappings of the running processes already cover the new
+ * buffers.
+ */
+int
+netmap_mem_resize(struct netmap_mem_d *nmd, u_int *nbufs)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int n = *nbufs;
+	int i, error = 0;
+
+	if (nmd->ops != &netmap_mem_global_ops)
+		return EOPNOTSUPP;
+	NMA_LOCK(nmd);
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED)) {
+		error = EINVAL;
+		goto out;
+	}
+	if (p->objtotal % p->_clustentries) {
+		/* a cluster was only partly used, see
+		 * netmap_finalize_obj_allocator() */
+		error = ENOMEM;
+		goto out;
+	}
+	if (n == 0)
+		n = p->objtotal;
+	else if (n < p->nummin)
+		n = p->nummin;
+	if (n > p->objtotal)
+		netmap_obj_grow(p, n);
+	else if (n + p->_clustentries <= p->objtotal)
+		netmap_obj_shrink(p, n);
+	nmd->nm_totalsize = 0;
+	for (i = 0; i < NETMAP_POOLS_NR; i++)
+		nmd->nm_totalsize += nmd->pools[i].memtotal;
+	if (netmap_verbose)
+		D("%s: %u buffers, %u free, %u clusters retired", nmd->name,
+			p->objtotal, p->objfree, p->retired);
+	*nbufs = p->objtotal;
+out:
+	NMA_UNLOCK(nmd);
+	return error;
+}
+
 /* call with lock held */
 static int
 netmap_mem_params_changed(struct netmap_obj_params* p)
@@ -1320,9 +1950,13 @@ netmap_mem_params_changed(struct netmap_obj_params* p)
 	int i, rv = 0;
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		if (p[i].last_size != p[i].size || p[i].last_num != p[i].num) {
+		if (p[i].last_size != p[i].size || p[i].last_num != p[i].num ||
+		    p[i].last_huge != p[i].huge ||
+		    p[i].last_max_num != p[i].max_num) {
 			p[i].last_size = p[i].size;
 			p[i].last_num = p[i].num;
+			p[i].last_huge = p[i].huge;
+			p[i].last_max_num = p[i].max_num;
 			rv = 1;
 		}
 	}
@@ -1339,7 +1973,7 @@ netmap_mem_reset_all(struct netmap_mem_d *nmd)
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		netmap_reset_obj_allocator(&nmd->pools[i]);
 	}
-	nmd->flags  &= ~NETMAP_MEM_FINALIZED;
+	nmd->flags  &= ~(NETMAP_MEM_FINALIZED | NETMAP_MEM_HUGE);
 }
 
 static int
@@ -1399,14 +2033,21 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		nmd->pools[i]._node = nmd->nm_node;
 		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
 		if (nmd->lasterr)
 			goto error;
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
 	}
-	/* buffers 0 and 1 are reserved */
-	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
-	nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
+	nmd->flags &= ~NETMAP_MEM_HUGE;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		/* buffers 0 and 1 are reserved */
+		netmap_obj_init_free(&nmd->pools[i],
+			i == NETMAP_BUF_POOL ? 2 : 0);
+		if (nmd->pools[i]._huge)
+			nmd->flags |= NETMAP_MEM_HUGE;
+	}
+	netmap_obj_mags_create(&nmd->pools[NETMAP_BUF_POOL]);
 	nmd->flags |= NETMAP_MEM_FINALIZED;
 
 	if (netmap_verbose)
@@ -1453,6 +2094,8 @@ _netmap_mem_private_new(struct netmap_obj_params *p, int *perr)
 				d->name);
 		d->params[i].num = p[i].num;
 		d->params[i].size = p[i].size;
+		d->params[i].huge = p[i].huge;
+		d->params[i].max_num = p[i].max_num;
 	}
 
 	NMA_LOCK_INIT(d);
@@ -1548,7 +2191,9 @@ netmap_mem2_config(struct netmap_mem_d *nmd)
 		/* already in use, we cannot change the configuration */
 		goto out;
 
-	if (!netmap_mem_params_changed(nmd->params))
+	if (!netmap_mem_params_changed(nmd->params) &&
+	    !((nmd->flags & NETMAP_MEM_FINALIZED) &&
+	      nmd->pools[NETMAP_BUF_POOL]._node != nmd->nm_node))
 		goto out;
 
 	ND("reconfiguring");
@@ -1558,12 +2203,14 @@ netmap_mem2_config(struct netmap_mem_d *nmd)
 		for (i = 0; i < NETMAP_POOLS_NR; i++) {
 			netmap_reset_obj_allocator(&nmd->pools[i]);
 		}
-		nmd->flags &= ~NETMAP_MEM_FINALIZED;
+		nmd->flags &= ~(NETMAP_MEM_FINALIZED | NETMAP_MEM_HUGE);
 	}
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				nmd->params[i].num, nmd->params[i].size);
+				nmd->params[i].num,
+				i == NETMAP_BUF_POOL ? nmd->params[i].max_num : 0,
+				nmd->params[i].size, nmd->params[i].huge);
 		if (nmd->lasterr)
 			goto out;
 	}
@@ -1846,8 +2493,10 @@ netmap_mem2_deref(struct netmap_mem_d *nmd)
 {
 
 	nmd->active--;
-	if (!nmd->active)
+	if (!nmd->active) {
 		nmd->nm_grp = -1;
+		nmd->flags &= ~NETMAP_MEM_NODESET;
+	}
 	if (netmap_verbose)
 		D("active = %d", nmd->active);
 
@@ -1868,12 +2517,18 @@ struct netmap_mem_ops netmap_mem_global_ops = {
 	.nmd_rings_delete = netmap_mem2_rings_delete
 };
 
+/*
+ * Copy the pools info of nmd to the user buffer of nmr, as large as
+ * struct netmap_pools_info was in NETMAP_API version.
+ */
 int
-netmap_mem_pools_info_get(struct nmreq *nmr, struct netmap_mem_d *nmd)
+netmap_mem_pools_info_get(struct nmreq *nmr, struct netmap_mem_d *nmd,
+		u_int version)
 {
 	uintptr_t *pp = (uintptr_t *)&nmr->nr_arg1;
 	struct netmap_pools_info *upi = (struct netmap_pools_info *)(*pp);
 	struct netmap_pools_info pi;
+	size_t len = sizeof(pi);
 	unsigned int memsize;
 	uint16_t memid;
 	int ret;
@@ -1898,9 +2553,15 @@ netmap_mem_pools_info_get(struct nmreq *nmr, struct netmap_mem_d *nmd)
 			     nmd->pools[NETMAP_RING_POOL].memtotal;
 	pi.buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
 	pi.buf_pool_objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	pi.buf_pool_maxtotal = nmd->pools[NETMAP_BUF_POOL]._maxtotal;
+
+	pi.numa_node = (nmd->flags & NETMAP_MEM_FINALIZED) ?
+		nmd->pools[NETMAP_BUF_POOL]._node : nmd->nm_node;
 	NMA_UNLOCK(nmd);
 
-	ret = copyout(&pi, upi, sizeof(pi));
+	if (version < 12)
+		len = offsetof(struct netmap_pools_info, numa_node);
+	ret = copyout(&pi, upi, len);
 	if (ret) {
 		return ret;
 	}
@@ -2314,6 +2975,7 @@ netmap_mem_pt_guest_create(nm_memid_t mem_id)
 
 	ptnmd->up.ops = &netmap_mem_pt_guest_ops;
 	ptnmd->host_mem_id = mem_id;
+	ptnmd->up.nm_node = -1;
 	ptnmd->pt_ifs = NULL;
 
         /* Assign new id in the guest (We have the lock) */
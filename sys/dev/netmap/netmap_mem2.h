@@ -64,9 +64,10 @@
  * per cluster).
  *
  * Objects are aligned to the cache line (64 bytes) rounding up object
- * sizes when needed. A bitmap contains the state of each object.
- * Allocation scans the bitmap; this is done only on attach, so we are not
- * too worried about performance
+ * sizes when needed. A bitmap contains the state of each object,
+ * and a stack holds the indexes of the free ones, so that allocating
+ * and freeing take constant time however full the pool is. Buffers
+ * for the rings and the extra buffers are allocated in batches.
  *
  * For each allocator we can define (thorugh sysctl) the size and
  * number of each object. Memory is allocated at the first use of a
@@ -147,6 +148,8 @@ void	   netmap_mem_delete(struct netmap_mem_d *);
 struct netmap_mem_d* __netmap_mem_get(struct netmap_mem_d *, const char *, int);
 void __netmap_mem_put(struct netmap_mem_d *, const char *, int);
 struct netmap_mem_d* netmap_mem_find(nm_memid_t);
+int netmap_mem_set_node(struct netmap_mem_d *, int node);
+int netmap_mem_resize(struct netmap_mem_d *, u_int *nbufs);
 
 #ifdef WITH_PTNETMAP_GUEST
 struct netmap_mem_d* netmap_mem_pt_guest_new(struct ifnet *,
@@ -157,10 +160,24 @@ struct netmap_mem_d* netmap_mem_pt_guest_attach(struct ptnetmap_memdev *, uint16
 int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 #endif /* WITH_PTNETMAP_GUEST */
 
-int netmap_mem_pools_info_get(struct nmreq *, struct netmap_mem_d *);
+int netmap_mem_pools_info_get(struct nmreq *, struct netmap_mem_d *,
+		u_int version);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
+#define NETMAP_MEM_HUGE		0x10	/* some clusters are huge pages */
+
+/*
+ * Size of the huge pages backing the pools configured with the
+ * *_huge parameters, which OSes may map with a single TLB entry.
+ */
+#if defined(linux) && defined(PMD_SIZE)
+#define NM_HUGE_SIZE		PMD_SIZE
+#else
+#define NM_HUGE_SIZE		(2 * 1024 * 1024)
+#endif
+ssize_t netmap_mem_huge_ofs(struct netmap_mem_d *);
+int	netmap_mem_ofs_is_huge(struct netmap_mem_d *, vm_ooffset_t);
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
 
@@ -668,6 +668,7 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 		int free_slots, busy, sent = 0, m;
 		u_int lim = kring->nkr_num_slots - 1;
 		struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
+		struct nm_copy_ctx cc;
 		u_int max_len = NETMAP_BUF_SIZE(mkring->na);
 
 		mlim = mkring->nkr_num_slots - 1;
@@ -697,6 +698,7 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			m = free_slots;
 		}
 
+		nm_copy_begin(&cc);
 		for ( ; m; m--) {
 			struct netmap_slot *s = &ring->slot[beg];
 			struct netmap_slot *ms = &mring->slot[i];
@@ -710,13 +712,19 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 				copy_len = max_len;
 			}
 
-			memcpy(dst, src, copy_len);
+			/* the copy engine rounds up to 64 bytes */
+			if (likely(((copy_len + 63) & ~63) <= max_len &&
+			    ((copy_len + 63) & ~63) <= NETMAP_BUF_SIZE(kring->na)))
+				nm_copy(&cc, src, dst, copy_len);
+			else
+				memcpy(dst, src, copy_len);
 			ms->len = copy_len;
 			sent++;
 
 			beg = nm_next(beg, lim);
 			i = nm_next(i, mlim);
 		}
+		nm_copy_end(&cc);
 		mb();
 		mkring->nr_hwtail = i;
 	out:
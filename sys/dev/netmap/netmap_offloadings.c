@@ -62,44 +62,133 @@
 
 
 
+/*
+ * Checksums are computed as 64 bit sums of words in memory order,
+ * folded with nm_csum_fold64(), so that the copy of the payload can
+ * compute its sum on the way (see nm_csum_copy()). Data at an odd
+ * offset of the checksummed area contributes with its bytes swapped.
+ */
+static inline uint64_t
+nm_csum_add(const uint8_t *p, u_int len, uint64_t sum)
+{
+	uint16_t w;
+
+	for (; len >= 2; len -= 2, p += 2) {
+		memcpy(&w, p, 2);
+		sum += w;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
+	}
+	return sum;
+}
+
+static inline uint64_t
+nm_csum_odd(uint64_t sum)
+{
+	uint16_t f = nm_csum_fold64(sum);
+
+	return (uint16_t)((f << 8) | (f >> 8));
+}
+
+/*
+ * Partial checksums of the headers of a GSO packet, computed once for
+ * all its segments by gso_tmpl_init(). The fields that change from a
+ * segment to the next are left out, gso_fix_segment() adds them.
+ */
+struct gso_tmpl {
+	uint64_t	ip_sum;		/* IPv4 header */
+	uint64_t	l4_sum;		/* pseudo header and TCP/UDP header */
+	uint32_t	tcp_seq;	/* host byte order */
+	uint16_t	ip_id;		/* host byte order */
+};
+
+/* 'pkt' points to the IP header of the GSO packet, followed by
+ * 'l4hlen' bytes of TCP or UDP header.
+ */
+static void
+gso_tmpl_init(struct gso_tmpl *t, const uint8_t *pkt, u_int ipv4,
+		u_int iphlen, u_int tcp, u_int l4hlen)
+{
+	uint8_t h[60];	/* the longest IPv4 or TCP header */
+	uint16_t proto;
+
+	if (ipv4) {
+		const struct nm_iphdr *iph = (const struct nm_iphdr *)pkt;
+
+		memcpy(h, pkt, iphlen);
+		bzero(h + 2, 4);	/* total length, identification */
+		bzero(h + 10, 2);	/* checksum */
+		t->ip_sum = nm_csum_add(h, iphlen, 0);
+		t->ip_id = be16toh(iph->id);
+		t->l4_sum = nm_csum_add(pkt + 12, 8, 0); /* addresses */
+		proto = iph->protocol;
+	} else {
+		t->ip_sum = 0;
+		t->ip_id = 0;
+		t->l4_sum = nm_csum_add(pkt + 8, 32, 0); /* addresses */
+		proto = ((const struct nm_ipv6hdr *)pkt)->nexthdr;
+	}
+	t->l4_sum += htobe16(proto);
+
+	memcpy(h, pkt + iphlen, l4hlen);
+	if (tcp) {
+		t->tcp_seq = be32toh(
+			((const struct nm_tcphdr *)(pkt + iphlen))->seq);
+		bzero(h + 4, 4);	/* sequence number */
+		bzero(h + 12, 2);	/* data offset and flags */
+		bzero(h + 16, 2);	/* checksum */
+	} else {
+		t->tcp_seq = 0;
+		bzero(h + 4, 4);	/* length and checksum */
+	}
+	t->l4_sum = nm_csum_add(h, l4hlen, t->l4_sum);
+}
+
 /* This routine is called by bdg_mismatch_datapath() when it finishes
  * accumulating bytes for a segment, in order to fix some fields in the
  * segment headers (which still contain the same content as the header
  * of the original GSO packet). 'pkt' points to the beginning of the IP
  * header of the segment, while 'len' is the length of the IP packet.
+ * 'payload_sum' is the sum of the TCP/UDP payload of the segment, the
+ * checksums are completed from the ones of the template.
  */
 static void
-gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
-		u_int idx, u_int segmented_bytes, u_int last_segment)
+gso_fix_segment(const struct gso_tmpl *t, uint8_t *pkt, size_t len,
+		u_int ipv4, u_int iphlen, u_int tcp, u_int idx,
+		u_int segmented_bytes, u_int last_segment, uint64_t payload_sum)
 {
 	struct nm_iphdr *iph = (struct nm_iphdr *)(pkt);
 	struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(pkt);
-	uint16_t *check = NULL;
-	uint8_t *check_data = NULL;
+	uint16_t l4len = htobe16(len - iphlen);
+	/* the length is also in the pseudo header */
+	uint64_t sum = t->l4_sum + payload_sum + l4len;
+	uint16_t *check;
 
 	if (ipv4) {
-		/* Set the IPv4 "Total Length" field. */
+		/* Set the IPv4 "Total Length" and "Identification" fields. */
 		iph->tot_len = htobe16(len);
-		ND("ip total length %u", be16toh(ip->tot_len));
-
-		/* Set the IPv4 "Identification" field. */
-		iph->id = htobe16(be16toh(iph->id) + idx);
-		ND("ip identification %u", be16toh(iph->id));
+		iph->id = htobe16(t->ip_id + idx);
+		ND("ip total length %u id %u", be16toh(iph->tot_len),
+			be16toh(iph->id));
 
-		/* Compute and insert the IPv4 header checksum. */
-		iph->check = 0;
-		iph->check = nm_os_csum_ipv4(iph);
+		/* Complete the IPv4 header checksum. */
+		iph->check = (uint16_t)~nm_csum_fold64(t->ip_sum +
+				iph->tot_len + iph->id);
 		ND("IP csum %x", be16toh(iph->check));
 	} else {
 		/* Set the IPv6 "Payload Len" field. */
-		ip6h->payload_len = htobe16(len-iphlen);
+		ip6h->payload_len = l4len;
 	}
 
 	if (tcp) {
 		struct nm_tcphdr *tcph = (struct nm_tcphdr *)(pkt + iphlen);
+		uint16_t w;
 
 		/* Set the TCP sequence number. */
-		tcph->seq = htobe32(be32toh(tcph->seq) + segmented_bytes);
+		tcph->seq = htobe32(t->tcp_seq + segmented_bytes);
 		ND("tcp seq %u", be32toh(tcph->seq));
 
 		/* Zero the PSH and FIN TCP flags if this is not the last
@@ -108,24 +197,22 @@ gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
 			tcph->flags &= ~(0x8 | 0x1);
 		ND("last_segment %u", last_segment);
 
+		memcpy(&w, &tcph->doff, 2);
+		sum += tcph->seq + w;
 		check = &tcph->check;
-		check_data = (uint8_t *)tcph;
 	} else { /* UDP */
 		struct nm_udphdr *udph = (struct nm_udphdr *)(pkt + iphlen);
 
 		/* Set the UDP 'Length' field. */
-		udph->len = htobe16(len-iphlen);
-
+		udph->len = l4len;
+		sum += l4len;
 		check = &udph->check;
-		check_data = (uint8_t *)udph;
 	}
 
-	/* Compute and insert TCP/UDP checksum. */
-	*check = 0;
-	if (ipv4)
-		nm_os_csum_tcpudp_ipv4(iph, check_data, len-iphlen, check);
-	else
-		nm_os_csum_tcpudp_ipv6(ip6h, check_data, len-iphlen, check);
+	/* Complete the TCP/UDP checksum. */
+	*check = (uint16_t)~nm_csum_fold64(sum);
+	if (!tcp && *check == 0)
+		*check = 0xffff; /* 0 means no checksum */
 
 	ND("TCP/UDP csum %x", be16toh(*check));
 }
@@ -152,7 +239,8 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		      struct netmap_vp_adapter *dst_na,
 		      const struct nm_bdg_fwd *ft_p,
 		      struct netmap_ring *dst_ring,
-		      u_int *j, u_int lim, u_int *howmany)
+		      u_int *j, u_int lim, u_int *howmany,
+		      struct nm_copy_ctx *cc)
 {
 	struct netmap_slot *dst_slot = NULL;
 	struct nm_vnet_hdr *vh = NULL;
@@ -256,6 +344,9 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		/* Is this a TCP or an UDP GSO packet? */
 		u_int tcp = ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
 				== VIRTIO_NET_HDR_GSO_UDP) ? 0 : 1;
+		/* Checksums of the headers, and of the current payload. */
+		struct gso_tmpl tmpl;
+		uint64_t payload_sum = 0;
 
 		/* Segment the GSO packet contained into the input slots (frags). */
 		for (;;) {
@@ -301,6 +392,10 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 						}
 						ipv4 = 1;
 						iphlen = 4 * (iph->version_ihl & 0x0F);
+						if (iphlen < 20) {
+							RD(3, "Bad IPv4 header, dropping");
+							return;
+						}
 						break;
 					}
 					case 0x86DD:  /* IPv6 */
@@ -333,6 +428,10 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 					}
 					gso_hdr_len = ethhlen + iphlen +
 						      4 * (tcph->doff >> 4);
+					if ((tcph->doff >> 4) < 5) {
+						RD(3, "Bad TCP header, dropping");
+						return;
+					}
 				} else {
 					gso_hdr_len = ethhlen + iphlen + 8; /* UDP */
 				}
@@ -344,6 +443,8 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 
 				ND(3, "gso_hdr_len %u gso_mtu %d", gso_hdr_len,
 								   dst_na->mfs);
+				gso_tmpl_init(&tmpl, gso_hdr + ethhlen, ipv4,
+					iphlen, tcp, gso_hdr_len - ethhlen - iphlen);
 
 				/* Advance source pointers. */
 				src += gso_hdr_len;
@@ -361,13 +462,22 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			if (gso_bytes == 0) {
 				memcpy(dst, gso_hdr, gso_hdr_len);
 				gso_bytes = gso_hdr_len;
+				payload_sum = 0;
 			}
 
-			/* Fill in data and update source and dest pointers. */
+			/* Fill in data and update source and dest pointers,
+			 * computing the checksum of the data on the way.
+			 * The TCP/UDP header starts at an even offset.
+			 */
 			copy = src_len;
 			if (gso_bytes + copy > dst_na->mfs)
 				copy = dst_na->mfs - gso_bytes;
-			memcpy(dst + gso_bytes, src, copy);
+			if (gso_bytes & 1)
+				payload_sum += nm_csum_odd(nm_csum_copy(cc,
+					src, dst + gso_bytes, copy, 0));
+			else
+				payload_sum = nm_csum_copy(cc, src,
+					dst + gso_bytes, copy, payload_sum);
 			gso_bytes += copy;
 			src += copy;
 			src_len -= copy;
@@ -379,10 +489,12 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				/* After raw segmentation, we must fix some header
 				 * fields and compute checksums, in a protocol dependent
 				 * way. */
-				gso_fix_segment(dst + ethhlen, gso_bytes - ethhlen,
+				gso_fix_segment(&tmpl, dst + ethhlen,
+						gso_bytes - ethhlen,
 						ipv4, iphlen, tcp,
 						gso_idx, segmented_bytes,
-						src_len == 0 && ft_p + 1 == ft_end);
+						src_len == 0 && ft_p + 1 == ft_end,
+						payload_sum);
 
 				ND("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				dst_slot->len = gso_bytes;
@@ -413,8 +525,10 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	} else {
 		/* Address of a checksum field into a destination slot. */
 		uint16_t *check = NULL;
-		/* Accumulator for an unfolded checksum. */
-		rawsum_t csum = 0;
+		/* Accumulator for an unfolded checksum (see nm_csum_add()). */
+		uint64_t csum = 0;
+		/* Bytes covered by the checksum so far. */
+		size_t csum_bytes = 0;
 
 		/* Process a non-GSO packet. */
 
@@ -428,26 +542,39 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		}
 
 		while (ft_p != ft_end) {
-			/* Init/update the packet checksum if needed. */
-			if (vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-				if (!dst_slots)
-					csum = nm_os_csum_raw(src + vh->csum_start,
-								src_len - vh->csum_start, 0);
-				else
-					csum = nm_os_csum_raw(src, src_len, csum);
-			}
-
-			/* Round to a multiple of 64 */
-			src_len = (src_len + 63) & ~63;
+			/* Bytes of this fragment not in the checksum. */
+			size_t skip = (check && !dst_slots) ? vh->csum_start : 0;
 
 			if (ft_p->ft_flags & NS_INDIRECT) {
-				if (copyin(src, dst, src_len)) {
+				nm_copy_end(cc); /* copyin may sleep */
+				/* Round to a multiple of 64 */
+				if (copyin(src, dst, (src_len + 63) & ~63)) {
 					/* Invalid user pointer, pretend len is 0. */
 					dst_len = 0;
+				} else if (check) {
+					uint64_t sum = nm_csum_add(dst + skip,
+							src_len - skip, 0);
+
+					csum += (csum_bytes & 1) ?
+						nm_csum_odd(sum) : sum;
 				}
+			} else if (!check) {
+				nm_copy(cc, src, dst, src_len);
 			} else {
-				memcpy(dst, src, (int)src_len);
+				/* Copy the checksummed part of the packet
+				 * computing its checksum.
+				 */
+				memcpy(dst, src, skip);
+				if (csum_bytes & 1)
+					csum += nm_csum_odd(nm_csum_copy(cc,
+						src + skip, dst + skip,
+						src_len - skip, 0));
+				else
+					csum = nm_csum_copy(cc, src + skip,
+						dst + skip, src_len - skip, csum);
 			}
+			if (check)
+				csum_bytes += src_len - skip;
 			dst_slot->len = dst_len;
 			dst_slots++;
 
@@ -462,9 +589,11 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			dst_len = src_len = ft_p->ft_len;
 		}
 
-		/* Finalize (fold) the checksum if needed. */
-		if (check && vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-			*check = nm_os_csum_fold(csum);
+		/* Finalize (fold) the checksum if needed. The field holds
+		 * the sum of the pseudo header, which is included in csum.
+		 */
+		if (check) {
+			*check = (uint16_t)~nm_csum_fold64(csum);
 		}
 		ND(3, "using %u dst_slots", dst_slots);
 
@@ -488,3 +617,304 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	*j = j_cur;
 	*howmany -= dst_slots;
 }
+
+/*
+ * Receive side coalescing, for packets going from a port without
+ * virtio-net headers (e.g. a NIC) to one that accepts them (e.g. a VM).
+ * In-order TCP segments of the same flow, queued one after the other
+ * for the destination, are merged into a single GSO packet, as long
+ * as they only differ in the sequence number and length (and the PSH
+ * flag of the last one). The checksum of each segment is verified
+ * while it is copied, and the GSO packet asks the receiver to complete
+ * the TCP checksum (VIRTIO_NET_HDR_F_NEEDS_CSUM), as a segmentation
+ * offload from that port would do.
+ */
+
+/* A TCP segment looked at by bdg_gro_datapath(). */
+struct gro_seg {
+	const uint8_t	*buf;	/* ethernet header */
+	u_int		iphlen;
+	u_int		hlen;	/* ethernet, IP and TCP headers */
+	u_int		plen;	/* payload */
+	uint32_t	seq;	/* host byte order */
+	uint8_t		flags;	/* TCP flags */
+};
+
+#define GRO_TCP_PSH	0x08
+#define GRO_TCP_ACK	0x10
+
+/* Parse the TCP segment of a single fragment IPv4 or IPv6 packet.
+ * Returns 0 if the packet cannot be coalesced.
+ */
+static int
+gro_parse(const struct nm_bdg_fwd *ft_p, struct gro_seg *s)
+{
+	const uint8_t *buf = ft_p->ft_buf;
+	const struct nm_tcphdr *tcph;
+	u_int len = ft_p->ft_len, iplen, thlen;
+	uint16_t ethertype;
+
+	if (ft_p->ft_frags != 1 || (ft_p->ft_flags & NS_INDIRECT) ||
+	    len < 14 + 40 + 20)
+		return 0;
+	memcpy(&ethertype, buf + 12, 2);
+	if (ethertype == htobe16(0x0800)) {
+		const struct nm_iphdr *iph =
+			(const struct nm_iphdr *)(buf + 14);
+
+		s->iphlen = 4 * (iph->version_ihl & 0x0F);
+		iplen = be16toh(iph->tot_len);
+		/* no fragments, but DF is fine */
+		if ((iph->version_ihl >> 4) != 4 || s->iphlen < 20 ||
+		    iph->protocol != 6 || (iph->frag_off & htobe16(0x3fff)))
+			return 0;
+	} else if (ethertype == htobe16(0x86DD)) {
+		const struct nm_ipv6hdr *ip6h =
+			(const struct nm_ipv6hdr *)(buf + 14);
+
+		s->iphlen = 40;
+		iplen = 40 + be16toh(ip6h->payload_len);
+		/* no extension headers */
+		if ((ip6h->priority_version >> 4) != 6 || ip6h->nexthdr != 6)
+			return 0;
+	} else {
+		return 0;
+	}
+	if (14 + iplen > len || s->iphlen + 20 > iplen)
+		return 0;
+	tcph = (const struct nm_tcphdr *)(buf + 14 + s->iphlen);
+	thlen = 4 * (tcph->doff >> 4);
+	if (thlen < 20 || s->iphlen + thlen >= iplen)
+		return 0; /* bad header, or no payload */
+	/* only plain data segments */
+	if ((tcph->flags & ~GRO_TCP_PSH) != GRO_TCP_ACK)
+		return 0;
+	s->buf = buf;
+	s->hlen = 14 + s->iphlen + thlen;
+	s->plen = 14 + iplen - s->hlen;
+	s->seq = be32toh(tcph->seq);
+	s->flags = tcph->flags;
+	return 1;
+}
+
+/* Can segment 's' follow the payload of 'first', which is 'bytes' long,
+ * in the same GSO packet?
+ */
+static int
+gro_match(const struct gro_seg *first, const struct gro_seg *s, u_int bytes)
+{
+	const uint8_t *a = first->buf, *b = s->buf;
+	u_int ipoff = 14 + first->iphlen;
+
+	if (s->hlen != first->hlen || s->iphlen != first->iphlen ||
+	    s->plen > first->plen || s->seq != first->seq + bytes)
+		return 0;
+	/* ethernet header */
+	if (memcmp(a, b, 14))
+		return 0;
+	/* IP header, but the length, id and checksum */
+	if (first->iphlen == 40) {
+		if (memcmp(a + 14, b + 14, 4) ||
+		    memcmp(a + 14 + 6, b + 14 + 6, 34))
+			return 0;
+	} else if (memcmp(a + 14, b + 14, 2) ||
+		   memcmp(a + 14 + 6, b + 14 + 6, 4) ||
+		   memcmp(a + 14 + 12, b + 14 + 12, first->iphlen - 12)) {
+		return 0;
+	}
+	/* TCP ports, ack, data offset, window and options */
+	return !memcmp(a + ipoff, b + ipoff, 4) &&
+	       !memcmp(a + ipoff + 8, b + ipoff + 8, 5) &&
+	       !memcmp(a + ipoff + 14, b + ipoff + 14, 2) &&
+	       !memcmp(a + ipoff + 20, b + ipoff + 20,
+			first->hlen - ipoff - 20);
+}
+
+/* Destination slots filled by bdg_gro_datapath(). */
+struct gro_dst {
+	struct netmap_adapter *na;
+	struct netmap_ring *ring;
+	u_int	j, lim;
+	u_int	slots;		/* full slots */
+	u_int	len;		/* bytes in slot j */
+	u_int	bufsize;
+};
+
+/* Append 'len' bytes to the destination and return their sum. */
+static uint64_t
+gro_copy(struct gro_dst *g, const uint8_t *src, u_int len,
+		struct nm_copy_ctx *cc)
+{
+	uint64_t sum = 0;
+	u_int done = 0;
+
+	while (len > 0) {
+		u_int copy = g->bufsize - g->len;
+		uint64_t s;
+
+		if (copy == 0) {
+			g->j = nm_next(g->j, g->lim);
+			g->slots++;
+			g->len = 0;
+			copy = g->bufsize;
+		}
+		if (copy > len)
+			copy = len;
+		s = nm_csum_copy(cc, src,
+			(uint8_t *)NMB(g->na, &g->ring->slot[g->j]) + g->len,
+			copy, 0);
+		sum += (done & 1) ? nm_csum_odd(s) : s;
+		g->len += copy;
+		src += copy;
+		done += copy;
+		len -= copy;
+	}
+	return sum;
+}
+
+/* Sum of the TCP pseudo header of segment 's', but the length. */
+static uint64_t
+gro_pseudo_sum(const struct gro_seg *s)
+{
+	const uint8_t *iph = s->buf + 14;
+
+	return htobe16(6) + (s->iphlen == 40 ?
+		nm_csum_add(iph + 8, 32, 0) : nm_csum_add(iph + 12, 8, 0));
+}
+
+/*
+ * Coalesce the unicast packet ft_p, coming from a port with
+ * virt_hdr_len 0 and going to dst_na (virt_hdr_len > 0), with the packets that follow it in its
+ * queue, starting at index *next of ft, up to max_segs segments.
+ * On success the GSO packet is in dst_ring starting at slot *j,
+ * *j, *howmany and *next are updated and the number of packets used
+ * is returned. Returns 0, with nothing changed, if ft_p cannot be
+ * coalesced with the next packet.
+ */
+u_int
+bdg_gro_datapath(struct netmap_vp_adapter *dst_na,
+		 const struct nm_bdg_fwd *ft, const struct nm_bdg_fwd *ft_p,
+		 u_int *next, u_int max_segs,
+		 struct netmap_ring *dst_ring,
+		 u_int *j, u_int lim, u_int *howmany,
+		 struct nm_copy_ctx *cc)
+{
+	u_int vhlen = dst_na->up.virt_hdr_len;
+	struct gro_seg first, s;
+	struct gro_dst g;
+	struct nm_vnet_hdr *vh;
+	struct nm_tcphdr *tcph;
+	uint8_t *dst;
+	uint64_t pseudo, sum;
+	u_int bytes, segs, n, csum_ok, i;
+	uint8_t flags;
+
+	if (max_segs < 2 || !gro_parse(ft_p, &first) ||
+	    first.flags != GRO_TCP_ACK)
+		return 0;
+	/* look at the next packet before copying anything */
+	n = *next;
+	if (n == NM_FT_NULL || !gro_parse(ft + n, &s) ||
+	    !gro_match(&first, &s, first.plen))
+		return 0;
+
+	g.na = &dst_na->up;
+	g.ring = dst_ring;
+	g.j = *j;
+	g.lim = lim;
+	g.slots = 0;
+	g.len = 0;
+	g.bufsize = NETMAP_BUF_SIZE(&dst_na->up);
+	if (vhlen + first.hlen > g.bufsize ||
+	    vhlen + first.hlen + 2 * first.plen > *howmany * g.bufsize)
+		return 0;
+
+	/* the first segment, with the headers for the GSO packet */
+	dst = NMB(g.na, &dst_ring->slot[g.j]);
+	bzero(dst, vhlen);
+	memcpy(dst + vhlen, first.buf, first.hlen);
+	g.len = vhlen + first.hlen;
+	pseudo = gro_pseudo_sum(&first);
+	sum = nm_csum_add(first.buf + 14 + first.iphlen,
+			first.hlen - 14 - first.iphlen, pseudo);
+	sum += htobe16(first.hlen - 14 - first.iphlen + first.plen);
+	sum += gro_copy(&g, first.buf + first.hlen, first.plen, cc);
+	csum_ok = nm_csum_fold64(sum) == 0xffff;
+	bytes = first.plen;
+	flags = first.flags;
+	segs = 1;
+
+	/* then the payload of the others, while they match */
+	while (csum_ok && segs < max_segs && n != NM_FT_NULL &&
+	       gro_parse(ft + n, &s) && gro_match(&first, &s, bytes)) {
+		struct gro_dst saved = g;
+		u_int thlen = s.hlen - 14 - s.iphlen;
+
+		if (first.hlen - 14 + bytes + s.plen > 65535 ||
+		    vhlen + first.hlen + bytes + s.plen > *howmany * g.bufsize)
+			break;
+		sum = nm_csum_add(s.buf + 14 + s.iphlen, thlen, pseudo);
+		sum += htobe16(thlen + s.plen);
+		sum += gro_copy(&g, s.buf + s.hlen, s.plen, cc);
+		if (nm_csum_fold64(sum) != 0xffff) {
+			g = saved; /* leave it to the receiver */
+			break;
+		}
+		bytes += s.plen;
+		flags |= s.flags;
+		segs++;
+		n = ft[n].ft_next;
+		if (s.plen < first.plen || (s.flags & GRO_TCP_PSH))
+			break; /* the last one */
+	}
+	if (segs == 1) {
+		if (!csum_ok)
+			return 0;
+		/* a single segment, deliver it with a valid checksum */
+		vh = (struct nm_vnet_hdr *)dst;
+		vh->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+	} else {
+		/* fix the headers for the whole payload */
+		if (first.iphlen == 40) {
+			struct nm_ipv6hdr *ip6h =
+				(struct nm_ipv6hdr *)(dst + vhlen + 14);
+
+			ip6h->payload_len = htobe16(first.hlen - 14 - 40 + bytes);
+		} else {
+			struct nm_iphdr *iph =
+				(struct nm_iphdr *)(dst + vhlen + 14);
+
+			iph->tot_len = htobe16(first.hlen - 14 + bytes);
+			iph->check = 0;
+			iph->check = (uint16_t)~nm_csum_fold64(
+				nm_csum_add((uint8_t *)iph, first.iphlen, 0));
+		}
+		tcph = (struct nm_tcphdr *)(dst + vhlen + 14 + first.iphlen);
+		tcph->flags = flags;
+		/* the receiver adds the sum from csum_start */
+		tcph->check = nm_csum_fold64(pseudo +
+			htobe16(first.hlen - 14 - first.iphlen + bytes));
+
+		vh = (struct nm_vnet_hdr *)dst;
+		vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh->gso_type = first.iphlen == 40 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+				VIRTIO_NET_HDR_GSO_TCPV4;
+		vh->hdr_len = first.hlen;
+		vh->gso_size = first.plen;
+		vh->csum_start = 14 + first.iphlen;
+		vh->csum_offset = 16;
+	}
+
+	/* set the lengths and flags of the slots */
+	for (i = 0; i <= g.slots; i++) {
+		struct netmap_slot *slot = &dst_ring->slot[*j];
+
+		slot->len = i < g.slots ? g.bufsize : g.len;
+		slot->flags = ((g.slots + 1) << 8) |
+			(i < g.slots ? NS_MOREFRAG : 0);
+		*j = nm_next(*j, lim);
+	}
+	*howmany -= g.slots + 1;
+	*next = n;
+	return segs;
+}
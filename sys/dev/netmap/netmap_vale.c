@@ -124,9 +124,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 /*
  * system parameters (most of them in netmap_kern.h)
  * NM_BDG_NAME	prefix for switch port names, default "vale"
- * NM_BDG_MAXPORTS	number of ports
- * NM_BRIDGES	max number of switches in the system.
- *	XXX should become a sysctl or tunable
+ * NM_BDG_MAXPORTS	max number of ports of a switch. Switches start
+ *	with room for bridge_ports ports, and grow on demand.
+ * NM_BRIDGES	default number of switches in the system,
+ *	see bridge_num.
  *
  * Switch ports are named valeX:Y where X is the switch name and Y
  * is the port. If Y matches a physical interface name, the port is
@@ -138,16 +139,21 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * In the tx loop, we aggregate traffic in batches to make all operations
  * faster. The batch size is bridge_batch.
  */
-#define NM_BDG_MAXRINGS		16	/* XXX unclear how many. */
 #define NM_BDG_MAXSLOTS		4096	/* XXX same as above */
 #define NM_BRIDGE_RINGSIZE	1024	/* in the device */
-#define NM_BDG_HASH		1024	/* forwarding table entries */
-#define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
-#define NM_MULTISEG		64	/* max size of a chain of bufs */
-/* actual size of the tables */
-#define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NM_MULTISEG)
-/* NM_FT_NULL terminates a list of slots in the ft */
-#define NM_FT_NULL		NM_BDG_BATCH_MAX
+#define NM_BDG_HASH		1024	/* default forwarding table entries */
+#define NM_BDG_HASH_MAX		(1 << 18) /* max forwarding table entries */
+/* destination queues in the scratch area of a bridge with room
+ * for nports ports: all port:rings, plus one broadcast queue per ring
+ */
+#define NM_BDG_NUM_DSTQ(nports)	(((nports) + 1) * NM_BDG_MAXRINGS)
+/* the ports the scratch area at ft is laid out for, stored in the
+ * area itself (in place of a queue) so that the sender always reads
+ * it together with the area
+ */
+#define NM_BDG_FWD_PORTS(ft)	(*(uint32_t *)((ft) + NM_BDG_BATCH_MAX))
+#define NM_BDG_PORTS		8	/* default initial ports per bridge */
+#define NM_BRIDGES_MAX		256	/* max value for bridge_num */
 
 
 /*
@@ -156,9 +162,96 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+/*
+ * bridge_zcopy enables zero-copy forwarding of unicast traffic
+ * between ports that share the same memory allocator: instead of
+ * copying, the buffers of the source tx slot and of the destination
+ * rx slot are swapped (as netmap_pipe_txsync() does).
+ * Senders must then be prepared to find a different buf_idx
+ * (with NS_BUF_CHANGED set) in the tx slots they get back.
+ */
+static int bridge_zcopy = 0;
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_zcopy, CTLFLAG_RW, &bridge_zcopy, 0 , "");
+/*
+ * bridge_fdb_size is the number of entries in the forwarding table
+ * of newly created bridges (rounded down to a power of 2).
+ * Entries not refreshed for bridge_fdb_ageing seconds are
+ * ignored and can be reused (0 means no ageing).
+ */
+static u_int bridge_fdb_size = NM_BDG_HASH;
+static u_int bridge_fdb_ageing = 300;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_fdb_size, CTLFLAG_RW, &bridge_fdb_size, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_fdb_ageing, CTLFLAG_RW, &bridge_fdb_ageing, 0 , "");
+/*
+ * bridge_ports is the number of ports newly created bridges have
+ * room for; the tables are doubled when they fill up, up to
+ * NM_BDG_MAXPORTS. bridge_num is the number of bridges, used
+ * when netmap is loaded (or, on linux, a network namespace is
+ * created).
+ */
+static u_int bridge_ports = NM_BDG_PORTS;
+static u_int bridge_num = NM_BRIDGES;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_ports, CTLFLAG_RW, &bridge_ports, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_num, CTLFLAG_RW, &bridge_num, 0 , "");
+/*
+ * On bridges with priority forwarding (NETMAP_BDG_PRIO), frames
+ * with an 802.1p priority of at least bridge_prio_pcp, or an IP
+ * DSCP of at least bridge_prio_dscp, are high priority.
+ */
+static u_int bridge_prio_pcp = 5;
+static u_int bridge_prio_dscp = 40;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_prio_pcp, CTLFLAG_RW, &bridge_prio_pcp, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_prio_dscp, CTLFLAG_RW, &bridge_prio_dscp, 0 , "");
+/*
+ * Every bridge_poll_period ms a ring may move from the busiest
+ * polling kthread to a less loaded one, if their load differs by
+ * more than bridge_poll_imbalance percent (0 disables rebalancing).
+ */
+static u_int bridge_poll_period = 100;
+static u_int bridge_poll_imbalance = 25;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_poll_period, CTLFLAG_RW, &bridge_poll_period, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_poll_imbalance, CTLFLAG_RW, &bridge_poll_imbalance, 0 , "");
+/*
+ * A NIC attached to a bridge forwards at most bridge_intr_budget
+ * slots per rx notification (0 means no limit), and asks to be called
+ * again if it has more.
+ */
+static u_int bridge_intr_budget = 1024;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_intr_budget, CTLFLAG_RW, &bridge_intr_budget, 0 , "");
+/*
+ * With bridge_fanin, senders to the same rx ring of a VALE port
+ * deliver their packets together, with a single lease and
+ * notification (see nm_bdg_fanin()). Off by default, as it keeps
+ * interrupts off while delivering and moves all the copies of a
+ * group of senders onto one of them.
+ */
+static int bridge_fanin = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_fanin, CTLFLAG_RW, &bridge_fanin, 0 , "");
+/*
+ * Size of the tables of the longest prefix match lookup
+ * (NETMAP_BDG_LPM, see netmap_lpm.c) of newly enabled switches:
+ * groups of 256 entries for the prefixes that do not fit the first
+ * level, and routes.
+ */
+static u_int bridge_lpm_groups = 1024;
+static u_int bridge_lpm_routes = 1024;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_lpm_groups, CTLFLAG_RW, &bridge_lpm_groups, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_lpm_routes, CTLFLAG_RW, &bridge_lpm_routes, 0 , "");
+/* size of the flow table (NETMAP_BDG_FLOW, see netmap_flow.c) of
+ * newly enabled switches
+ */
+static u_int bridge_flow_entries = 65536;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_flow_entries, CTLFLAG_RW, &bridge_flow_entries, 0 , "");
+/*
+ * TCP segments from ports without virtio-net headers to ports that
+ * use them are coalesced into GSO packets of up to bridge_gro_segs
+ * segments (see bdg_gro_datapath(), 0 or 1 disables it).
+ */
+static u_int bridge_gro_segs = 64;
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_gro_segs, CTLFLAG_RW, &bridge_gro_segs, 0 , "");
 SYSEND;
 
 static int netmap_vp_create(struct nmreq *, struct ifnet *,
@@ -167,22 +260,111 @@ static int netmap_vp_reg(struct netmap_adapter *na, int onoff);
 static int netmap_bwrap_reg(struct netmap_adapter *, int onoff);
 
 /*
- * For each output interface, nm_bdg_q is used to construct a list.
- * bq_len is the number of output buffers (we can have coalescing
- * during the copy).
+ * For each output interface, nm_bdg_q is used to construct a list,
+ * and a second one for high priority packets (only used with
+ * NM_BDG_PRIO).
+ * bq_len is the number of output buffers in both lists (we can
+ * have coalescing during the copy).
  */
 struct nm_bdg_q {
 	uint16_t bq_head;
 	uint16_t bq_tail;
+	uint16_t bq_hi_head;
+	uint16_t bq_hi_tail;
 	uint32_t bq_len;	/* number of buffers */
 };
 
-/* XXX revise this */
+/*
+ * Forwarding database entry. The table is organized in buckets of
+ * NM_FDB_WAYS entries (one cache line), and each MAC address can be
+ * stored in either of two buckets (bucketized cuckoo hashing).
+ * Empty entries have mac == 0, used ones have NM_FDB_VALID set.
+ * Static entries (NETMAP_BDG_FDB) never age and are not changed
+ * by learning; they go away with their port.
+ */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac;	/* NM_FDB_VALID | 48 bit address */
+	uint16_t	ports;	/* port where the address was seen */
+	uint16_t	flags;
+#define NM_FDB_STATIC		1
+	uint32_t	ts;	/* time_second of the last update */
+};
+#define NM_FDB_VALID		(1ULL << 63)
+#define NM_FDB_WAYS		4	/* entries per bucket */
+#define NM_FDB_MAX_KICKS	8	/* max cuckoo displacements */
+
+static int nm_fdb_add_static(struct nm_bridge *, uint64_t, u_int);
+static int nm_fdb_del_static(struct nm_bridge *, uint64_t);
+static void nm_bdg_lpm_free(struct nm_bridge *);
+static void nm_bdg_flow_free(struct nm_bridge *);
+
+/*
+ * Multicast group table of a bridge, allocated on first use.
+ * A group has a bitmap of the ports subscribed to it, updated
+ * under mc_lock by the control path and by IGMP/MLD snooping,
+ * and read without locks by the forwarding path.
+ * Groups are found by linear probing from the hash of the address.
+ * Slots are never released: a group without ports is handled as
+ * unregistered (i.e., flooded), and its slot can be taken over by
+ * a new group, in which case a sender racing with the change may
+ * deliver a few packets to the ports of the new group.
+ */
+#define NM_BDG_MCAST_GROUPS	128	/* power of 2, less than 256 */
+#define NM_BDG_MCAST_NWORDS(nports)	(((nports) + 31) / 32)
+#define NM_BDG_MCAST_WORDS	NM_BDG_MCAST_NWORDS(NM_BDG_MAXPORTS)
+
+struct nm_bdg_mgroup {
+	uint32_t	mg_nports;	/* subscribed ports */
+	uint32_t	mg_refs;	/* flow rules, see netmap_bdg_mirror() */
+	uint32_t	mg_ports[NM_BDG_MCAST_WORDS];
+};
+
+struct nm_bdg_mcast {
+	NM_LOCK_T	mc_lock;	/* serializes updates */
+	uint64_t	mc_mac[NM_BDG_MCAST_GROUPS];	/* 0 if free */
+	struct nm_bdg_mgroup *mc_grp[NM_BDG_MCAST_GROUPS];
+};
+
+static int nm_bdg_mcast_update(struct nm_bdg_mcast *, uint64_t, u_int, int);
+
+/*
+ * Egress shaping of a port, per port and per rx ring, with token
+ * buckets measured in slots and driven by nm_os_cycles().
+ * A bucket is kept as the time at which it will be full again, so
+ * taking n slots just moves that time n * tb_cost cycles ahead.
+ * The buckets are updated when the senders reserve slots on the
+ * rings of the port: the ring buckets under the kring lock, the
+ * port bucket under sh_lock. The control path never modifies a
+ * shaper in use, it installs a new one (see nm_bdg_ctl_shape()).
+ */
+#define NM_BDG_SHAPE_BURST	128	/* default bucket size, in slots */
+
+struct nm_bdg_tb {
+	uint64_t	tb_cost;	/* cycles per slot, 0 if unlimited */
+	uint64_t	tb_depth;	/* cycles worth of a full bucket */
+	uint64_t	tb_full;	/* when the bucket is full again */
+	uint32_t	tb_rate;	/* slots per second, for the control path */
+	uint32_t	tb_burst;
+};
+
+struct nm_bdg_shaper {
+	NM_LOCK_T	sh_lock;	/* protects sh_port */
+	struct nm_bdg_tb sh_port;
+	struct nm_bdg_tb sh_ring[NM_BDG_MAXRINGS];
 };
 
+static void nm_bdg_shaper_set(struct netmap_vp_adapter *,
+		struct nm_bdg_shaper *);
+
+/*
+ * The lookup function of the learning bridge returns NM_BDG_MCAST(g)
+ * for traffic to registered group g, which the flush replicates
+ * only to the subscribed ports.
+ */
+#define NM_BDG_MCAST(g)		(NM_BDG_NOPORT + 1 + (g))
+#define NM_BDG_IS_MCAST(d)	((d) > NM_BDG_NOPORT && \
+				 (d) <= NM_BDG_MCAST(NM_BDG_MCAST_GROUPS - 1))
+
 /*
  * nm_bridge is a descriptor for a VALE switch.
  * Interfaces for a bridge are all in bdg_ports[].
@@ -193,9 +375,33 @@ struct nm_hash_ent {
  * The bridge is non blocking on the transmit ports: excess
  * packets are dropped if there is no room on the output port.
  *
- * bdg_lock protects accesses to the bdg_ports array.
- * This is a rw lock (or equivalent).
+ * bdg_ports, bdg_port_index and bdg_ops are only modified by the
+ * control path, under NMG_LOCK. The forwarding path uses a copy,
+ * the struct nm_bdg_dp pointed by bdg_dp, and takes no locks:
+ * see nm_bdg_publish() for how the copy is updated.
+ * bdg_lock serializes the config() callback with changes to
+ * bdg_ops and the removal of ports.
+ */
+
+/*
+ * The view of a bridge used by the forwarding path. Each bridge has
+ * two of them: the control path fills the spare one, switches
+ * bdg_dp to it and waits until no sender can be using the old one,
+ * which becomes the spare.
  */
+struct nm_bdg_dp {
+	u_int		max_ports;	/* size of the arrays below */
+	uint32_t	active_ports;
+	uint16_t	*port_index;
+	struct netmap_vp_adapter **ports;
+	struct netmap_bdg_ops ops;
+	/* the active ports that can receive traffic (in netmap
+	 * mode and not SW_ONLY), used to flood broadcasts
+	 */
+	uint32_t	live_ports;
+	uint16_t	*live_index;
+};
+
 struct nm_bridge {
 	/* XXX what is the proper alignment/layout ? */
 	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ports */
@@ -204,11 +410,13 @@ struct nm_bridge {
 	char		bdg_basename[IFNAMSIZ];
 
 	/* Indexes of active ports (up to active_ports)
-	 * and all other remaining ports.
+	 * and all other remaining ports. Both arrays have
+	 * room for bdg_max_ports entries.
 	 */
-	uint8_t		bdg_port_index[NM_BDG_MAXPORTS];
+	u_int		bdg_max_ports;
+	uint16_t	*bdg_port_index;
 
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	struct netmap_vp_adapter **bdg_ports;
 
 
 	/*
@@ -222,11 +430,35 @@ struct nm_bridge {
 	 */
 	struct netmap_bdg_ops bdg_ops;
 
-	/* the forwarding table, MAC+ports.
-	 * XXX should be changed to an argument to be passed to
-	 * the lookup function, and allocated on attach
+	/* the forwarding table, MAC+ports, allocated when the
+	 * bridge is created. ht_mask selects a bucket, i.e.,
+	 * the table has (ht_mask + 1) * NM_FDB_WAYS entries.
+	 */
+	struct nm_hash_ent *ht;
+	u_int		ht_mask;
+
+	uint32_t	bdg_flags;
+#define NM_BDG_RXHASH	0x1	/* spread flows over the rx rings */
+#define NM_BDG_MCSNOOP	0x2	/* IGMP/MLD snooping */
+#define NM_BDG_PRIO	0x4	/* high priority packets first */
+	/* with NM_BDG_PRIO, high priority packets served for each
+	 * normal one when the destination is short of slots,
+	 * 0 for strict priority
+	 */
+	u_int		bdg_prio_weight;
+
+	/* multicast groups, NULL until first used */
+	struct nm_bdg_mcast * volatile bdg_mcast;
+
+	/* forwarding path view, and the one to fill next */
+	struct nm_bdg_dp * volatile bdg_dp;
+	struct nm_bdg_dp *bdg_dp_spare;
+
+	/* routes, with NETMAP_BDG_LPM. Changed under NMG_LOCK and
+	 * BDG_WLOCK, and only freed when no sender can use them
 	 */
-	struct nm_hash_ent ht[NM_BDG_HASH];
+	struct nm_lpm	*bdg_lpm;
+	struct nm_flow	*bdg_flow;	/* flows, with NETMAP_BDG_FLOW, ditto */
 
 #ifdef CONFIG_NET_NS
 	struct net *ns;
@@ -242,6 +474,267 @@ netmap_bdg_name(struct netmap_vp_adapter *vp)
 	return b->bdg_basename;
 }
 
+/* the routes of b, for the lookup functions in netmap_lpm.c */
+struct nm_lpm *
+netmap_bdg_lpm(struct nm_bridge *b)
+{
+	return b->bdg_lpm;
+}
+
+/* the flows of b, for the lookup functions in netmap_flow.c */
+struct nm_flow *
+netmap_bdg_flow(struct nm_bridge *b)
+{
+	return b->bdg_flow;
+}
+
+/* index of the port of b called name, or -1. Called with NMG_LOCK held */
+int
+netmap_bdg_port(struct nm_bridge *b, const char *name)
+{
+	u_int j;
+
+	NMG_LOCK_ASSERT();
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *vpna =
+			b->bdg_ports[b->bdg_port_index[j]];
+
+		if (!strcmp(vpna->up.name, name))
+			return vpna->bdg_port;
+	}
+	return -1;
+}
+
+
+/*
+ * Senders mark the forwarding path with nkr_bdg_epoch in their
+ * own tx kring, so that they never write to shared memory.
+ * The barrier on entry orders the increment before the load of
+ * bdg_dp, the one on exit completes all the accesses to the view
+ * before the kring is seen as quiescent.
+ */
+static inline void
+nm_bdg_enter(struct netmap_kring *kring)
+{
+	kring->nkr_bdg_epoch++;
+	mb();
+}
+
+static inline void
+nm_bdg_exit(struct netmap_kring *kring)
+{
+	mb();
+	kring->nkr_bdg_epoch++;
+}
+
+/*
+ * A sender stays in the forwarding path for one batch, so we spin
+ * for up to NM_BDG_WAIT_SPINS pauses before sleeping. The control
+ * path holds NMG_LOCK while waiting, and sleeping a clock tick for
+ * each busy ring would stall it for the sum of the ticks.
+ */
+#define NM_BDG_WAIT_SPINS	10000
+
+/* wait until the sender on kring is out of the forwarding path,
+ * if it was in it
+ */
+static void
+nm_bdg_wait_kring(struct netmap_kring *kring)
+{
+	uint32_t e = kring->nkr_bdg_epoch;
+	u_int spins = 0;
+
+	while ((e & 1) && kring->nkr_bdg_epoch == e) {
+		if (spins++ < NM_BDG_WAIT_SPINS)
+			nm_os_pause();
+		else
+			tsleep(kring, 0, "NM_BDG_WAIT", 1);
+	}
+}
+
+/* wait until the senders on the tx rings of the ports in
+ * view dp are out of the forwarding path, if they were in it
+ */
+static void
+nm_bdg_wait_senders(struct nm_bdg_dp *dp)
+{
+	u_int j;
+
+	for (j = 0; j < dp->active_ports; j++) {
+		struct netmap_vp_adapter *vpna = dp->ports[dp->port_index[j]];
+		struct netmap_adapter *na;
+		int i, n;
+
+		if (vpna == NULL)
+			continue;
+		na = &vpna->up;
+		if (na->tx_rings == NULL)
+			continue; /* no krings, no senders */
+		n = netmap_real_rings(na, NR_TX);
+		for (i = 0; i < n; i++)
+			nm_bdg_wait_kring(&na->tx_rings[i]);
+	}
+}
+
+/* the same, for the lookup modules that recycle their tables.
+ * Called with NMG_LOCK held, may sleep.
+ */
+void
+netmap_bdg_wait_senders(struct nm_bridge *b)
+{
+	NMG_LOCK_ASSERT();
+	if (b->bdg_dp != NULL)
+		nm_bdg_wait_senders(b->bdg_dp);
+}
+
+/*
+ * Make the changes to bdg_ports, bdg_port_index and bdg_ops,
+ * or to the netmap mode of a port, visible to the forwarding path.
+ * When this returns, no sender can reference a port or a callback
+ * which has been removed, or the rings of a port no longer in
+ * netmap mode.
+ * Must be called with NMG_LOCK held and no other lock, as it
+ * may sleep.
+ */
+static void
+nm_bdg_publish(struct nm_bridge *b)
+{
+	struct nm_bdg_dp *old = b->bdg_dp, *dp = b->bdg_dp_spare;
+	u_int i, n = b->bdg_max_ports;
+
+	NMG_LOCK_ASSERT();
+	/* the spare has the same size as the tables, see
+	 * nm_bdg_tables_resize()
+	 */
+	dp->active_ports = b->bdg_active_ports;
+	memcpy(dp->port_index, b->bdg_port_index, n * sizeof(dp->port_index[0]));
+	memcpy(dp->ports, b->bdg_ports, n * sizeof(dp->ports[0]));
+	dp->ops = b->bdg_ops;
+	dp->live_ports = 0;
+	for (i = 0; i < b->bdg_active_ports; i++) {
+		struct netmap_vp_adapter *vpna =
+			b->bdg_ports[b->bdg_port_index[i]];
+
+		if (nm_netmap_on(&vpna->up) &&
+				!(vpna->up.na_flags & NAF_SW_ONLY))
+			dp->live_index[dp->live_ports++] = vpna->bdg_port;
+	}
+	wmb(); /* fill the view before publishing it */
+	b->bdg_dp = dp;
+	mb();
+	/* senders may still use the old view, and new ports
+	 * may have picked it up before the switch
+	 */
+	nm_bdg_wait_senders(old);
+	nm_bdg_wait_senders(dp);
+	b->bdg_dp_spare = old;
+}
+
+/* initial number of ports of a bridge, from bridge_ports */
+static u_int
+nm_bdg_init_ports(void)
+{
+	if (bridge_ports < 2)
+		bridge_ports = 2;
+	else if (bridge_ports > NM_BDG_MAXPORTS)
+		bridge_ports = NM_BDG_MAXPORTS;
+	return bridge_ports;
+}
+
+/* allocate a forwarding path view for nports ports */
+static struct nm_bdg_dp *
+nm_bdg_dp_alloc(u_int nports)
+{
+	struct nm_bdg_dp *dp;
+
+	dp = nm_os_malloc(sizeof(*dp) + nports * (sizeof(dp->ports[0]) +
+		sizeof(dp->port_index[0]) + sizeof(dp->live_index[0])));
+	if (dp == NULL)
+		return NULL;
+	dp->max_ports = nports;
+	dp->ports = (struct netmap_vp_adapter **)(dp + 1);
+	dp->port_index = (uint16_t *)(dp->ports + nports);
+	dp->live_index = dp->port_index + nports;
+	return dp;
+}
+
+/*
+ * Resize the port tables of bridge b to nports entries, keeping
+ * the current ports, and publish them. The scratch areas of the
+ * ports must already be large enough (see nm_bdg_fwd_resize()).
+ * Also used to create the tables of a new bridge.
+ */
+static int
+nm_bdg_tables_resize(struct nm_bridge *b, u_int nports)
+{
+	struct netmap_vp_adapter **ports;
+	uint16_t *port_index;
+	struct nm_bdg_dp *dp, *spare;
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+	ports = nm_os_malloc(nports * (sizeof(*ports) + sizeof(*port_index)));
+	dp = nm_bdg_dp_alloc(nports);
+	spare = nm_bdg_dp_alloc(nports);
+	if (ports == NULL || dp == NULL || spare == NULL) {
+		if (ports)
+			nm_os_free(ports);
+		if (dp)
+			nm_os_free(dp);
+		if (spare)
+			nm_os_free(spare);
+		return ENOMEM;
+	}
+	port_index = (uint16_t *)(ports + nports);
+	for (i = 0; i < b->bdg_max_ports; i++) {
+		ports[i] = b->bdg_ports[i];
+		port_index[i] = b->bdg_port_index[i];
+	}
+	for (; i < nports; i++)
+		port_index[i] = i;
+	/* the old arrays are only used by the control path */
+	if (b->bdg_ports)
+		nm_os_free(b->bdg_ports);
+	b->bdg_ports = ports;
+	b->bdg_port_index = port_index;
+	b->bdg_max_ports = nports;
+
+	/* the old spare is not in use, the old view will be
+	 * once we publish the new one
+	 */
+	if (b->bdg_dp_spare)
+		nm_os_free(b->bdg_dp_spare);
+	b->bdg_dp_spare = dp;
+	if (b->bdg_dp == NULL) {
+		/* new bridge, no senders */
+		b->bdg_dp = spare;
+		spare = NULL;
+	}
+	nm_bdg_publish(b);
+	if (spare) {
+		nm_os_free(b->bdg_dp_spare);
+		b->bdg_dp_spare = spare;
+	}
+	return 0;
+}
+
+/* release the tables of a bridge without ports */
+static void
+nm_bdg_tables_free(struct nm_bridge *b)
+{
+	if (b->bdg_ports)
+		nm_os_free(b->bdg_ports);
+	if (b->bdg_dp)
+		nm_os_free(b->bdg_dp);
+	if (b->bdg_dp_spare)
+		nm_os_free(b->bdg_dp_spare);
+	b->bdg_ports = NULL;
+	b->bdg_port_index = NULL;
+	b->bdg_dp = b->bdg_dp_spare = NULL;
+	b->bdg_max_ports = 0;
+}
+
+
 
 #ifndef CONFIG_NET_NS
 /*
@@ -250,38 +743,118 @@ netmap_bdg_name(struct netmap_vp_adapter *vp)
  * by an exclusive lock.
  */
 static struct nm_bridge *nm_bridges;
+static u_int nm_num_bridges;
 #endif /* !CONFIG_NET_NS */
 
 
 /*
- * this is a slightly optimized copy routine which rounds
- * to multiple of 64 bytes and is often faster than dealing
- * with other odd sizes. We assume there is enough room
- * in the source and destination buffers.
- *
- * XXX only for multiples of 64 bytes, non overlapped.
+ * Allocate the forwarding table of a new bridge, using
+ * bridge_fdb_size entries rounded down to a power of 2.
+ * The table can take megabytes, so it is not physically
+ * contiguous; called with NMG_LOCK held, which may sleep.
  */
-static inline void
-pkt_copy(void *_src, void *_dst, int l)
-{
-        uint64_t *src = _src;
-        uint64_t *dst = _dst;
-        if (unlikely(l >= 1024)) {
-                memcpy(dst, src, l);
-                return;
-        }
-        for (; likely(l > 0); l-=64) {
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-        }
+static int
+nm_bdg_fdb_alloc(struct nm_bridge *b)
+{
+	u_int entries = bridge_fdb_size, nbuckets = 2;
+
+	nm_bound_var(&entries, NM_BDG_HASH, 2 * NM_FDB_WAYS,
+			NM_BDG_HASH_MAX, "bridge_fdb_size");
+	while (nbuckets * 2 * NM_FDB_WAYS <= entries)
+		nbuckets *= 2;
+	b->ht = nm_os_vmalloc(sizeof(struct nm_hash_ent) *
+			nbuckets * NM_FDB_WAYS);
+	if (b->ht == NULL)
+		return ENOMEM;
+	b->ht_mask = nbuckets - 1;
+	return 0;
+}
+
+static void
+nm_bdg_fdb_free(struct nm_bridge *b)
+{
+	if (b->ht) {
+		nm_os_vfree(b->ht);
+		b->ht = NULL;
+	}
+	b->ht_mask = 0;
+}
+
+/* forget all the addresses learned on a port.
+ * Called with the bridge write-locked.
+ */
+static void
+nm_bdg_fdb_purge(struct nm_bridge *b, u_int port)
+{
+	u_int i, n = (b->ht_mask + 1) * NM_FDB_WAYS;
+
+	if (b->ht == NULL)
+		return;
+	for (i = 0; i < n; i++) {
+		if (b->ht[i].mac && b->ht[i].ports == port)
+			b->ht[i].mac = 0;
+	}
 }
 
+/* allocate the multicast group table of b, if not there yet.
+ * Called with NMG_LOCK held.
+ */
+static int
+nm_bdg_mcast_alloc(struct nm_bridge *b)
+{
+	struct nm_bdg_mcast *mc;
+
+	NMG_LOCK_ASSERT();
+	if (b->bdg_mcast)
+		return 0;
+	mc = nm_os_malloc(sizeof(*mc));
+	if (mc == NULL)
+		return ENOMEM;
+	mtx_init(&mc->mc_lock, "nm_bdg_mcast_lock", NULL, MTX_DEF);
+	wmb();
+	b->bdg_mcast = mc;
+	return 0;
+}
+
+/* release the multicast group table of a bridge without ports */
+static void
+nm_bdg_mcast_free(struct nm_bridge *b)
+{
+	struct nm_bdg_mcast *mc = b->bdg_mcast;
+	u_int g;
+
+	if (mc == NULL)
+		return;
+	for (g = 0; g < NM_BDG_MCAST_GROUPS; g++) {
+		if (mc->mc_grp[g])
+			nm_os_free(mc->mc_grp[g]);
+	}
+	mtx_destroy(&mc->mc_lock);
+	nm_os_free(mc);
+	b->bdg_mcast = NULL;
+}
+
+/* remove a port from all the multicast groups */
+static void
+nm_bdg_mcast_purge(struct nm_bridge *b, u_int port)
+{
+	struct nm_bdg_mcast *mc = b->bdg_mcast;
+	uint32_t bit = 1U << (port % 32);
+	u_int g;
+
+	if (mc == NULL)
+		return;
+	mtx_lock(&mc->mc_lock);
+	for (g = 0; g < NM_BDG_MCAST_GROUPS; g++) {
+		struct nm_bdg_mgroup *mg = mc->mc_grp[g];
+
+		if (mg && (mg->mg_ports[port / 32] & bit)) {
+			mg->mg_ports[port / 32] &= ~bit;
+			mg->mg_nports--;
+		}
+	}
+	mtx_unlock(&mc->mc_lock);
+}
 
 static int
 nm_is_id_char(const char c)
@@ -363,17 +936,28 @@ nm_find_bridge(const char *name, int create)
 	}
 	if (i == num_bridges && b) { /* name not found, can create entry */
 		/* initialize the bridge */
+		/* in case the slot was never used */
+		nm_bdg_fdb_free(b);
+		nm_bdg_tables_free(b);
+		if (nm_bdg_fdb_alloc(b)) {
+			D("cannot allocate the forwarding table");
+			return NULL;
+		}
 		strncpy(b->bdg_basename, name, namelen);
 		ND("create new bridge %s with ports %d", b->bdg_basename,
 			b->bdg_active_ports);
 		b->bdg_namelen = namelen;
 		b->bdg_active_ports = 0;
-		for (i = 0; i < NM_BDG_MAXPORTS; i++)
-			b->bdg_port_index[i] = i;
+		b->bdg_flags = 0;
+		b->bdg_prio_weight = 0;
 		/* set the default function */
 		b->bdg_ops.lookup = netmap_bdg_learning;
-		/* reset the MAC address table */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		b->bdg_ops.lookup_batch = netmap_bdg_learning_batch;
+		if (nm_bdg_tables_resize(b, nm_bdg_init_ports())) {
+			D("cannot allocate the port tables");
+			nm_bdg_fdb_free(b);
+			return NULL;
+		}
 		NM_BNS_GET(b);
 	}
 	return b;
@@ -390,56 +974,144 @@ nm_free_bdgfwd(struct netmap_adapter *na)
 	struct netmap_kring *kring;
 
 	NMG_LOCK_ASSERT();
-	nrings = na->num_tx_rings;
+	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
 	for (i = 0; i < nrings; i++) {
 		if (kring[i].nkr_ft) {
-			nm_os_free(kring[i].nkr_ft);
+			nm_os_vfree(kring[i].nkr_ft);
 			kring[i].nkr_ft = NULL; /* protect from freeing twice */
+			kring[i].nkr_ft_ports = 0;
 		}
 	}
 }
 
 
+/*
+ * Allocate the scratch area of a tx ring for a bridge with
+ * room for nports ports. It takes hundreds of KB for large
+ * bridges, so it is not physically contiguous; always called
+ * with NMG_LOCK held, which may sleep.
+ */
+static struct nm_bdg_fwd *
+nm_bdg_fwd_alloc(u_int nports)
+{
+	int l, j, num_dstq;
+	struct nm_bdg_fwd *ft;
+	struct nm_bdg_q *dstq;
+
+	/* all port:rings + broadcast rings */
+	num_dstq = NM_BDG_NUM_DSTQ(nports);
+	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
+	l += sizeof(struct nm_bdg_q);			/* NM_BDG_FWD_PORTS() */
+	l += sizeof(struct nm_bdg_q) * num_dstq;
+	l += sizeof(uint16_t) * num_dstq;		/* dsts */
+	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;	/* lookup_batch ports */
+	l += sizeof(uint8_t) * NM_BDG_BATCH_MAX;	/* lookup_batch rings */
+	l += sizeof(uint32_t) * NM_BDG_MCAST_NWORDS(nports); /* mcast ports */
+
+	ft = nm_os_vmalloc(l);
+	if (!ft)
+		return NULL;
+	NM_BDG_FWD_PORTS(ft) = nports;
+	dstq = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX) + 1;
+	for (j = 0; j < num_dstq; j++) {
+		dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
+		dstq[j].bq_hi_head = dstq[j].bq_hi_tail = NM_FT_NULL;
+		dstq[j].bq_len = 0;
+	}
+	return ft;
+}
+
+
 /*
  * Allocate the forwarding tables for the rings attached to the bridge ports.
+ * They are sized for the bridge the port is attached to, if any,
+ * and resized by nm_bdg_fwd_resize() when the bridge grows.
  */
 static int
 nm_alloc_bdgfwd(struct netmap_adapter *na)
 {
-	int nrings, l, i, num_dstq;
+	struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)na;
+	int nrings, i;
+	u_int nports;
 	struct netmap_kring *kring;
 
 	NMG_LOCK_ASSERT();
-	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
-	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
-	l += sizeof(struct nm_bdg_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
-
+	nports = vpna->na_bdg ? vpna->na_bdg->bdg_max_ports :
+		nm_bdg_init_ports();
 	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
 	for (i = 0; i < nrings; i++) {
 		struct nm_bdg_fwd *ft;
-		struct nm_bdg_q *dstq;
-		int j;
 
-		ft = nm_os_malloc(l);
+		ft = nm_bdg_fwd_alloc(nports);
 		if (!ft) {
 			nm_free_bdgfwd(na);
 			return ENOMEM;
 		}
-		dstq = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
-		for (j = 0; j < num_dstq; j++) {
-			dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
-			dstq[j].bq_len = 0;
-		}
 		kring[i].nkr_ft = ft;
+		kring[i].nkr_ft_ports = nports;
+	}
+	return 0;
+}
+
+
+/*
+ * Make the scratch areas of the tx rings of na large enough for
+ * a bridge with nports ports. Each ring is only used by its sender,
+ * so we replace the area and wait for the sender to leave the old one.
+ */
+static int
+nm_bdg_fwd_resize(struct netmap_adapter *na, u_int nports)
+{
+	int nrings, i;
+
+	NMG_LOCK_ASSERT();
+	if (na->tx_rings == NULL)
+		return 0; /* allocated with the krings */
+	nrings = netmap_real_rings(na, NR_TX);
+	for (i = 0; i < nrings; i++) {
+		struct netmap_kring *kring = &na->tx_rings[i];
+		struct nm_bdg_fwd *ft, *old = kring->nkr_ft;
+
+		if (old == NULL || kring->nkr_ft_ports >= nports)
+			continue;
+		ft = nm_bdg_fwd_alloc(nports);
+		if (!ft)
+			return ENOMEM;
+		kring->nkr_ft = ft;
+		kring->nkr_ft_ports = nports;
+		mb();
+		nm_bdg_wait_kring(kring);
+		nm_os_vfree(old);
 	}
 	return 0;
 }
 
 
+/*
+ * Grow bridge b to room for nports ports: first the scratch areas
+ * of the ports, which must always fit the view the senders use,
+ * then the tables.
+ */
+static int
+nm_bdg_grow(struct nm_bridge *b, u_int nports)
+{
+	u_int j;
+	int error;
+
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *vpna =
+			b->bdg_ports[b->bdg_port_index[j]];
+
+		error = nm_bdg_fwd_resize(&vpna->up, nports);
+		if (error)
+			return error;
+	}
+	return nm_bdg_tables_resize(b, nports);
+}
+
+
 /* remove from bridge b the ports in slots hw and sw
  * (sw can be -1 if not needed)
  */
@@ -448,24 +1120,22 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 {
 	int s_hw = hw, s_sw = sw;
 	int i, lim =b->bdg_active_ports;
-	uint8_t tmp[NM_BDG_MAXPORTS];
+	uint16_t *tmp = b->bdg_port_index;
+	struct netmap_vp_adapter *vpna, *swna = NULL;
 
 	/*
 	New algorithm:
-	make a copy of bdg_port_index;
 	lookup NA(ifp)->bdg_port and SWNA(ifp)->bdg_port
 	in the array of bdg_port_index, replacing them with
 	entries from the bottom of the array;
 	decrement bdg_active_ports;
-	acquire BDG_WLOCK() and copy back the array.
+	publish the new tables to the forwarding path.
+	The forwarding path does not use bdg_port_index, so
+	we can update it in place.
 	 */
 
 	if (netmap_verbose)
 		D("detach %d and %d (lim %d)", hw, sw, lim);
-	/* make a copy of the list of active ports, update it,
-	 * and then copy back within BDG_WLOCK().
-	 */
-	memcpy(tmp, b->bdg_port_index, sizeof(tmp));
 	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
 		if (hw >= 0 && tmp[i] == hw) {
 			ND("detach hw %d at %d", hw, i);
@@ -488,20 +1158,55 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	}
 
 	BDG_WLOCK(b);
-	if (b->bdg_ops.dtor)
-		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
+	vpna = b->bdg_ports[s_hw];
 	b->bdg_ports[s_hw] = NULL;
 	if (s_sw >= 0) {
+		swna = b->bdg_ports[s_sw];
 		b->bdg_ports[s_sw] = NULL;
 	}
-	memcpy(b->bdg_port_index, tmp, sizeof(tmp));
 	b->bdg_active_ports = lim;
 	BDG_WUNLOCK(b);
 
+	/* from now on no sender can reach the ports */
+	nm_bdg_publish(b);
+	nm_bdg_shaper_set(vpna, NULL);
+	if (swna)
+		nm_bdg_shaper_set(swna, NULL);
+
+	BDG_WLOCK(b);
+	if (b->bdg_ops.dtor)
+		b->bdg_ops.dtor(vpna);
+	BDG_WUNLOCK(b);
+	/* learning on other ports may race with the purge and leave
+	 * a stale entry behind. It is harmless, as the forwarding
+	 * path drops traffic to empty ports, and it ages out.
+	 */
+	nm_bdg_fdb_purge(b, s_hw);
+	nm_bdg_mcast_purge(b, s_hw);
+	if (s_sw >= 0) {
+		nm_bdg_fdb_purge(b, s_sw);
+		nm_bdg_mcast_purge(b, s_sw);
+	}
+	if (b->bdg_lpm) {
+		nm_lpm_purge(b->bdg_lpm, s_hw);
+		if (s_sw >= 0)
+			nm_lpm_purge(b->bdg_lpm, s_sw);
+	}
+	if (b->bdg_flow) {
+		nm_flow_purge(b->bdg_flow, s_hw);
+		if (s_sw >= 0)
+			nm_flow_purge(b->bdg_flow, s_sw);
+	}
+
 	ND("now %d active ports", lim);
 	if (lim == 0) {
 		ND("marking bridge %s as free", b->bdg_basename);
 		bzero(&b->bdg_ops, sizeof(b->bdg_ops));
+		nm_bdg_lpm_free(b);
+		nm_bdg_flow_free(b);
+		nm_bdg_fdb_free(b);
+		nm_bdg_mcast_free(b);
+		nm_bdg_tables_free(b);
 		NM_BNS_PUT(b);
 	}
 }
@@ -662,6 +1367,12 @@ netmap_vi_create(struct nmreq *nmr, int autodelete)
 		vpna->autodelete = 1;
 	}
 	NM_ATTACH_NA(ifp, &vpna->up);
+	if (nmr->nr_flags & NR_NUMA_NODE) {
+		error = netmap_mem_set_node(vpna->up.nm_mem,
+				NR_NUMA_NODE_GET(nmr->nr_flags));
+		if (error)
+			goto err_2;
+	}
 	/* return the updated info */
 	error = nm_update_info(nmr, &vpna->up);
 	if (error) {
@@ -752,10 +1463,22 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na,
 		D("bridge full %d, cannot create new port", b->bdg_active_ports);
 		return ENOMEM;
 	}
-	/* record the next two ports available, but do not allocate yet */
-	cand = b->bdg_port_index[b->bdg_active_ports];
-	cand2 = b->bdg_port_index[b->bdg_active_ports + 1];
-	ND("+++ bridge %s port %s used %d avail %d %d",
+	if (b->bdg_active_ports + needed > b->bdg_max_ports) {
+		u_int nports = b->bdg_max_ports * 2;
+
+		if (nports > NM_BDG_MAXPORTS)
+			nports = NM_BDG_MAXPORTS;
+		error = nm_bdg_grow(b, nports);
+		if (error) {
+			D("cannot grow bridge %s to %u ports",
+				b->bdg_basename, nports);
+			return error;
+		}
+	}
+	/* record the next two ports available, but do not allocate yet */
+	cand = b->bdg_port_index[b->bdg_active_ports];
+	cand2 = b->bdg_port_index[b->bdg_active_ports + 1];
+	ND("+++ bridge %s port %s used %d avail %d %d",
 		b->bdg_basename, ifname, b->bdg_active_ports, cand, cand2);
 
 	/*
@@ -798,6 +1521,10 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na,
 		hostna = hw->na_hostvp;
 		if (nmr->nr_arg1 != NETMAP_BDG_HOST)
 			hostna = NULL;
+		/* persistent VALE ports may already have their krings */
+		error = nm_bdg_fwd_resize(&vpna->up, b->bdg_max_ports);
+		if (error)
+			goto out;
 	}
 
 	BDG_WLOCK(b);
@@ -817,6 +1544,7 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na,
 	}
 	ND("if %s refs %d", ifname, vpna->up.na_refcount);
 	BDG_WUNLOCK(b);
+	nm_bdg_publish(b);
 	*na = &vpna->up;
 	netmap_adapter_get(*na);
 
@@ -902,8 +1630,9 @@ nm_bdg_ctl_detach(struct nmreq *nmr)
 		error = EINVAL;
 		goto unlock_exit;
 	} else if (nm_is_bwrap(na) &&
-		   ((struct netmap_bwrap_adapter *)na)->na_polling_state) {
-		/* Don't detach a NIC with polling */
+		   (((struct netmap_bwrap_adapter *)na)->na_polling_state ||
+		    ((struct netmap_bwrap_adapter *)na)->na_defer)) {
+		/* Don't detach a NIC with polling or deferred forwarding */
 		error = EBUSY;
 		netmap_adapter_put(na);
 		goto unlock_exit;
@@ -922,13 +1651,46 @@ unlock_exit:
 
 }
 
+/*
+ * Polling kthreads. There is at most one kthread per core, shared by
+ * all the adapters whose polling configuration includes that core, so
+ * each kthread polls an arbitrary set of (adapter, ring) pairs. The
+ * cycles spent on each ring are accounted and, every
+ * bridge_poll_period ms, the busiest kthread may hand one of its rings
+ * over to a less loaded one (see nm_bdg_poll_rebalance()). A ring only
+ * moves among the cores configured for its adapter.
+ *
+ * The kthreads spin as long as there is traffic. If all the adapters
+ * they serve have idle_polls != 0, after idle_polls polls without
+ * traffic they back off with an increasing number of pause
+ * instructions between polls, and after idle_polls more they sleep,
+ * polling once per tick. While any ring of an adapter is served by a
+ * sleeping kthread the NIC interrupt is enabled, so that its traffic
+ * is still served with the usual latency, and the kthread returns to
+ * spinning as soon as it sees that traffic.
+ */
+#define NM_BDG_POLL_MAXPAUSE	1024
+#define NM_BDG_POLL_MAXENTS	256	/* rings per kthread */
+
 struct nm_bdg_polling_state;
+
+struct nm_bdg_pollent {
+	struct netmap_kring *kring;
+	struct nm_bdg_polling_state *bps;
+	uint64_t cycles;	/* spent on the ring since last rebalance */
+	bool sleeping;		/* counted in bps->nsleeping */
+};
+
 struct
 nm_bdg_kthread {
 	struct nm_kthread *nmk;
-	u_int qfirst;
-	u_int qlast;
-	struct nm_bdg_polling_state *bps;
+	u_int cpu;
+	u_int refcount;		/* adapters configured on this core */
+	u_int idle;		/* consecutive polls without traffic */
+	u_int seen;		/* sum of the hwcur of the rings */
+	NM_MTX_T lock;		/* protects the entries */
+	u_int nents;
+	struct nm_bdg_pollent ents[NM_BDG_POLL_MAXENTS];
 };
 
 struct nm_bdg_polling_state {
@@ -940,119 +1702,355 @@ struct nm_bdg_polling_state {
 	u_int qlast;
 	u_int cpu_from;
 	u_int ncpus;
-	struct nm_bdg_kthread *kthreads;
+	u_int idle_polls;	/* 0: always spin */
+	NM_MTX_T intr_lock;	/* protects nsleeping and the interrupt */
+	u_int nsleeping;	/* sleeping rings */
 };
 
+/*
+ * nm_bdg_pollers[cpu] is the kthread bound to cpu, if any.
+ * nm_bdg_poll_lock protects the array and serializes the changes to
+ * the entries of the kthreads, which also need the lock of the
+ * kthread. It is never acquired while holding the lock of a kthread.
+ */
+static struct nm_bdg_kthread **nm_bdg_pollers;
+static u_int nm_bdg_npollers;
+static NM_MTX_T nm_bdg_poll_lock;
+static volatile uint64_t nm_bdg_poll_last;	/* last rebalance */
+
+/* a ring served by a polling kthread goes to sleep (sleep = 1) or
+ * wakes up. Called with the lock of the kthread.
+ */
 static void
-netmap_bwrap_polling(void *data)
+nm_bdg_pollent_sleep(struct nm_bdg_pollent *e, int sleep)
 {
-	struct nm_bdg_kthread *nbk = data;
-	struct netmap_bwrap_adapter *bna;
-	u_int qfirst, qlast, i;
-	struct netmap_kring *kring0, *kring;
-
-	if (!nbk)
-		return;
-	qfirst = nbk->qfirst;
-	qlast = nbk->qlast;
-	bna = nbk->bps->bna;
-	kring0 = NMR(bna->hwna, NR_RX);
+	struct nm_bdg_polling_state *bps = e->bps;
+	struct netmap_adapter *hwna = bps->bna->hwna;
 
-	for (i = qfirst; i < qlast; i++) {
-		kring = kring0 + i;
-		kring->nm_notify(kring, 0);
+	NM_MTX_LOCK(bps->intr_lock);
+	if (sleep) {
+		if (bps->nsleeping++ == 0 && hwna->nm_intr)
+			hwna->nm_intr(hwna, 1);
+	} else {
+		if (--bps->nsleeping == 0 && hwna->nm_intr)
+			hwna->nm_intr(hwna, 0);
 	}
+	NM_MTX_UNLOCK(bps->intr_lock);
+	e->sleeping = sleep;
 }
 
-static int
-nm_bdg_create_kthreads(struct nm_bdg_polling_state *bps)
+/*
+ * If the busiest kthread has more than bridge_poll_imbalance percent
+ * more load than another one that can serve one of its rings, move
+ * there the ring that best halves the difference. A single ring is
+ * moved per period, to give the kthreads time to settle.
+ */
+static void
+nm_bdg_poll_rebalance(uint64_t period)
 {
-	struct nm_kthread_cfg kcfg;
-	int i, j;
+	struct nm_bdg_kthread *src = NULL, *dst = NULL, *t;
+	struct nm_bdg_pollent *e, *best = NULL;
+	uint64_t *load, diff, score, best_score = 0;
+	u_int i, j, cpu;
 
-	bps->kthreads = nm_os_malloc(sizeof(struct nm_bdg_kthread) * bps->ncpus);
-	if (bps->kthreads == NULL)
-		return ENOMEM;
+	load = nm_os_malloc(sizeof(*load) * nm_bdg_npollers);
+	if (load == NULL)
+		return;
+	NM_MTX_LOCK(nm_bdg_poll_lock);
+	if (nm_os_cycles() - nm_bdg_poll_last < period) {
+		/* another kthread did it */
+		NM_MTX_UNLOCK(nm_bdg_poll_lock);
+		nm_os_free(load);
+		return;
+	}
+	nm_bdg_poll_last = nm_os_cycles();
+	for (i = 0; i < nm_bdg_npollers; i++) {
+		t = nm_bdg_pollers[i];
+		if (t == NULL)
+			continue;
+		NM_MTX_LOCK(t->lock);
+		for (j = 0; j < t->nents; j++)
+			load[i] += t->ents[j].cycles;
+		NM_MTX_UNLOCK(t->lock);
+		if (src == NULL || load[i] > load[src->cpu])
+			src = t;
+	}
+	if (src == NULL)
+		goto reset;
+	NM_MTX_LOCK(src->lock);
+	for (j = 0; j < src->nents; j++) {
+		e = src->ents + j;
+		for (i = 0; i < e->bps->ncpus; i++) {
+			cpu = e->bps->cpu_from + i;
+			t = nm_bdg_pollers[cpu];
+			if (t == NULL || t == src ||
+			    t->nents == NM_BDG_POLL_MAXENTS ||
+			    load[cpu] >= load[src->cpu])
+				continue;
+			diff = load[src->cpu] - load[cpu];
+			if (diff * 100 <= load[src->cpu] * bridge_poll_imbalance)
+				continue;
+			/* moving it must reduce the difference */
+			if (e->cycles == 0 || e->cycles >= diff)
+				continue;
+			score = diff > 2 * e->cycles ?
+				diff - 2 * e->cycles : 2 * e->cycles - diff;
+			if (best == NULL || score < best_score) {
+				best = e;
+				best_score = score;
+				dst = t;
+			}
+		}
+	}
+	if (best != NULL) {
+		ND("ring %s moves from core %u to %u", best->kring->name,
+			src->cpu, dst->cpu);
+		NM_MTX_LOCK(dst->lock);
+		dst->ents[dst->nents++] = *best;
+		*best = src->ents[--src->nents];
+		NM_MTX_UNLOCK(dst->lock);
+	}
+	NM_MTX_UNLOCK(src->lock);
+reset:
+	for (i = 0; i < nm_bdg_npollers; i++) {
+		t = nm_bdg_pollers[i];
+		if (t == NULL)
+			continue;
+		NM_MTX_LOCK(t->lock);
+		for (j = 0; j < t->nents; j++)
+			t->ents[j].cycles = 0;
+		NM_MTX_UNLOCK(t->lock);
+	}
+	NM_MTX_UNLOCK(nm_bdg_poll_lock);
+	nm_os_free(load);
+}
 
-	bzero(&kcfg, sizeof(kcfg));
-	kcfg.worker_fn = netmap_bwrap_polling;
-	for (i = 0; i < bps->ncpus; i++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
-		int all = (bps->ncpus == 1 && bps->reg == NR_REG_ALL_NIC);
-		int affinity = bps->cpu_from + i;
+static void
+netmap_bwrap_polling(void *data)
+{
+	struct nm_bdg_kthread *nbk = data;
+	struct nm_bdg_pollent *e;
+	u_int i, seen = 0, nsleeping = 0, idle_polls = 0, n = 0;
+	bool spin = false, sleep;
+	uint64_t t0, t1, period;
+
+	if (!nbk)
+		return;
 
-		t->bps = bps;
-		t->qfirst = all ? bps->qfirst /* must be 0 */: affinity;
-		t->qlast = all ? bps->qlast : t->qfirst + 1;
-		D("kthread %d a:%u qf:%u ql:%u", i, affinity, t->qfirst,
-			t->qlast);
+	NM_MTX_LOCK(nbk->lock);
+	t0 = nm_os_cycles();
+	for (i = 0; i < nbk->nents; i++) {
+		e = nbk->ents + i;
+		e->kring->nm_notify(e->kring, 0);
+		t1 = nm_os_cycles();
+		e->cycles += t1 - t0;
+		t0 = t1;
+		seen += e->kring->nr_hwcur;
+		if (e->sleeping)
+			nsleeping++;
+		if (e->bps->idle_polls == 0)
+			spin = true;
+		else if (e->bps->idle_polls > idle_polls)
+			idle_polls = e->bps->idle_polls;
+	}
+	sleep = (nbk->nents == 0);
 
-		kcfg.type = i;
-		kcfg.worker_private = t;
-		t->nmk = nm_os_kthread_create(&kcfg, 0, NULL);
-		if (t->nmk == NULL) {
-			goto cleanup;
+	if (spin || seen != nbk->seen) {
+		/* the rings moved, because of us or of the interrupt
+		 * handler, or a ring arrived from a sleeping kthread
+		 */
+		nbk->seen = seen;
+		nbk->idle = 0;
+		for (i = 0; nsleeping > 0 && i < nbk->nents; i++) {
+			e = nbk->ents + i;
+			if (e->sleeping) {
+				nm_bdg_pollent_sleep(e, 0);
+				nsleeping--;
+			}
+		}
+	} else if (!sleep) {
+		if (nbk->idle < 2 * idle_polls)
+			nbk->idle++;
+		if (nbk->idle < idle_polls) {
+			/* spin */
+		} else if (nbk->idle < 2 * idle_polls) {
+			n = nbk->idle - idle_polls;
+			n = n < 10 ? 1 << n : NM_BDG_POLL_MAXPAUSE;
+		} else {
+			for (i = 0; i < nbk->nents; i++) {
+				e = nbk->ents + i;
+				if (!e->sleeping)
+					nm_bdg_pollent_sleep(e, 1);
+			}
+			sleep = true;
 		}
-		nm_os_kthread_set_affinity(t->nmk, affinity);
 	}
-	return 0;
+	NM_MTX_UNLOCK(nbk->lock);
 
-cleanup:
-	for (j = 0; j < i; j++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
-		nm_os_kthread_delete(t->nmk);
+	if (bridge_poll_imbalance && !sleep) {
+		period = nm_os_cycles_freq() / 1000 * bridge_poll_period;
+		if (t0 - nm_bdg_poll_last >= period)
+			nm_bdg_poll_rebalance(period);
 	}
-	nm_os_free(bps->kthreads);
-	return EFAULT;
+
+	if (sleep)
+		tsleep(nbk, 0, "NM_BDG_POLL", 1);
+	while (n--)
+		nm_os_pause();
 }
 
-/* a version of ptnetmap_start_kthreads() */
-static int
-nm_bdg_polling_start_kthreads(struct nm_bdg_polling_state *bps)
+/* return the kthread bound to cpu, creating it if needed */
+static struct nm_bdg_kthread *
+nm_bdg_poller_get(u_int cpu)
 {
-	int error, i, j;
+	struct nm_kthread_cfg kcfg;
+	struct nm_bdg_kthread *t;
 
-	if (!bps) {
-		D("polling is not configured");
-		return EFAULT;
+	t = nm_bdg_pollers[cpu];
+	if (t != NULL) {
+		t->refcount++;
+		return t;
 	}
-	bps->stopped = false;
+	t = nm_os_malloc(sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->cpu = cpu;
+	t->refcount = 1;
+	NM_MTX_INIT(t->lock);
 
-	for (i = 0; i < bps->ncpus; i++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
-		error = nm_os_kthread_start(t->nmk);
-		if (error) {
-			D("error in nm_kthread_start()");
-			goto cleanup;
-		}
+	bzero(&kcfg, sizeof(kcfg));
+	kcfg.worker_fn = netmap_bwrap_polling;
+	kcfg.type = cpu;
+	kcfg.worker_private = t;
+	t->nmk = nm_os_kthread_create(&kcfg, 0, NULL);
+	if (t->nmk == NULL)
+		goto fail;
+	nm_os_kthread_set_affinity(t->nmk, cpu);
+	if (nm_os_kthread_start(t->nmk)) {
+		D("error in nm_kthread_start()");
+		nm_os_kthread_delete(t->nmk);
+		goto fail;
 	}
-	return 0;
+	D("kthread on core %u", cpu);
+	nm_bdg_pollers[cpu] = t;
+	return t;
+
+fail:
+	NM_MTX_DESTROY(t->lock);
+	nm_os_free(t);
+	return NULL;
+}
 
-cleanup:
-	for (j = 0; j < i; j++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
-		nm_os_kthread_stop(t->nmk);
+/* release the kthread bound to cpu. Called with nm_bdg_poll_lock,
+ * which is released because the kthread may be waiting for it.
+ */
+static void
+nm_bdg_poller_put(u_int cpu)
+{
+	struct nm_bdg_kthread *t = nm_bdg_pollers[cpu];
+
+	if (--t->refcount > 0) {
+		NM_MTX_UNLOCK(nm_bdg_poll_lock);
+		return;
 	}
-	bps->stopped = true;
-	return error;
+	nm_bdg_pollers[cpu] = NULL;
+	NM_MTX_UNLOCK(nm_bdg_poll_lock);
+	nm_os_kthread_stop(t->nmk);
+	nm_os_kthread_delete(t->nmk);
+	NM_MTX_DESTROY(t->lock);
+	nm_os_free(t);
 }
 
+/* remove all the rings of bps from the kthreads, and release them */
 static void
 nm_bdg_polling_stop_delete_kthreads(struct nm_bdg_polling_state *bps)
 {
-	int i;
+	struct nm_bdg_kthread *t;
+	u_int i, j;
 
 	if (!bps)
 		return;
 
+	NM_MTX_LOCK(nm_bdg_poll_lock);
 	for (i = 0; i < bps->ncpus; i++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
-		nm_os_kthread_stop(t->nmk);
-		nm_os_kthread_delete(t->nmk);
+		t = nm_bdg_pollers[bps->cpu_from + i];
+		if (t == NULL)
+			continue;
+		NM_MTX_LOCK(t->lock);
+		for (j = 0; j < t->nents; ) {
+			if (t->ents[j].bps == bps)
+				t->ents[j] = t->ents[--t->nents];
+			else
+				j++;
+		}
+		NM_MTX_UNLOCK(t->lock);
+	}
+	NM_MTX_UNLOCK(nm_bdg_poll_lock);
+	for (i = 0; i < bps->ncpus; i++) {
+		NM_MTX_LOCK(nm_bdg_poll_lock);
+		if (nm_bdg_pollers[bps->cpu_from + i] == NULL) {
+			NM_MTX_UNLOCK(nm_bdg_poll_lock);
+			continue;
+		}
+		nm_bdg_poller_put(bps->cpu_from + i);
 	}
 	bps->stopped = true;
 }
 
+/*
+ * Add the rings of bps to the kthreads of its cores:
+ * ONE_NIC: ring qfirst + i to core cpu_from + i;
+ * ALL_NIC: all the rings to core cpu_from.
+ */
+static int
+nm_bdg_polling_start_kthreads(struct nm_bdg_polling_state *bps)
+{
+	struct netmap_kring *kring0 = NMR(bps->bna->hwna, NR_RX);
+	struct nm_bdg_kthread *t;
+	u_int i, q;
+	int error = 0;
+
+	NM_MTX_LOCK(nm_bdg_poll_lock);
+	for (i = 0; i < bps->ncpus; i++) {
+		t = nm_bdg_poller_get(bps->cpu_from + i);
+		if (t == NULL) {
+			error = EFAULT;
+			break;
+		}
+	}
+	if (error) {
+		/* release the kthreads we got */
+		while (i-- > 0) {
+			nm_bdg_poller_put(bps->cpu_from + i);
+			NM_MTX_LOCK(nm_bdg_poll_lock);
+		}
+		NM_MTX_UNLOCK(nm_bdg_poll_lock);
+		return error;
+	}
+	bps->stopped = false;
+	for (q = bps->qfirst; q < bps->qlast; q++) {
+		struct nm_bdg_pollent *e;
+
+		t = nm_bdg_pollers[bps->cpu_from +
+			(bps->reg == NR_REG_ONE_NIC ? q - bps->qfirst : 0)];
+		if (t->nents == NM_BDG_POLL_MAXENTS) {
+			D("too many rings on core %u", t->cpu);
+			error = ENOSPC;
+			break;
+		}
+		NM_MTX_LOCK(t->lock);
+		e = t->ents + t->nents++;
+		bzero(e, sizeof(*e));
+		e->kring = kring0 + q;
+		e->bps = bps;
+		NM_MTX_UNLOCK(t->lock);
+	}
+	NM_MTX_UNLOCK(nm_bdg_poll_lock);
+	if (error)
+		nm_bdg_polling_stop_delete_kthreads(bps);
+	return error;
+}
+
 static int
 get_polling_cfg(struct nmreq *nmr, struct netmap_adapter *na,
 			struct nm_bdg_polling_state *bps)
@@ -1101,15 +2099,21 @@ get_polling_cfg(struct nmreq *nmr, struct netmap_adapter *na,
 		D("reg must be ALL_NIC or ONE_NIC");
 		return EINVAL;
 	}
+	if (core_from + req_cpus > nm_bdg_npollers) {
+		D("only %u cores exist (core %u-%u is given)",
+			nm_bdg_npollers, core_from, core_from + req_cpus);
+		return EINVAL;
+	}
 
 	bps->reg = reg;
 	bps->qfirst = qfirst;
 	bps->qlast = qlast;
 	bps->cpu_from = core_from;
 	bps->ncpus = req_cpus;
-	D("%s qfirst %u qlast %u cpu_from %u ncpus %u",
+	bps->idle_polls = nmr->nr_arg3;
+	D("%s qfirst %u qlast %u cpu_from %u ncpus %u idle_polls %u",
 		reg == NR_REG_ALL_NIC ? "REG_ALL_NIC" : "REG_ONE_NIC",
-		qfirst, qlast, core_from, req_cpus);
+		qfirst, qlast, core_from, req_cpus, bps->idle_polls);
 	return 0;
 }
 
@@ -1125,22 +2129,24 @@ nm_bdg_ctl_polling_start(struct nmreq *nmr, struct netmap_adapter *na)
 		D("ERROR adapter already in polling mode");
 		return EFAULT;
 	}
+	if (bna->na_defer) {
+		D("ERROR adapter in deferred mode");
+		return EBUSY;
+	}
 
 	bps = nm_os_malloc(sizeof(*bps));
 	if (!bps)
 		return ENOMEM;
 	bps->configured = false;
 	bps->stopped = true;
+	bps->nsleeping = 0;
 
 	if (get_polling_cfg(nmr, na, bps)) {
 		nm_os_free(bps);
 		return EINVAL;
 	}
 
-	if (nm_bdg_create_kthreads(bps)) {
-		nm_os_free(bps);
-		return EFAULT;
-	}
+	NM_MTX_INIT(bps->intr_lock);
 
 	bps->configured = true;
 	bna->na_polling_state = bps;
@@ -1149,11 +2155,11 @@ nm_bdg_ctl_polling_start(struct nmreq *nmr, struct netmap_adapter *na)
 	/* disable interrupt if possible */
 	if (bna->hwna->nm_intr)
 		bna->hwna->nm_intr(bna->hwna, 0);
-	/* start kthread now */
+	/* hand the rings to the kthreads now */
 	error = nm_bdg_polling_start_kthreads(bps);
 	if (error) {
 		D("ERROR nm_bdg_polling_start_kthread()");
-		nm_os_free(bps->kthreads);
+		NM_MTX_DESTROY(bps->intr_lock);
 		nm_os_free(bps);
 		bna->na_polling_state = NULL;
 		if (bna->hwna->nm_intr)
@@ -1175,6 +2181,7 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 	bps = bna->na_polling_state;
 	nm_bdg_polling_stop_delete_kthreads(bna->na_polling_state);
 	bps->configured = false;
+	NM_MTX_DESTROY(bps->intr_lock);
 	nm_os_free(bps);
 	bna->na_polling_state = NULL;
 	/* reenable interrupt */
@@ -1183,63 +2190,619 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 	return 0;
 }
 
-/* Called by either user's context (netmap_ioctl())
- * or external kernel modules (e.g., Openvswitch).
- * Operation is indicated in nmr->nr_cmd.
- * NETMAP_BDG_OPS that sets configure/lookup/dtor functions to the bridge
- * requires bdg_ops argument; the other commands ignore this argument.
- *
- * Called without NMG_LOCK.
+/*
+ * Deferred forwarding. Adapters with na_defer set do not forward from
+ * their rx notifications: the ring is queued to the worker kthread of
+ * the cpu that took the interrupt, which forwards up to
+ * bridge_intr_budget slots from each queued ring in turn, requeueing
+ * the rings that have more. This bounds the time spent in the
+ * interrupt path and shares the worker fairly among the rings.
+ * A worker that has been idle for a while sleeps, and then the
+ * notifications forward directly (still within the budget) until it
+ * wakes up.
  */
-int
-netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
+#define NM_BDG_DEFER_QLEN	256	/* rings per worker */
+#define NM_BDG_DEFER_IDLE	1000	/* empty polls before sleeping */
+
+struct nm_bdg_deferq {
+	struct nm_kthread *nmk;
+	NM_LOCK_T lock;		/* protects the fields below */
+	bool sleeping;
+	u_int idle;
+	struct netmap_kring *busy;	/* being forwarded by the worker */
+	u_int head;
+	u_int count;
+	struct netmap_kring *ring[NM_BDG_DEFER_QLEN];
+};
+
+/* one per cpu, while any adapter uses them (under NMG_LOCK) */
+static struct nm_bdg_deferq *nm_bdg_deferqs;
+static u_int nm_bdg_ndefer;
+
+static int netmap_bwrap_forward(struct netmap_kring *kring, int flags);
+
+/* append kring to q, return nonzero if q is full or asleep */
+static int
+nm_bdg_defer_enqueue(struct nm_bdg_deferq *q, struct netmap_kring *kring)
 {
-	struct nm_bridge *b, *bridges;
-	struct netmap_adapter *na;
-	struct netmap_vp_adapter *vpna;
-	char *name = nmr->nr_name;
-	int cmd = nmr->nr_cmd, namelen = strlen(name);
-	int error = 0, i, j;
-	u_int num_bridges;
+	int error = 0;
 
-	netmap_bns_getbridges(&bridges, &num_bridges);
+	mtx_lock(&q->lock);
+	if (q->sleeping || q->count == NM_BDG_DEFER_QLEN)
+		error = EBUSY;
+	else
+		q->ring[(q->head + q->count++) % NM_BDG_DEFER_QLEN] = kring;
+	mtx_unlock(&q->lock);
+	return error;
+}
 
-	switch (cmd) {
-	case NETMAP_BDG_NEWIF:
-		error = netmap_vi_create(nmr, 0 /* no autodelete */);
-		break;
+static void
+nm_bdg_defer_worker(void *data)
+{
+	struct nm_bdg_deferq *q = data;
+	struct netmap_kring *kring;
+	int error;
 
-	case NETMAP_BDG_DELIF:
-		error = nm_vi_destroy(nmr->nr_name);
-		break;
+	mtx_lock(&q->lock);
+	if (q->count == 0) {
+		if (++q->idle < NM_BDG_DEFER_IDLE) {
+			mtx_unlock(&q->lock);
+			nm_os_pause();
+			return;
+		}
+		q->sleeping = true;
+		mtx_unlock(&q->lock);
+		tsleep(q, 0, "NM_BDG_DEFER", 1);
+		mtx_lock(&q->lock);
+		q->sleeping = false;
+		mtx_unlock(&q->lock);
+		return;
+	}
+	q->idle = 0;
+	kring = q->busy = q->ring[q->head];
+	q->head = (q->head + 1) % NM_BDG_DEFER_QLEN;
+	q->count--;
+	mtx_unlock(&q->lock);
+
+	/* from now on a notification queues the ring again */
+	NM_ATOMIC_CLEAR(&kring->nkr_deferred);
+	mb();
+	for (;;) {
+		error = netmap_bwrap_forward(kring, 0);
+		/* EIO with a ring not stopped: a notification holds it */
+		if (error != NM_IRQ_RESCHED &&
+		    (error != EIO || kring->nkr_stopped))
+			break;
+		if (NM_ATOMIC_TEST_AND_SET(&kring->nkr_deferred))
+			break; /* queued again by a notification */
+		if (nm_bdg_defer_enqueue(q, kring) == 0)
+			break;
+		/* the queue is full, keep going */
+		NM_ATOMIC_CLEAR(&kring->nkr_deferred);
+	}
 
-	case NETMAP_BDG_ATTACH:
-		error = nm_bdg_ctl_attach(nmr);
-		break;
+	mtx_lock(&q->lock);
+	q->busy = NULL;
+	mtx_unlock(&q->lock);
+}
 
-	case NETMAP_BDG_DETACH:
-		error = nm_bdg_ctl_detach(nmr);
-		break;
+/*
+ * Called from the rx notification of an adapter with na_defer.
+ * Return nonzero if the caller must forward by itself.
+ */
+static int
+nm_bdg_defer(struct netmap_kring *kring)
+{
+	struct nm_bdg_deferq *q = nm_bdg_deferqs + nm_os_curcpu();
 
-	case NETMAP_BDG_LIST:
-		/* this is used to enumerate bridges and ports */
-		if (namelen) { /* look up indexes of bridge and port */
-			if (strncmp(name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
-				error = EINVAL;
-				break;
+	if (NM_ATOMIC_TEST_AND_SET(&kring->nkr_deferred))
+		return 0; /* already queued */
+	if (nm_bdg_defer_enqueue(q, kring)) {
+		NM_ATOMIC_CLEAR(&kring->nkr_deferred);
+		return EBUSY;
+	}
+	return 0;
+}
+
+/* stop the workers */
+static void
+nm_bdg_defer_fini(void)
+{
+	u_int i;
+
+	for (i = 0; i < nm_bdg_npollers; i++) {
+		struct nm_bdg_deferq *q = nm_bdg_deferqs + i;
+
+		if (q->nmk == NULL)
+			continue;
+		nm_os_kthread_stop(q->nmk);
+		nm_os_kthread_delete(q->nmk);
+		mtx_destroy(&q->lock);
+	}
+	nm_os_free(nm_bdg_deferqs);
+	nm_bdg_deferqs = NULL;
+}
+
+/* start one worker per cpu */
+static int
+nm_bdg_defer_init(void)
+{
+	struct nm_kthread_cfg kcfg;
+	u_int i;
+
+	nm_bdg_deferqs = nm_os_malloc(sizeof(*nm_bdg_deferqs) *
+		nm_bdg_npollers);
+	if (nm_bdg_deferqs == NULL)
+		return ENOMEM;
+	bzero(&kcfg, sizeof(kcfg));
+	kcfg.worker_fn = nm_bdg_defer_worker;
+	for (i = 0; i < nm_bdg_npollers; i++) {
+		struct nm_bdg_deferq *q = nm_bdg_deferqs + i;
+
+		mtx_init(&q->lock, "nm_bdg_deferq", NULL, MTX_DEF);
+		kcfg.type = i;
+		kcfg.worker_private = q;
+		q->nmk = nm_os_kthread_create(&kcfg, 0, NULL);
+		if (q->nmk == NULL) {
+			mtx_destroy(&q->lock);
+			goto fail;
+		}
+		nm_os_kthread_set_affinity(q->nmk, i);
+		if (nm_os_kthread_start(q->nmk)) {
+			D("error in nm_kthread_start()");
+			nm_os_kthread_delete(q->nmk);
+			q->nmk = NULL;
+			mtx_destroy(&q->lock);
+			goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	nm_bdg_defer_fini();
+	return EFAULT;
+}
+
+/* remove the rings of bna from the workers, and wait for them
+ * to be done with the ring they are forwarding. na_defer is
+ * already clear.
+ */
+static void
+nm_bdg_defer_purge(struct netmap_bwrap_adapter *bna)
+{
+	struct netmap_adapter *hwna = bna->hwna;
+	u_int i, j, n;
+
+	/* wait for the notifications that may still be queueing */
+	for (i = 0; i < nma_get_nrings(hwna, NR_RX); i++) {
+		struct netmap_kring *kring = NMR(hwna, NR_RX) + i;
+
+		while (kring->nr_busy)
+			tsleep(kring, 0, "NM_BDG_PURGE", 1);
+	}
+
+	for (i = 0; i < nm_bdg_npollers; i++) {
+		struct nm_bdg_deferq *q = nm_bdg_deferqs + i;
+
+		mtx_lock(&q->lock);
+		for (;;) {
+			for (j = n = 0; j < q->count; j++) {
+				struct netmap_kring *kring =
+				    q->ring[(q->head + j) % NM_BDG_DEFER_QLEN];
+
+				if (kring->na == hwna)
+					NM_ATOMIC_CLEAR(&kring->nkr_deferred);
+				else
+					q->ring[(q->head + n++) %
+					    NM_BDG_DEFER_QLEN] = kring;
 			}
-			NMG_LOCK();
-			b = nm_find_bridge(name, 0 /* don't create */);
-			if (!b) {
-				error = ENOENT;
-				NMG_UNLOCK();
+			q->count = n;
+			if (q->busy == NULL || q->busy->na != hwna)
 				break;
-			}
+			/* the worker may queue it again, look once more */
+			mtx_unlock(&q->lock);
+			tsleep(q, 0, "NM_BDG_PURGE", 1);
+			mtx_lock(&q->lock);
+		}
+		mtx_unlock(&q->lock);
+	}
+}
 
-			error = 0;
-			nmr->nr_arg1 = b - bridges; /* bridge index */
-			nmr->nr_arg2 = NM_BDG_NOPORT;
-			for (j = 0; j < b->bdg_active_ports; j++) {
+/* enable (onoff = 1) or disable deferred forwarding on bna */
+static int
+nm_bdg_ctl_defer(struct netmap_bwrap_adapter *bna, int onoff)
+{
+	int error;
+
+	if (!!bna->na_defer == !!onoff)
+		return 0;
+	if (onoff) {
+		if (bna->na_polling_state) {
+			D("ERROR adapter in polling mode");
+			return EBUSY;
+		}
+		if (nm_bdg_ndefer == 0) {
+			error = nm_bdg_defer_init();
+			if (error)
+				return error;
+		}
+		nm_bdg_ndefer++;
+		bna->na_defer = 1;
+		return 0;
+	}
+	bna->na_defer = 0;
+	mb();
+	nm_bdg_defer_purge(bna);
+	if (--nm_bdg_ndefer == 0)
+		nm_bdg_defer_fini();
+	return 0;
+}
+
+/* set the rate (slots per second, 0 for unlimited) and size of tb */
+static void
+nm_bdg_tb_init(struct nm_bdg_tb *tb, uint32_t rate, uint32_t burst)
+{
+	uint64_t freq = nm_os_cycles_freq();
+
+	bzero(tb, sizeof(*tb));
+	if (rate == 0)
+		return;
+	if (burst == 0)
+		burst = NM_BDG_SHAPE_BURST;
+	tb->tb_rate = rate;
+	tb->tb_burst = burst;
+	tb->tb_cost = freq / rate;
+	if (tb->tb_cost == 0)
+		tb->tb_cost = 1;
+	tb->tb_depth = tb->tb_cost * burst;
+}
+
+/* replace the shaper of vpna with sh (possibly NULL), and free
+ * the old one once no sender can be using it
+ */
+static void
+nm_bdg_shaper_set(struct netmap_vp_adapter *vpna, struct nm_bdg_shaper *sh)
+{
+	struct nm_bdg_shaper *old = vpna->bdg_shaper;
+	struct nm_bridge *b = vpna->na_bdg;
+
+	NMG_LOCK_ASSERT();
+	wmb(); /* fill the shaper before publishing it */
+	vpna->bdg_shaper = sh;
+	mb();
+	if (old == NULL)
+		return;
+	if (b != NULL && b->bdg_dp != NULL)
+		nm_bdg_wait_senders(b->bdg_dp);
+	mtx_destroy(&old->sh_lock);
+	nm_os_free(old);
+}
+
+/*
+ * Process NETMAP_BDG_SHAPE: nr_arg3 is the rate in slots per second
+ * (0 removes the limit) and nr_arg2 the burst, for all the rx rings
+ * of the port together (NR_REG_ALL_NIC) or for the ring in nr_ringid
+ * (NR_REG_ONE_NIC).
+ */
+static int
+nm_bdg_ctl_shape(struct nmreq *nmr, struct netmap_adapter *na)
+{
+	struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)na;
+	struct nm_bdg_shaper *sh, *old = vpna->bdg_shaper;
+	struct nm_bdg_tb *tb;
+	u_int i, r = nmr->nr_ringid & NETMAP_RING_MASK;
+	int reg = nmr->nr_flags & NR_REG_MASK, on;
+
+	NMG_LOCK_ASSERT();
+	if (reg == NR_REG_DEFAULT)
+		reg = NR_REG_ALL_NIC;
+	if (reg == NR_REG_ONE_NIC) {
+		if (r >= NM_BDG_MAXRINGS || r >= na->num_rx_rings)
+			return EINVAL;
+	} else if (reg != NR_REG_ALL_NIC) {
+		return EINVAL;
+	}
+	sh = nm_os_malloc(sizeof(*sh));
+	if (sh == NULL)
+		return ENOMEM;
+	/* keep the settings, start with full buckets */
+	for (i = 0; old && i < NM_BDG_MAXRINGS; i++)
+		nm_bdg_tb_init(&sh->sh_ring[i], old->sh_ring[i].tb_rate,
+				old->sh_ring[i].tb_burst);
+	if (old)
+		nm_bdg_tb_init(&sh->sh_port, old->sh_port.tb_rate,
+				old->sh_port.tb_burst);
+	tb = (reg == NR_REG_ONE_NIC) ? &sh->sh_ring[r] : &sh->sh_port;
+	nm_bdg_tb_init(tb, nmr->nr_arg3, nmr->nr_arg2);
+
+	on = sh->sh_port.tb_cost != 0;
+	for (i = 0; !on && i < NM_BDG_MAXRINGS; i++)
+		on = sh->sh_ring[i].tb_cost != 0;
+	if (!on) {
+		nm_os_free(sh);
+		sh = NULL;
+	} else {
+		mtx_init(&sh->sh_lock, "nm_bdg_shaper_lock", NULL, MTX_DEF);
+	}
+	nm_bdg_shaper_set(vpna, sh);
+	return 0;
+}
+
+/* the address a:b:c:d:e:f passed with nr_arg2 = a:b
+ * and nr_arg3 = c:d:e:f, see net/netmap.h
+ */
+static uint64_t
+nm_bdg_nmr_mac(const struct nmreq *nmr)
+{
+	return (nmr->nr_arg2 >> 8) | ((uint64_t)(nmr->nr_arg2 & 0xff) << 8) |
+		((uint64_t)(nmr->nr_arg3 >> 24) << 16) |
+		((uint64_t)((nmr->nr_arg3 >> 16) & 0xff) << 24) |
+		((uint64_t)((nmr->nr_arg3 >> 8) & 0xff) << 32) |
+		((uint64_t)(nmr->nr_arg3 & 0xff) << 40);
+}
+
+/* release the routes of b, once no sender can use them */
+static void
+nm_bdg_lpm_free(struct nm_bridge *b)
+{
+	struct nm_lpm *t = b->bdg_lpm;
+
+	if (t == NULL)
+		return;
+	BDG_WLOCK(b);
+	b->bdg_lpm = NULL;
+	BDG_WUNLOCK(b);
+	nm_lpm_destroy(t);
+}
+
+/*
+ * Process NETMAP_BDG_LPM: turn on (on != 0) or off the longest
+ * prefix match lookup of b, which replaces the learning bridge
+ * for the frames that match a route.
+ */
+static int
+nm_bdg_ctl_lpm(struct nm_bridge *b, int on)
+{
+	struct nm_lpm *t;
+
+	NMG_LOCK_ASSERT();
+	if (!on) {
+		if (b->bdg_lpm == NULL)
+			return 0;
+		BDG_WLOCK(b);
+		b->bdg_ops.lookup = netmap_bdg_learning;
+		b->bdg_ops.lookup_batch = netmap_bdg_learning_batch;
+		BDG_WUNLOCK(b);
+		nm_bdg_publish(b);
+		nm_bdg_lpm_free(b);
+		return 0;
+	}
+	if (b->bdg_lpm != NULL)
+		return 0;
+	if (b->bdg_ops.lookup != netmap_bdg_learning)
+		return EBUSY; /* the lookup of an external module */
+	t = nm_lpm_create(bridge_lpm_groups, bridge_lpm_routes);
+	if (t == NULL)
+		return ENOMEM;
+	BDG_WLOCK(b);
+	b->bdg_lpm = t;
+	b->bdg_ops.lookup = nm_lpm_lookup;
+	b->bdg_ops.lookup_batch = nm_lpm_lookup_batch;
+	BDG_WUNLOCK(b);
+	nm_bdg_publish(b);
+	return 0;
+}
+
+/* release the flows of b, once no sender can use them */
+static void
+nm_bdg_flow_free(struct nm_bridge *b)
+{
+	struct nm_flow *t = b->bdg_flow;
+
+	if (t == NULL)
+		return;
+	BDG_WLOCK(b);
+	b->bdg_flow = NULL;
+	BDG_WUNLOCK(b);
+	nm_flow_destroy(t);
+}
+
+/*
+ * Process NETMAP_BDG_FLOW: turn on (on != 0) or off the 5-tuple
+ * flow lookup of b, which replaces the learning bridge for the
+ * frames of the flows in the table.
+ */
+static int
+nm_bdg_ctl_flow(struct nm_bridge *b, int on)
+{
+	struct nm_flow *t;
+
+	NMG_LOCK_ASSERT();
+	if (!on) {
+		if (b->bdg_flow == NULL)
+			return 0;
+		BDG_WLOCK(b);
+		b->bdg_ops.lookup = netmap_bdg_learning;
+		b->bdg_ops.lookup_batch = netmap_bdg_learning_batch;
+		BDG_WUNLOCK(b);
+		nm_bdg_publish(b);
+		nm_bdg_flow_free(b);
+		return 0;
+	}
+	if (b->bdg_flow != NULL)
+		return 0;
+	if (b->bdg_ops.lookup != netmap_bdg_learning)
+		return EBUSY; /* routes, or an external module */
+	t = nm_flow_create(b, bridge_flow_entries);
+	if (t == NULL)
+		return ENOMEM;
+	BDG_WLOCK(b);
+	b->bdg_flow = t;
+	b->bdg_ops.lookup = nm_flow_lookup;
+	b->bdg_ops.lookup_batch = nm_flow_lookup_batch;
+	BDG_WUNLOCK(b);
+	nm_bdg_publish(b);
+	return 0;
+}
+
+/* Process NETMAP_BDG_FDB */
+static int
+nm_bdg_ctl_fdb(struct nmreq *nmr)
+{
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	struct nm_bridge *b;
+	uint64_t mac = nm_bdg_nmr_mac(nmr);
+	int error;
+
+	NMG_LOCK_ASSERT();
+	if (nmr->nr_arg1 == NETMAP_BDG_FDB_DEL) {
+		b = nm_find_bridge(nmr->nr_name, 0 /* don't create */);
+		if (b == NULL)
+			return ENOENT;
+		if (b->ht == NULL)
+			return EOPNOTSUPP; /* not a learning bridge */
+		return nm_fdb_del_static(b, mac | NM_FDB_VALID);
+	}
+	if (nmr->nr_arg1 > NETMAP_BDG_FDB_NOLEARN)
+		return EINVAL;
+	if (nmr->nr_arg1 == NETMAP_BDG_FDB_ADD &&
+	    ((mac & 1) || mac == 0))
+		return EINVAL; /* not a unicast address */
+
+	error = netmap_get_bdg_na(nmr, &na, NULL, 0);
+	if (error)
+		return error;
+	if (na == NULL)
+		return ENXIO;
+	vpna = (struct netmap_vp_adapter *)na;
+	b = vpna->na_bdg;
+	switch (nmr->nr_arg1) {
+	case NETMAP_BDG_FDB_ADD:
+		error = b->ht ? nm_fdb_add_static(b, mac | NM_FDB_VALID,
+				vpna->bdg_port) : EOPNOTSUPP;
+		break;
+	case NETMAP_BDG_FDB_LEARN:
+		vpna->bdg_nolearn = 0;
+		break;
+	case NETMAP_BDG_FDB_NOLEARN:
+		vpna->bdg_nolearn = 1;
+		break;
+	}
+	netmap_adapter_put(na);
+	return error;
+}
+
+/* Process NETMAP_BDG_MCAST */
+static int
+nm_bdg_ctl_mcast(struct nmreq *nmr)
+{
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	struct nm_bridge *b;
+	uint64_t mac;
+	int error;
+
+	NMG_LOCK_ASSERT();
+	switch (nmr->nr_arg1) {
+	case NETMAP_BDG_MCAST_SNOOP:
+	case NETMAP_BDG_MCAST_NOSNOOP:
+		b = nm_find_bridge(nmr->nr_name, 0 /* don't create */);
+		if (b == NULL)
+			return ENOENT;
+		if (nmr->nr_arg1 == NETMAP_BDG_MCAST_NOSNOOP) {
+			b->bdg_flags &= ~NM_BDG_MCSNOOP;
+			return 0;
+		}
+		error = nm_bdg_mcast_alloc(b);
+		if (!error)
+			b->bdg_flags |= NM_BDG_MCSNOOP;
+		return error;
+
+	case NETMAP_BDG_MCAST_JOIN:
+	case NETMAP_BDG_MCAST_LEAVE:
+		break;
+
+	default:
+		return EINVAL;
+	}
+
+	mac = nm_bdg_nmr_mac(nmr);
+	if (!(mac & 1) || mac == 0xffffffffffffULL)
+		return EINVAL; /* not a group address */
+
+	error = netmap_get_bdg_na(nmr, &na, NULL, 0);
+	if (error)
+		return error;
+	if (na == NULL)
+		return ENXIO;
+	vpna = (struct netmap_vp_adapter *)na;
+	b = vpna->na_bdg;
+	error = nm_bdg_mcast_alloc(b);
+	if (!error)
+		error = nm_bdg_mcast_update(b->bdg_mcast, mac, vpna->bdg_port,
+				nmr->nr_arg1 == NETMAP_BDG_MCAST_JOIN);
+	netmap_adapter_put(na);
+	return error;
+}
+
+/* Called by either user's context (netmap_ioctl())
+ * or external kernel modules (e.g., Openvswitch).
+ * Operation is indicated in nmr->nr_cmd.
+ * NETMAP_BDG_OPS that sets configure/lookup/dtor functions to the bridge
+ * requires bdg_ops argument; the other commands ignore this argument.
+ *
+ * Called without NMG_LOCK.
+ */
+int
+netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
+{
+	struct nm_bridge *b, *bridges;
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	char *name = nmr->nr_name;
+	int cmd = nmr->nr_cmd, namelen = strlen(name);
+	int error = 0, i, j;
+	u_int num_bridges;
+
+	netmap_bns_getbridges(&bridges, &num_bridges);
+
+	switch (cmd) {
+	case NETMAP_BDG_NEWIF:
+		error = netmap_vi_create(nmr, 0 /* no autodelete */);
+		break;
+
+	case NETMAP_BDG_DELIF:
+		error = nm_vi_destroy(nmr->nr_name);
+		break;
+
+	case NETMAP_BDG_ATTACH:
+		error = nm_bdg_ctl_attach(nmr);
+		break;
+
+	case NETMAP_BDG_DETACH:
+		error = nm_bdg_ctl_detach(nmr);
+		break;
+
+	case NETMAP_BDG_LIST:
+		/* this is used to enumerate bridges and ports */
+		if (namelen) { /* look up indexes of bridge and port */
+			if (strncmp(name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+				error = EINVAL;
+				break;
+			}
+			NMG_LOCK();
+			b = nm_find_bridge(name, 0 /* don't create */);
+			if (!b) {
+				error = ENOENT;
+				NMG_UNLOCK();
+				break;
+			}
+
+			error = 0;
+			nmr->nr_arg1 = b - bridges; /* bridge index */
+			nmr->nr_arg2 = NM_BDG_NOPORT;
+			for (j = 0; j < b->bdg_active_ports; j++) {
 				i = b->bdg_port_index[j];
 				vpna = b->bdg_ports[i];
 				if (vpna == NULL) {
@@ -1267,9 +2830,9 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 			j = nmr->nr_arg2;
 
 			NMG_LOCK();
-			for (error = ENOENT; i < NM_BRIDGES; i++) {
+			for (error = ENOENT; i < num_bridges; i++) {
 				b = bridges + i;
-				for ( ; j < NM_BDG_MAXPORTS; j++) {
+				for ( ; j < b->bdg_max_ports; j++) {
 					if (b->bdg_ports[j] == NULL)
 						continue;
 					vpna = b->bdg_ports[j];
@@ -1295,12 +2858,23 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 			error = EINVAL;
 			break;
 		}
+		if (nmr->nr_arg3 != NM_BDG_OPS_VERSION) {
+			D("bridge callbacks version %u, expected %u",
+				nmr->nr_arg3, NM_BDG_OPS_VERSION);
+			error = EINVAL;
+			break;
+		}
 		NMG_LOCK();
 		b = nm_find_bridge(name, 0 /* don't create */);
 		if (!b) {
 			error = EINVAL;
 		} else {
+			BDG_WLOCK(b);
 			b->bdg_ops = *bdg_ops;
+			BDG_WUNLOCK(b);
+			nm_bdg_publish(b);
+			nm_bdg_lpm_free(b); /* no longer used */
+			nm_bdg_flow_free(b);
 		}
 		NMG_UNLOCK();
 		break;
@@ -1351,34 +2925,158 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		NMG_UNLOCK();
 		break;
 
-	default:
-		D("invalid cmd (nmr->nr_cmd) (0x%x)", cmd);
-		error = EINVAL;
+	case NETMAP_BDG_DEFER:
+		NMG_LOCK();
+		error = netmap_get_bdg_na(nmr, &na, NULL, 0);
+		if (na && !error) {
+			struct netmap_bwrap_adapter *bna =
+				(struct netmap_bwrap_adapter *)na;
+			int was = 0;
+
+			if (!nm_is_bwrap(na)) {
+				error = EOPNOTSUPP;
+			} else {
+				was = bna->na_defer;
+				error = nm_bdg_ctl_defer(bna, nmr->nr_arg1);
+			}
+			/* keep a reference while deferred */
+			if (!error && !was && bna->na_defer)
+				netmap_adapter_get(na);
+			else if (!error && was && !bna->na_defer)
+				netmap_adapter_put(na);
+			netmap_adapter_put(na);
+		} else if (!na && !error) {
+			error = ENXIO;
+		}
+		NMG_UNLOCK();
 		break;
-	}
-	return error;
-}
 
-int
-netmap_bdg_config(struct nmreq *nmr)
-{
-	struct nm_bridge *b;
-	int error = EINVAL;
+	case NETMAP_BDG_MCAST:
+		NMG_LOCK();
+		error = nm_bdg_ctl_mcast(nmr);
+		NMG_UNLOCK();
+		break;
 
-	NMG_LOCK();
-	b = nm_find_bridge(nmr->nr_name, 0);
-	if (!b) {
+	case NETMAP_BDG_FDB:
+		NMG_LOCK();
+		error = nm_bdg_ctl_fdb(nmr);
 		NMG_UNLOCK();
-		return error;
-	}
-	NMG_UNLOCK();
-	/* Don't call config() with NMG_LOCK() held */
-	BDG_RLOCK(b);
-	if (b->bdg_ops.config != NULL)
-		error = b->bdg_ops.config((struct nm_ifreq *)nmr);
-	BDG_RUNLOCK(b);
-	return error;
-}
+		break;
+
+	case NETMAP_BDG_LPM:
+		if (nmr->nr_arg1 > 1) {
+			error = EINVAL;
+			break;
+		}
+		NMG_LOCK();
+		b = nm_find_bridge(name, 0 /* don't create */);
+		if (!b)
+			error = ENOENT;
+		else
+			error = nm_bdg_ctl_lpm(b, nmr->nr_arg1);
+		NMG_UNLOCK();
+		break;
+
+	case NETMAP_BDG_FLOW:
+		if (nmr->nr_arg1 > 1) {
+			error = EINVAL;
+			break;
+		}
+		NMG_LOCK();
+		b = nm_find_bridge(name, 0 /* don't create */);
+		if (!b)
+			error = ENOENT;
+		else
+			error = nm_bdg_ctl_flow(b, nmr->nr_arg1);
+		NMG_UNLOCK();
+		break;
+
+	case NETMAP_BDG_SHAPE:
+		NMG_LOCK();
+		error = netmap_get_bdg_na(nmr, &na, NULL, 0);
+		if (na && !error) {
+			error = nm_bdg_ctl_shape(nmr, na);
+			netmap_adapter_put(na);
+		} else if (!na && !error) {
+			error = ENXIO;
+		}
+		NMG_UNLOCK();
+		break;
+
+	case NETMAP_BDG_PRIO:
+		if (nmr->nr_arg1 > 1) {
+			error = EINVAL;
+			break;
+		}
+		NMG_LOCK();
+		b = nm_find_bridge(name, 0 /* don't create */);
+		if (!b) {
+			error = ENOENT;
+		} else if (nmr->nr_arg1) {
+			b->bdg_prio_weight = nmr->nr_arg2;
+			b->bdg_flags |= NM_BDG_PRIO;
+		} else {
+			b->bdg_flags &= ~NM_BDG_PRIO;
+		}
+		NMG_UNLOCK();
+		break;
+
+	case NETMAP_BDG_RXHASH:
+		if (nmr->nr_arg1 > 1) {
+			error = EINVAL;
+			break;
+		}
+		NMG_LOCK();
+		b = nm_find_bridge(name, 0 /* don't create */);
+		if (!b) {
+			error = ENOENT;
+		} else if (nmr->nr_arg1) {
+			b->bdg_flags |= NM_BDG_RXHASH;
+		} else {
+			b->bdg_flags &= ~NM_BDG_RXHASH;
+		}
+		NMG_UNLOCK();
+		break;
+
+	default:
+		D("invalid cmd (nmr->nr_cmd) (0x%x)", cmd);
+		error = EINVAL;
+		break;
+	}
+	return error;
+}
+
+int
+netmap_bdg_config(struct nmreq *nmr)
+{
+	struct nm_bridge *b;
+	int error = EINVAL;
+
+	NMG_LOCK();
+	b = nm_find_bridge(nmr->nr_name, 0);
+	if (!b) {
+		NMG_UNLOCK();
+		return error;
+	}
+	if (b->bdg_lpm) {
+		/* routes are updated under NMG_LOCK, see netmap_lpm.c */
+		error = nm_lpm_config(b, b->bdg_lpm, (struct nm_ifreq *)nmr);
+		NMG_UNLOCK();
+		return error;
+	}
+	if (b->bdg_flow) {
+		error = nm_flow_config(b, b->bdg_flow, (struct nm_ifreq *)nmr);
+		NMG_UNLOCK();
+		return error;
+	}
+	NMG_UNLOCK();
+	/* Don't call config() with NMG_LOCK() held */
+	BDG_RLOCK(b);
+	if (b->bdg_ops.config != NULL)
+		error = b->bdg_ops.config((struct nm_ifreq *)nmr);
+	BDG_RUNLOCK(b);
+	return error;
+}
 
 
 /* nm_krings_create callback for VALE ports.
@@ -1430,7 +3128,7 @@ netmap_vp_krings_delete(struct netmap_adapter *na)
 
 static int
 nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n,
-	struct netmap_vp_adapter *na, u_int ring_nr);
+	struct netmap_vp_adapter *na, struct netmap_kring *kring, u_int start);
 
 
 /*
@@ -1447,22 +3145,15 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		(struct netmap_vp_adapter*)kring->na;
 	struct netmap_ring *ring = kring->ring;
 	struct nm_bdg_fwd *ft;
-	u_int ring_nr = kring->ring_id;
 	u_int j = kring->nr_hwcur, lim = kring->nkr_num_slots - 1;
 	u_int ft_i = 0;	/* start from 0 */
+	u_int ft_start = j; /* ring position of ft[0] */
 	u_int frags = 1; /* how many frags ? */
-	struct nm_bridge *b = na->na_bdg;
 
-	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	/* Modifications to the bridge do not block us, they wait
+	 * until we are out of here (see nm_bdg_publish()).
 	 */
-	ND("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
-		BDG_RLOCK(b);
-	else if (!BDG_RTRYLOCK(b))
-		return 0;
-	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	nm_bdg_enter(kring);
 	ft = kring->nkr_ft;
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
@@ -1498,8 +3189,10 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 			RD(5, "%d frags at %d", frags, ft_i - frags);
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
-		if (unlikely((int)ft_i >= bridge_batch))
-			ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
+		if (unlikely((int)ft_i >= bridge_batch)) {
+			ft_i = nm_bdg_flush(ft, ft_i, na, kring, ft_start);
+			ft_start = nm_next(j, lim);
+		}
 	}
 	if (frags > 1) {
 		/* Here ft_i > 0, ft[ft_i-1].flags has NS_MOREFRAG, and we
@@ -1510,8 +3203,8 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		D("Truncate incomplete fragment at %d (%d frags)", ft_i, frags);
 	}
 	if (ft_i)
-		ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
-	BDG_RUNLOCK(b);
+		ft_i = nm_bdg_flush(ft, ft_i, na, kring, ft_start);
+	nm_bdg_exit(kring);
 	return j;
 }
 
@@ -1539,24 +3232,612 @@ do {                                                                    \
 
 
 static __inline uint32_t
-nm_bridge_rthash(const uint8_t *addr)
+nm_bridge_rthash(uint64_t mac)
 {
         uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hask key
 
-        b += addr[5] << 8;
-        b += addr[4];
-        a += addr[3] << 24;
-        a += addr[2] << 16;
-        a += addr[1] << 8;
-        a += addr[0];
+        /* mac holds the address bytes starting from the LSB */
+        b += (mac >> 32) & 0xffff;
+        a += (uint32_t)mac;
 
         mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-        return (c & BRIDGE_RTHASH_MASK);
+        return c;
+}
+
+/* same as above, for three 32 bit words */
+static __inline uint32_t
+nm_bridge_rthash3(uint32_t x, uint32_t y, uint32_t z)
+{
+	uint32_t a = 0x9e3779b9 + x, b = 0x9e3779b9 + y, c = z;
+
+	mix(a, b, c);
+	return c;
 }
 
 #undef mix
 
+/*
+ * On x86 cpus with SSE4.2 the forwarding table uses the crc32c
+ * instruction, which is much cheaper than the mix() above and
+ * does not touch the FPU/SIMD state, so it is safe in any context.
+ * The choice is made once, in netmap_init_bridges(), because
+ * all the tables must be accessed with the same hash function.
+ */
+static int nm_bdg_use_crc32c = 0;
+
+#if defined(__x86_64__)
+static int
+nm_cpu_has_sse42(void)
+{
+	uint32_t eax = 1, ebx, ecx = 0, edx;
+
+	__asm__ __volatile__("cpuid"
+		: "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx));
+	return (ecx >> 20) & 1;
+}
+
+static __inline uint32_t
+nm_bridge_crc32c(uint64_t mac)
+{
+	uint64_t c = 0x9e3779b9;
+
+	__asm__("crc32q %1, %0" : "+r" (c) : "rm" (mac));
+	return (uint32_t)c;
+}
+
+static __inline uint32_t
+nm_bridge_crc32c3(uint32_t x, uint32_t y, uint32_t z)
+{
+	uint64_t c = 0x9e3779b9;
+	uint32_t c32;
+
+	__asm__("crc32q %1, %0" : "+r" (c) : "rm" (((uint64_t)x << 32) | y));
+	c32 = (uint32_t)c;
+	__asm__("crc32l %1, %0" : "+r" (c32) : "rm" (z));
+	return c32;
+}
+#else /* !__x86_64__ */
+#define nm_cpu_has_sse42()	0
+#define nm_bridge_crc32c(mac)	nm_bridge_rthash(mac)
+#define nm_bridge_crc32c3(x, y, z)	nm_bridge_rthash3(x, y, z)
+#endif /* !__x86_64__ */
+
+/* hash of a 48 bit MAC address (without NM_FDB_VALID) */
+static __inline uint32_t
+nm_bdg_mac_hash(uint64_t mac)
+{
+	return nm_bdg_use_crc32c ? nm_bridge_crc32c(mac) : nm_bridge_rthash(mac);
+}
+
+/* hash of three words describing a flow */
+static __inline uint32_t
+nm_bdg_flow_hash(uint32_t x, uint32_t y, uint32_t z)
+{
+	return nm_bdg_use_crc32c ? nm_bridge_crc32c3(x, y, z) :
+		nm_bridge_rthash3(x, y, z);
+}
+
+
+/*
+ * Forwarding database helpers. Each address hashes to two
+ * buckets, the second one is derived from the high bits of the hash.
+ */
+static inline struct nm_hash_ent *
+nm_fdb_bucket(struct nm_bridge *b, uint32_t h, int which)
+{
+	u_int i = h & b->ht_mask;
+
+	if (which) {
+		u_int i2 = ((h >> 16) | (h << 16)) & b->ht_mask;
+		i = (i2 == i) ? i ^ 1 : i2;
+	}
+	return b->ht + i * NM_FDB_WAYS;
+}
+
+static inline void
+nm_fdb_prefetch(struct nm_bridge *b, uint32_t h, int rw)
+{
+	__builtin_prefetch(nm_fdb_bucket(b, h, 0), rw);
+	__builtin_prefetch(nm_fdb_bucket(b, h, 1), rw);
+}
+
+static inline int
+nm_fdb_expired(const struct nm_hash_ent *e, uint32_t now)
+{
+	return bridge_fdb_ageing && now - e->ts > bridge_fdb_ageing &&
+		!(e->flags & NM_FDB_STATIC);
+}
+
+/* return the entry for 'mac' (NM_FDB_VALID set), or NULL */
+static inline struct nm_hash_ent *
+nm_fdb_find(struct nm_bridge *b, uint64_t mac, uint32_t h)
+{
+	int k, w;
+
+	for (k = 0; k < 2; k++) {
+		struct nm_hash_ent *e = nm_fdb_bucket(b, h, k);
+
+		for (w = 0; w < NM_FDB_WAYS; w++) {
+			if (e[w].mac == mac)
+				return e + w;
+		}
+	}
+	return NULL;
+}
+
+/* return a free (or expired) entry in the bucket, or NULL */
+static inline struct nm_hash_ent *
+nm_fdb_free_ent(struct nm_hash_ent *e, uint32_t now)
+{
+	int w;
+
+	for (w = 0; w < NM_FDB_WAYS; w++) {
+		if (e[w].mac == 0 || nm_fdb_expired(e + w, now))
+			return e + w;
+	}
+	return NULL;
+}
+
+/*
+ * Record that 'mac' (NM_FDB_VALID set), whose hash is 'h',
+ * has been seen on 'port'.
+ * If both buckets are full, entries are moved to their alternate
+ * bucket to make room (at most NM_FDB_MAX_KICKS times), and as
+ * a last resort the oldest entry in the last bucket is replaced.
+ * Static entries are never moved or replaced.
+ * Like the old direct-mapped table, updates from concurrent senders
+ * are not serialized: at worst an address is forgotten and its
+ * traffic is flooded until it is learned again.
+ */
+static void
+nm_fdb_learn(struct nm_bridge *b, uint64_t mac, uint32_t h,
+		u_int port, uint32_t now)
+{
+	struct nm_hash_ent *e, *b1, *b2, cur;
+	int kick, w;
+
+	e = nm_fdb_find(b, mac, h);
+	if (e != NULL && (e->flags & NM_FDB_STATIC))
+		return; /* pinned */
+	if (e == NULL) {
+		b1 = nm_fdb_bucket(b, h, 0);
+		b2 = nm_fdb_bucket(b, h, 1);
+		e = nm_fdb_free_ent(b1, now);
+		if (e == NULL)
+			e = nm_fdb_free_ent(b2, now);
+	}
+	if (e != NULL) {
+		e->ports = port;
+		e->flags = 0;
+		e->ts = now;
+		e->mac = mac;
+		return;
+	}
+
+	/* both buckets full, displace entries */
+	cur.mac = mac;
+	cur.ports = port;
+	cur.flags = 0;
+	cur.ts = now;
+	e = b1;
+	for (kick = 0; kick < NM_FDB_MAX_KICKS; kick++) {
+		struct nm_hash_ent victim, *alt, *f;
+		uint32_t vh;
+
+		/* evict a pseudo-random dynamic way, then try the
+		 * victim's alternate bucket
+		 */
+		for (w = 0; w < NM_FDB_WAYS; w++) {
+			if (!(e[(h + kick + w) % NM_FDB_WAYS].flags &
+			    NM_FDB_STATIC))
+				break;
+		}
+		if (w == NM_FDB_WAYS)
+			return; /* all static, forget cur */
+		w = (h + kick + w) % NM_FDB_WAYS;
+		victim = e[w];
+		e[w] = cur;
+		vh = nm_bdg_mac_hash(victim.mac & ~NM_FDB_VALID);
+		alt = nm_fdb_bucket(b, vh, 0);
+		if (alt == e)
+			alt = nm_fdb_bucket(b, vh, 1);
+		f = nm_fdb_free_ent(alt, now);
+		if (f != NULL) {
+			*f = victim;
+			return;
+		}
+		cur = victim;
+		e = alt;
+	}
+	/* no room, replace the oldest dynamic entry in the last bucket,
+	 * or forget cur (which is dynamic) if there is none
+	 */
+	for (w = 0, kick = -1; w < NM_FDB_WAYS; w++) {
+		if (e[w].flags & NM_FDB_STATIC)
+			continue;
+		if (kick < 0 || (int32_t)(e[w].ts - e[kick].ts) < 0)
+			kick = w;
+	}
+	if (kick >= 0)
+		e[kick] = cur;
+}
+
+/*
+ * Install a static entry for 'mac' (NM_FDB_VALID set) on 'port',
+ * replacing the current entry for the address if any, or a free,
+ * expired or (as a last resort) dynamic entry of its buckets.
+ * Called with NMG_LOCK held. Senders may be learning at the same
+ * time and overwrite the new entry, so we check and retry.
+ */
+static int
+nm_fdb_add_static(struct nm_bridge *b, uint64_t mac, u_int port)
+{
+	uint32_t h = nm_bdg_mac_hash(mac & ~NM_FDB_VALID);
+	uint32_t now = time_second;
+	struct nm_hash_ent *e;
+	int tries, k, w;
+
+	for (tries = 0; tries < 4; tries++) {
+		e = nm_fdb_find(b, mac, h);
+		for (k = 0; e == NULL && k < 2; k++)
+			e = nm_fdb_free_ent(nm_fdb_bucket(b, h, k), now);
+		for (k = 0; e == NULL && k < 2; k++) {
+			struct nm_hash_ent *bk = nm_fdb_bucket(b, h, k);
+
+			for (w = 0; w < NM_FDB_WAYS; w++) {
+				if (!(bk[w].flags & NM_FDB_STATIC)) {
+					e = bk + w;
+					break;
+				}
+			}
+		}
+		if (e == NULL)
+			return ENOSPC; /* all static */
+		e->flags = NM_FDB_STATIC;
+		e->ports = port;
+		e->ts = now;
+		e->mac = mac;
+		mb();
+		e = nm_fdb_find(b, mac, h);
+		if (e != NULL && (e->flags & NM_FDB_STATIC) && e->ports == port)
+			return 0;
+	}
+	return EBUSY;
+}
+
+/* remove the static entry for 'mac' (NM_FDB_VALID set) */
+static int
+nm_fdb_del_static(struct nm_bridge *b, uint64_t mac)
+{
+	struct nm_hash_ent *e;
+
+	e = nm_fdb_find(b, mac, nm_bdg_mac_hash(mac & ~NM_FDB_VALID));
+	if (e == NULL || !(e->flags & NM_FDB_STATIC))
+		return ENOENT;
+	e->mac = 0;
+	e->flags = 0;
+	return 0;
+}
+
+
+/* slot of group mac in the multicast table, or -1 if not there */
+static inline int
+nm_bdg_mcast_find(struct nm_bdg_mcast *mc, uint64_t mac)
+{
+	u_int i, g = nm_bdg_mac_hash(mac) & (NM_BDG_MCAST_GROUPS - 1);
+
+	for (i = 0; i < NM_BDG_MCAST_GROUPS; i++) {
+		if (mc->mc_mac[g] == mac)
+			return g;
+		if (mc->mc_mac[g] == 0)
+			break;
+		g = (g + 1) & (NM_BDG_MCAST_GROUPS - 1);
+	}
+	return -1;
+}
+
+/* whether port is subscribed to group g */
+static inline int
+nm_bdg_mcast_member(struct nm_bdg_mcast *mc, u_int g, u_int port)
+{
+	struct nm_bdg_mgroup *mg = mc->mc_grp[g];
+
+	return mg != NULL && (mg->mg_ports[port / 32] & (1U << (port % 32)));
+}
+
+/*
+ * Subscribe port to (join != 0) or unsubscribe it from group mac.
+ * Called by the control path and by the snooping code in the lookup.
+ */
+static int
+nm_bdg_mcast_update(struct nm_bdg_mcast *mc, uint64_t mac, u_int port,
+		int join)
+{
+	struct nm_bdg_mgroup *mg;
+	uint32_t *w, bit = 1U << (port % 32);
+	u_int i;
+	int g, error = 0;
+
+	mtx_lock(&mc->mc_lock);
+	g = nm_bdg_mcast_find(mc, mac);
+	if (g < 0) {
+		if (!join)
+			goto out; /* nothing to do */
+		/* take the first unused slot in the probe sequence */
+		g = nm_bdg_mac_hash(mac) & (NM_BDG_MCAST_GROUPS - 1);
+		for (i = 0; i < NM_BDG_MCAST_GROUPS; i++) {
+			if (mc->mc_mac[g] == 0 ||
+			    (mc->mc_grp[g]->mg_nports == 0 &&
+			     mc->mc_grp[g]->mg_refs == 0))
+				break;
+			g = (g + 1) & (NM_BDG_MCAST_GROUPS - 1);
+		}
+		if (i == NM_BDG_MCAST_GROUPS) {
+			error = ENOSPC;
+			goto out;
+		}
+		if (mc->mc_grp[g] == NULL) {
+			mg = nm_os_malloc(sizeof(*mg));
+			if (mg == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+			mc->mc_grp[g] = mg;
+			wmb(); /* the group before its address */
+		}
+		mc->mc_mac[g] = mac;
+	}
+	mg = mc->mc_grp[g];
+	w = &mg->mg_ports[port / 32];
+	if (join && !(*w & bit)) {
+		*w |= bit;
+		mg->mg_nports++;
+	} else if (!join && (*w & bit)) {
+		*w &= ~bit;
+		mg->mg_nports--;
+	}
+out:
+	mtx_unlock(&mc->mc_lock);
+	return error;
+}
+
+/*
+ * Destination, in *dst, for the frames that go to both port and
+ * mirror, for the lookup modules: a multicast group of the two
+ * ports, named by a key that is not a MAC address, so that the
+ * learning bridge and the snooping code never use it.
+ * Each call takes a reference on the group, to be dropped with
+ * netmap_bdg_mirror_put().
+ * Called with NMG_LOCK held.
+ */
+#define NM_BDG_MIRROR_KEY(p, m)	((1ULL << 48) | ((uint64_t)(p) << 24) | (m))
+#define NM_BDG_MIRROR_PORT(k)	((u_int)((k) >> 24) & 0xffffff)
+#define NM_BDG_MIRROR_MIRROR(k)	((u_int)(k) & 0xffffff)
+
+int
+netmap_bdg_mirror(struct nm_bridge *b, u_int port, u_int mirror, u_int *dst)
+{
+	uint64_t key = NM_BDG_MIRROR_KEY(port, mirror);
+	struct nm_bdg_mcast *mc;
+	int error, g;
+
+	NMG_LOCK_ASSERT();
+	error = nm_bdg_mcast_alloc(b);
+	if (error)
+		return error;
+	mc = b->bdg_mcast;
+	error = nm_bdg_mcast_update(mc, key, port, 1);
+	if (error)
+		return error;
+	error = nm_bdg_mcast_update(mc, key, mirror, 1);
+	if (error) {
+		nm_bdg_mcast_update(mc, key, port, 0);
+		return error;
+	}
+	mtx_lock(&mc->mc_lock);
+	g = nm_bdg_mcast_find(mc, key);
+	if (g >= 0)
+		mc->mc_grp[g]->mg_refs++;
+	mtx_unlock(&mc->mc_lock);
+	if (g < 0)
+		return ENOENT;
+	*dst = NM_BDG_MCAST(g);
+	return 0;
+}
+
+/*
+ * Drop a reference taken by netmap_bdg_mirror() on the group dst.
+ * With the last one the two ports leave the group, which can then
+ * be reused.
+ */
+void
+netmap_bdg_mirror_put(struct nm_bridge *b, u_int dst)
+{
+	struct nm_bdg_mcast *mc = b->bdg_mcast;
+	struct nm_bdg_mgroup *mg;
+	u_int g = dst - NM_BDG_MCAST(0), i, p[2];
+	uint64_t key;
+
+	if (mc == NULL || !NM_BDG_IS_MCAST(dst))
+		return;
+	mtx_lock(&mc->mc_lock);
+	mg = mc->mc_grp[g];
+	if (mg == NULL || mg->mg_refs == 0 || --mg->mg_refs > 0)
+		goto out;
+	key = mc->mc_mac[g];
+	p[0] = NM_BDG_MIRROR_PORT(key);
+	p[1] = NM_BDG_MIRROR_MIRROR(key);
+	for (i = 0; i < 2; i++) {
+		uint32_t *w = &mg->mg_ports[p[i] / 32], bit = 1U << (p[i] % 32);
+
+		if (p[i] < NM_BDG_MAXPORTS && (*w & bit)) {
+			*w &= ~bit;
+			mg->mg_nports--;
+		}
+	}
+out:
+	mtx_unlock(&mc->mc_lock);
+}
+
+/* group addresses of IPv4 and IPv6 multicast groups */
+static inline uint64_t
+nm_bdg_mcast_mac4(const uint8_t *g)
+{
+	return 0x5e0001ULL | ((uint64_t)(g[1] & 0x7f) << 24) |
+		((uint64_t)g[2] << 32) | ((uint64_t)g[3] << 40);
+}
+
+static inline uint64_t
+nm_bdg_mcast_mac6(const uint8_t *g)
+{
+	return 0x3333ULL | ((uint64_t)g[12] << 16) | ((uint64_t)g[13] << 24) |
+		((uint64_t)g[14] << 32) | ((uint64_t)g[15] << 40);
+}
+
+/* record types of IGMPv3 and MLDv2 reports. Block records are
+ * ignored, the others mean that the host wants the traffic of the
+ * group (join) unless they include an empty list of sources (leave)
+ */
+#define NM_MCREC_IS_IN		1
+#define NM_MCREC_IS_EX		2
+#define NM_MCREC_TO_IN		3
+#define NM_MCREC_TO_EX		4
+#define NM_MCREC_ALLOW		5
+
+static inline int
+nm_bdg_mcast_rec_join(u_int type, u_int nsrc)
+{
+	return type == NM_MCREC_IS_EX || type == NM_MCREC_TO_EX || nsrc > 0;
+}
+
+/*
+ * IGMP/MLD snooping. If the packet from port na is a membership
+ * report or a leave message, update the group table.
+ * Groups are tracked by their MAC address, so groups which map to
+ * the same address are merged. Link-local groups (224.0.0.0/24 and
+ * scopes 1 and 2 in IPv6) are always flooded and not tracked.
+ * Returns 1 for IGMP and MLD messages, which are flooded, 0 otherwise.
+ */
+static int
+nm_bdg_mcast_snoop(struct nm_bdg_mcast *mc, struct nm_bdg_fwd *ft,
+		struct netmap_vp_adapter *na)
+{
+	uint8_t *buf = ft->ft_buf + na->up.virt_hdr_len, *p;
+	int len = (int)ft->ft_len - (int)na->up.virt_hdr_len;
+	u_int port = na->bdg_port, n, type, nsrc;
+	int l2 = 14, l4, k;
+	uint16_t ethtype;
+
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14 + 20)
+		return 0;
+	ethtype = (buf[12] << 8) | buf[13];
+	if (ethtype == 0x8100) { /* 802.1Q */
+		ethtype = (buf[16] << 8) | buf[17];
+		l2 = 18;
+	}
+	if (ethtype == 0x0800 && len >= l2 + 20) {
+		uint8_t *ip = buf + l2;
+
+		if ((ip[0] >> 4) != 4 || ip[9] != 2 /* IGMP */)
+			return 0;
+		l4 = l2 + (ip[0] & 0xf) * 4;
+		if (len < l4 + 8)
+			return 1;
+		p = buf + l4;
+		switch (p[0]) {
+		case 0x12: /* v1 report */
+		case 0x16: /* v2 report */
+		case 0x17: /* v2 leave */
+			if ((p[4] & 0xf0) == 0xe0 &&
+			    !(p[4] == 224 && p[5] == 0 && p[6] == 0))
+				nm_bdg_mcast_update(mc, nm_bdg_mcast_mac4(p + 4),
+					port, p[0] != 0x17);
+			break;
+		case 0x22: /* v3 report */
+			n = (p[6] << 8) | p[7];
+			for (k = l4 + 8; n > 0 && len >= k + 8; n--) {
+				p = buf + k;
+				type = p[0];
+				nsrc = (p[2] << 8) | p[3];
+				if ((p[4] & 0xf0) == 0xe0 &&
+				    !(p[4] == 224 && p[5] == 0 && p[6] == 0) &&
+				    type >= NM_MCREC_IS_IN &&
+				    type <= NM_MCREC_ALLOW)
+					nm_bdg_mcast_update(mc,
+						nm_bdg_mcast_mac4(p + 4), port,
+						nm_bdg_mcast_rec_join(type, nsrc));
+				k += 8 + 4 * (nsrc + p[1]);
+			}
+			break;
+		}
+		return 1;
+	} else if (ethtype == 0x86dd && len >= l2 + 40) {
+		uint8_t *ip6 = buf + l2;
+		u_int nh = ip6[6];
+
+		l4 = l2 + 40;
+		if (nh == 0 /* hop-by-hop, with the router alert */) {
+			if (len < l4 + 8)
+				return 0;
+			nh = buf[l4];
+			l4 += (buf[l4 + 1] + 1) * 8;
+		}
+		if (nh != 58 /* ICMPv6 */ || len < l4 + 8)
+			return 0;
+		p = buf + l4;
+		switch (p[0]) {
+		case 130: /* query */
+			break;
+		case 131: /* v1 report */
+		case 132: /* v1 done */
+			if (len >= l4 + 24 && p[8] == 0xff &&
+			    (p[9] & 0xf) > 2)
+				nm_bdg_mcast_update(mc, nm_bdg_mcast_mac6(p + 8),
+					port, p[0] == 131);
+			break;
+		case 143: /* v2 report */
+			n = (p[6] << 8) | p[7];
+			for (k = l4 + 8; n > 0 && len >= k + 20; n--) {
+				p = buf + k;
+				type = p[0];
+				nsrc = (p[2] << 8) | p[3];
+				if (p[4] == 0xff && (p[5] & 0xf) > 2 &&
+				    type >= NM_MCREC_IS_IN &&
+				    type <= NM_MCREC_ALLOW)
+					nm_bdg_mcast_update(mc,
+						nm_bdg_mcast_mac6(p + 4), port,
+						nm_bdg_mcast_rec_join(type, nsrc));
+				k += 20 + 16 * nsrc + 4 * p[1];
+			}
+			break;
+		default: /* not MLD */
+			return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* destination for the multicast (or broadcast) address dmac:
+ * the group, if it has subscribers, or all the ports
+ */
+static inline u_int
+nm_bdg_lookup_mcast(struct nm_bridge *b, struct nm_bdg_fwd *ft,
+		struct netmap_vp_adapter *na, uint64_t dmac)
+{
+	struct nm_bdg_mcast *mc = b->bdg_mcast;
+	int g;
+
+	if (mc == NULL)
+		return NM_BDG_BROADCAST;
+	if ((b->bdg_flags & NM_BDG_MCSNOOP) && nm_bdg_mcast_snoop(mc, ft, na))
+		return NM_BDG_BROADCAST;
+	g = nm_bdg_mcast_find(mc, dmac);
+	if (g < 0 || mc->mc_grp[g]->mg_nports == 0)
+		return NM_BDG_BROADCAST;
+	return NM_BDG_MCAST(g);
+}
+
 
 /* nm_register callback for VALE ports */
 static int
@@ -1567,11 +3848,6 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 	enum txrx t;
 	int i;
 
-	/* persistent ports may be put in netmap mode
-	 * before being attached to a bridge
-	 */
-	if (vpna->na_bdg)
-		BDG_WLOCK(vpna->na_bdg);
 	if (onoff) {
 		for_rx_tx(t) {
 			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
@@ -1593,84 +3869,309 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
-				if (nm_kring_pending_off(kring))
-					kring->nr_mode = NKR_NETMAP_OFF;
-			}
-		}
+				if (nm_kring_pending_off(kring))
+					kring->nr_mode = NKR_NETMAP_OFF;
+			}
+		}
+	}
+	/* persistent ports may be put in netmap mode
+	 * before being attached to a bridge. If attached, update
+	 * the list of destinations, which also waits for the
+	 * senders which may still be writing into our rings.
+	 */
+	if (vpna->na_bdg)
+		nm_bdg_publish(vpna->na_bdg);
+	return 0;
+}
+
+
+/*
+ * Extract the destination and source MAC addresses of the packet
+ * starting at ft (the top 16 bits of the results are 0).
+ * Returns 0 on success, -1 if the packet is malformed.
+ */
+static inline int
+nm_bdg_get_macs(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		uint64_t *dmac, uint64_t *smac)
+{
+	uint8_t *buf = ft->ft_buf;
+	u_int buf_len = ft->ft_len;
+	uint8_t indbuf[12];
+
+	/* safety check, unfortunately we have many cases */
+	if (buf_len >= 14 + na->up.virt_hdr_len) {
+		/* virthdr + mac_hdr in the same slot */
+		buf += na->up.virt_hdr_len;
+		buf_len -= na->up.virt_hdr_len;
+	} else if (buf_len == na->up.virt_hdr_len && ft->ft_flags & NS_MOREFRAG) {
+		/* only header in first fragment */
+		ft++;
+		buf = ft->ft_buf;
+		buf_len = ft->ft_len;
+	} else {
+		RD(5, "invalid buf format, length %d", buf_len);
+		return -1;
+	}
+
+	if (ft->ft_flags & NS_INDIRECT) {
+		if (copyin(buf, indbuf, sizeof(indbuf))) {
+			return -1;
+		}
+		buf = indbuf;
+	}
+
+	*dmac = le64toh(*(uint64_t *)(buf)) & 0xffffffffffff;
+	*smac = le64toh(*(uint64_t *)(buf + 4)) >> 16;
+	return 0;
+}
+
+#define NM_ROL32(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+
+/*
+ * Hash of the flow the packet belongs to, used with NM_BDG_RXHASH
+ * to select the rx ring of the destination. The hash is symmetric
+ * (the endpoints are combined with + and ^) so that both directions
+ * of a connection land on the same ring index.
+ * TCP and UDP use the 5-tuple, other IPv4/IPv6 traffic the
+ * addresses and protocol, anything else (including indirect buffers
+ * and headers split over fragments) the MAC addresses.
+ * IPv6 extension headers are not followed.
+ */
+static inline uint32_t
+nm_bdg_rxhash(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		uint64_t dmac, uint64_t smac)
+{
+	uint8_t *buf = ft->ft_buf + na->up.virt_hdr_len;
+	int len = (int)ft->ft_len - (int)na->up.virt_hdr_len;
+	int l2 = 14, l4 = 0;
+	uint32_t x, y, z, s, d;
+	uint16_t ethtype;
+	u_int proto = 0, k;
+
+	x = (uint32_t)dmac + (uint32_t)smac;
+	y = (uint32_t)dmac ^ (uint32_t)smac;
+	z = ((uint32_t)((dmac >> 32) + (smac >> 32)) << 16) |
+		(uint16_t)((dmac ^ smac) >> 32);
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14 + 20)
+		goto done;
+
+	ethtype = (buf[12] << 8) | buf[13];
+	if (ethtype == 0x8100) { /* 802.1Q */
+		ethtype = (buf[16] << 8) | buf[17];
+		l2 = 18;
+	}
+	if (ethtype == 0x0800 && len >= l2 + 20) {
+		uint8_t *ip = buf + l2;
+
+		if ((ip[0] >> 4) != 4)
+			goto done;
+		memcpy(&s, ip + 12, 4);
+		memcpy(&d, ip + 16, 4);
+		x = s + d;
+		y = s ^ d;
+		proto = ip[9];
+		/*
+		 * Fragments are hashed without the ports, the first
+		 * one too (MF is in the test), so that all the pieces
+		 * of a datagram go to the same ring.
+		 */
+		if ((ip[6] & 0x3f) == 0 && ip[7] == 0)
+			l4 = l2 + (ip[0] & 0xf) * 4;
+	} else if (ethtype == 0x86dd && len >= l2 + 40) {
+		uint8_t *ip6 = buf + l2;
+
+		x = y = 0;
+		for (k = 0; k < 16; k += 4) {
+			memcpy(&s, ip6 + 8 + k, 4);
+			memcpy(&d, ip6 + 24 + k, 4);
+			x = NM_ROL32(x, 5) + s + d;
+			y = NM_ROL32(y, 5) ^ s ^ d;
+		}
+		proto = ip6[6];
+		l4 = l2 + 40;
+	} else {
+		goto done;
+	}
+	x += proto;
+	z = 0;
+	if ((proto == 6 /* TCP */ || proto == 17 /* UDP */) &&
+			l4 && len >= l4 + 4) {
+		uint16_t sp = (buf[l4] << 8) | buf[l4 + 1];
+		uint16_t dp = (buf[l4 + 2] << 8) | buf[l4 + 3];
+
+		z = ((uint32_t)(uint16_t)(sp + dp) << 16) | (uint16_t)(sp ^ dp);
+	}
+done:
+	return nm_bdg_flow_hash(x, y, z);
+}
+
+#undef NM_ROL32
+
+/* set the rx ring for a packet to port dst, given the flow hash h.
+ * Broadcasts and multicasts use the hash modulo NM_BDG_MAXRINGS,
+ * the flush reduces it to the number of rings of each destination.
+ */
+static inline void
+nm_bdg_rxhash_ring(struct nm_bridge *b, u_int dst, uint32_t h,
+		uint8_t *dst_ring)
+{
+	struct netmap_vp_adapter *vpna;
+
+	if (dst == NM_BDG_BROADCAST || NM_BDG_IS_MCAST(dst)) {
+		*dst_ring = h & (NM_BDG_MAXRINGS - 1);
+	} else if (dst < b->bdg_dp->max_ports &&
+			(vpna = b->bdg_dp->ports[dst]) != NULL) {
+		*dst_ring = h % vpna->up.num_rx_rings;
+	}
+}
+
+/* whether the source address must be (re)learned.
+ * The hash is somewhat expensive, so we only update the entry
+ * when the source changes, or once per second to refresh
+ * its timestamp for ageing.
+ */
+static inline int
+nm_bdg_src_stale(uint64_t smac, uint64_t last_smac, uint32_t last_ts,
+		uint32_t now)
+{
+	return (smac & 1) == 0 /* valid src */ &&
+		(smac != last_smac || last_ts != now);
+}
+
+/* update source port forwarding entry */
+static inline void
+nm_bdg_learn_src(struct netmap_vp_adapter *na, uint64_t smac, uint32_t sh,
+		uint32_t now)
+{
+	nm_fdb_learn(na->na_bdg, smac | NM_FDB_VALID, sh, na->bdg_port, now);
+	na->last_smac = smac;
+	na->last_smac_ts = now;
+	if (netmap_verbose)
+	    D("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
+		(u_int)(smac & 0xff), (u_int)(smac >> 8) & 0xff,
+		(u_int)(smac >> 16) & 0xff, (u_int)(smac >> 24) & 0xff,
+		(u_int)(smac >> 32) & 0xff, (u_int)(smac >> 40) & 0xff,
+		na->bdg_port);
+}
+
+/* destination port for dmac, whose hash is dh */
+static inline u_int
+nm_bdg_lookup_dst(struct nm_bridge *b, uint64_t dmac, uint32_t dh,
+		uint32_t now)
+{
+	struct nm_hash_ent *e;
+
+	if (dmac & 1) /* multicast */
+		return NM_BDG_BROADCAST;
+	e = nm_fdb_find(b, dmac | NM_FDB_VALID, dh);
+	if (e != NULL && !nm_fdb_expired(e, now)) { /* found dst */
+		return e->ports;
 	}
-	if (vpna->na_bdg)
-		BDG_WUNLOCK(vpna->na_bdg);
-	return 0;
+	/* XXX otherwise return NM_BDG_UNKNOWN ? */
+	return NM_BDG_BROADCAST;
 }
 
-
 /*
  * Lookup function for a learning bridge.
  * Update the hash table with the source address,
  * and then returns the destination port index, and the
- * ring in *dst_ring (at the moment, always use ring 0)
+ * ring in *dst_ring (unchanged unless NM_BDG_RXHASH is set)
  */
 u_int
 netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *na)
 {
-	uint8_t *buf = ft->ft_buf;
-	u_int buf_len = ft->ft_len;
-	struct nm_hash_ent *ht = na->na_bdg->ht;
-	uint32_t sh, dh;
-	u_int dst, mysrc = na->bdg_port;
+	struct nm_bridge *b = na->na_bdg;
 	uint64_t smac, dmac;
-	uint8_t indbuf[12];
+	uint32_t now = time_second;
+	u_int dst;
 
-	/* safety check, unfortunately we have many cases */
-	if (buf_len >= 14 + na->up.virt_hdr_len) {
-		/* virthdr + mac_hdr in the same slot */
-		buf += na->up.virt_hdr_len;
-		buf_len -= na->up.virt_hdr_len;
-	} else if (buf_len == na->up.virt_hdr_len && ft->ft_flags & NS_MOREFRAG) {
-		/* only header in first fragment */
-		ft++;
-		buf = ft->ft_buf;
-		buf_len = ft->ft_len;
-	} else {
-		RD(5, "invalid buf format, length %d", buf_len);
+	if (nm_bdg_get_macs(ft, na, &dmac, &smac))
 		return NM_BDG_NOPORT;
-	}
 
-	if (ft->ft_flags & NS_INDIRECT) {
-		if (copyin(buf, indbuf, sizeof(indbuf))) {
-			return NM_BDG_NOPORT;
-		}
-		buf = indbuf;
-	}
+	if (!na->bdg_nolearn &&
+	    nm_bdg_src_stale(smac, na->last_smac, na->last_smac_ts, now))
+		nm_bdg_learn_src(na, smac, nm_bdg_mac_hash(smac), now);
 
-	dmac = le64toh(*(uint64_t *)(buf)) & 0xffffffffffff;
-	smac = le64toh(*(uint64_t *)(buf + 4));
-	smac >>= 16;
+	dst = (dmac & 1) ? nm_bdg_lookup_mcast(b, ft, na, dmac) :
+		nm_bdg_lookup_dst(b, dmac, nm_bdg_mac_hash(dmac), now);
+	if (b->bdg_flags & NM_BDG_RXHASH)
+		nm_bdg_rxhash_ring(b, dst, nm_bdg_rxhash(ft, na, dmac, smac),
+				dst_ring);
+	return dst;
+}
 
-	/*
-	 * The hash is somewhat expensive, there might be some
-	 * worthwhile optimizations here.
-	 */
-	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
-		uint8_t *s = buf+6;
-		sh = nm_bridge_rthash(s); // XXX hash of source
-		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
-		if (netmap_verbose)
-		    D("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
-			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
-	}
-	dst = NM_BDG_BROADCAST;
-	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_bridge_rthash(buf); // XXX hash of dst
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
+/*
+ * Batched version of netmap_bdg_learning().
+ * Frames are processed in groups of NM_BDG_LOOKUP_BATCH: first all
+ * the addresses in the group are extracted and hashed, and the
+ * buckets they need are prefetched; then the table is updated and
+ * searched, hopefully without waiting for memory.
+ */
+#define NM_BDG_LOOKUP_BATCH	16
+
+void
+netmap_bdg_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na)
+{
+	struct nm_bridge *b = na->na_bdg;
+	uint32_t now = time_second;
+	uint64_t last_smac = na->last_smac;
+	uint32_t last_ts = na->last_smac_ts;
+	struct {
+		uint64_t smac, dmac;
+		uint32_t sh, dh, fh;
+		uint16_t idx;
+		uint8_t learn;
+	} lk[NM_BDG_LOOKUP_BATCH];
+	u_int i = 0, k, cnt;
+	int rxhash = b->bdg_flags & NM_BDG_RXHASH;
+	int learn = !na->bdg_nolearn;
+
+	while (i < n) {
+		/* stage 1: parse, hash and prefetch */
+		for (cnt = 0; i < n && cnt < NM_BDG_LOOKUP_BATCH;
+				i += ft[i].ft_frags) {
+			dst_port[i] = NM_BDG_NOPORT;
+			if (unlikely(na->up.virt_hdr_len > ft[i].ft_len))
+				continue;
+			if (nm_bdg_get_macs(ft + i, na, &lk[cnt].dmac,
+						&lk[cnt].smac))
+				continue;
+			lk[cnt].idx = i;
+			lk[cnt].learn = learn && nm_bdg_src_stale(lk[cnt].smac,
+					last_smac, last_ts, now);
+			if (lk[cnt].learn) {
+				last_smac = lk[cnt].smac;
+				last_ts = now;
+				lk[cnt].sh = nm_bdg_mac_hash(lk[cnt].smac);
+				nm_fdb_prefetch(b, lk[cnt].sh, 1);
+			}
+			if (!(lk[cnt].dmac & 1)) {
+				lk[cnt].dh = nm_bdg_mac_hash(lk[cnt].dmac);
+				nm_fdb_prefetch(b, lk[cnt].dh, 0);
+			}
+			if (rxhash)
+				lk[cnt].fh = nm_bdg_rxhash(ft + i, na,
+						lk[cnt].dmac, lk[cnt].smac);
+			cnt++;
+		}
+		/* stage 2: learn and resolve */
+		for (k = 0; k < cnt; k++) {
+			if (lk[k].learn)
+				nm_bdg_learn_src(na, lk[k].smac, lk[k].sh, now);
+			if (lk[k].dmac & 1)
+				dst_port[lk[k].idx] = nm_bdg_lookup_mcast(b,
+					ft + lk[k].idx, na, lk[k].dmac);
+			else
+				dst_port[lk[k].idx] = nm_bdg_lookup_dst(b,
+					lk[k].dmac, lk[k].dh, now);
+			if (rxhash)
+				nm_bdg_rxhash_ring(b, dst_port[lk[k].idx],
+						lk[k].fh, &dst_ring[lk[k].idx]);
 		}
-		/* XXX otherwise return NM_BDG_UNKNOWN ? */
 	}
-	return dst;
 }
 
 
@@ -1745,63 +4246,645 @@ nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
 	return lease_idx;
 }
 
+
+/* take up to n slots from bucket tb at time now, return how many */
+static inline u_int
+nm_bdg_tb_take(struct nm_bdg_tb *tb, uint64_t now, u_int n)
+{
+	uint64_t avail;
+
+	if (tb->tb_cost == 0)
+		return n; /* unlimited */
+	if (tb->tb_full < now)
+		tb->tb_full = now;
+	avail = (now + tb->tb_depth - tb->tb_full) / tb->tb_cost;
+	if (n > avail)
+		n = avail;
+	tb->tb_full += n * tb->tb_cost;
+	return n;
+}
+
+/* give back n slots taken and not used */
+static inline void
+nm_bdg_tb_give(struct nm_bdg_tb *tb, u_int n)
+{
+	tb->tb_full -= n * tb->tb_cost;
+}
+
+/*
+ * Reduce the n slots that a sender wants to reserve on rx ring r
+ * of a port with shaper sh, according to the ring and the port
+ * buckets. Called with the lock of the kring.
+ */
+static u_int
+nm_bdg_shape(struct nm_bdg_shaper *sh, u_int r, u_int n, uint64_t now)
+{
+	struct nm_bdg_tb *rtb = &sh->sh_ring[r];
+	u_int m;
+
+	n = nm_bdg_tb_take(rtb, now, n);
+	if (sh->sh_port.tb_cost == 0 || n == 0)
+		return n;
+	mtx_lock(&sh->sh_lock);
+	m = nm_bdg_tb_take(&sh->sh_port, now, n);
+	mtx_unlock(&sh->sh_lock);
+	if (m < n)
+		nm_bdg_tb_give(rtb, n - m);
+	return m;
+}
+
+/* give back n slots to ring r of sh, with the lock of the kring */
+static void
+nm_bdg_unshape(struct nm_bdg_shaper *sh, u_int r, u_int n)
+{
+	nm_bdg_tb_give(&sh->sh_ring[r], n);
+	if (sh->sh_port.tb_cost == 0)
+		return;
+	mtx_lock(&sh->sh_lock);
+	nm_bdg_tb_give(&sh->sh_port, n);
+	mtx_unlock(&sh->sh_lock);
+}
+
+
+/* whether both the unicast and the broadcast lists are empty */
+#define NM_BDG_Q_EMPTY(next, brd_next)	\
+	((next) == NM_FT_NULL && (brd_next) == NM_FT_NULL)
+
+/*
+ * Classification for NM_BDG_PRIO: whether the frame at ft has an
+ * 802.1p priority of at least pcp or an IP DSCP of at least dscp.
+ */
+static inline int
+nm_bdg_prio_high(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		u_int pcp, u_int dscp)
+{
+	uint8_t *buf = ft->ft_buf + na->up.virt_hdr_len;
+	int len = (int)ft->ft_len - (int)na->up.virt_hdr_len;
+	int l2 = 14;
+	uint16_t ethtype;
+
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14 + 2)
+		return 0;
+	ethtype = (buf[12] << 8) | buf[13];
+	if (ethtype == 0x8100) { /* 802.1Q */
+		if ((u_int)(buf[14] >> 5) >= pcp)
+			return 1;
+		if (len < 18 + 2)
+			return 0;
+		ethtype = (buf[16] << 8) | buf[17];
+		l2 = 18;
+	}
+	if (len < l2 + 2)
+		return 0;
+	if (ethtype == 0x0800)
+		return (u_int)(buf[l2 + 1] >> 2) >= dscp;
+	if (ethtype == 0x86dd) /* the traffic class spans two bytes */
+		return (u_int)(((buf[l2] & 0xf) << 2) | (buf[l2 + 1] >> 6)) >=
+			dscp;
+	return 0;
+}
+
+/*
+ * Check that all the fragments of a packet are in regular netmap
+ * buffers of the source port, so that they can be swapped.
+ */
+static inline int
+nm_bdg_zcopy_ok(const struct nm_bdg_fwd *ft_p, struct netmap_vp_adapter *na)
+{
+	const struct nm_bdg_fwd *ft_end = ft_p + ft_p->ft_frags;
+
+	for (; ft_p != ft_end; ft_p++) {
+		if (ft_p->ft_flags & NS_INDIRECT ||
+		    ft_p->ft_buf == NETMAP_BUF_BASE(&na->up))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Move a unicast packet to the destination ring by swapping the
+ * buffers of the source tx slots and of the destination rx slots.
+ * Only valid if source and destination share the memory allocator.
+ * 'src_j' is the position in the source ring of the first fragment.
+ */
+static inline void
+nm_bdg_swap_slots(struct netmap_kring *src_kring, u_int src_j,
+		struct netmap_ring *ring, u_int *j, u_int lim,
+		const struct nm_bdg_fwd *ft_p)
+{
+	struct netmap_ring *src_ring = src_kring->ring;
+	u_int src_lim = src_kring->nkr_num_slots - 1;
+	u_int cnt = ft_p->ft_frags;
+	struct netmap_slot *rs = NULL;
+	const struct nm_bdg_fwd *ft_end = ft_p + cnt;
+
+	do {
+		struct netmap_slot *ts = &src_ring->slot[src_j];
+		uint32_t tmp;
+
+		rs = &ring->slot[*j];
+		tmp = rs->buf_idx;
+		rs->buf_idx = ts->buf_idx;
+		ts->buf_idx = tmp;
+		ts->flags |= NS_BUF_CHANGED;
+		rs->len = ft_p->ft_len;
+		rs->flags = (cnt << 8) | NS_MOREFRAG | NS_BUF_CHANGED;
+		*j = nm_next(*j, lim);
+		src_j = nm_next(src_j, src_lim);
+		ft_p++;
+	} while (ft_p != ft_end);
+	rs->flags = (cnt << 8) | NS_BUF_CHANGED; /* clear flag on last entry */
+}
+
+/* the packets that a sender delivers to one destination ring */
+struct nm_bdg_xfer {
+	struct netmap_vp_adapter *na;	/* source port */
+	struct netmap_kring *src_kring;
+	struct nm_bdg_fwd *ft;
+	u_int start;		/* position of ft[0] in src_kring */
+	struct nm_bdg_mcast *mc;
+	int weight;
+	int credit;
+	/* the next packet in each list */
+	u_int next, brd_next, hi_next, hi_brd_next;
+	u_int needed;		/* slots still needed */
+	int virt_hdr_mismatch;
+	u_int gro;		/* max segments to coalesce, 0 if off */
+	int zcopy;
+	/* for nm_bdg_fanin() */
+	struct nm_bdg_xfer *fi_next;
+	volatile int fi_done;
+};
+
+/*
+ * Copy (or swap) the packets of x into ring, starting at slot *pj and
+ * using at most *phowmany slots, and update x, *pj and *phowmany.
+ */
+static void
+nm_bdg_deliver(struct nm_bdg_xfer *x, struct netmap_vp_adapter *dst_na,
+		struct netmap_ring *ring, u_int *pj, u_int lim, u_int *phowmany)
+{
+	struct netmap_vp_adapter *na = x->na;
+	struct netmap_kring *src_kring = x->src_kring;
+	struct nm_bdg_fwd *ft = x->ft;
+	struct nm_bdg_mcast *mc = x->mc;
+	u_int start = x->start, src_lim = src_kring->nkr_num_slots - 1;
+	u_int next = x->next, brd_next = x->brd_next;
+	u_int hi_next = x->hi_next, hi_brd_next = x->hi_brd_next;
+	u_int j = *pj, howmany = *phowmany, needed = x->needed;
+	int weight = x->weight, credit = x->credit;
+	int virt_hdr_mismatch = x->virt_hdr_mismatch, zcopy = x->zcopy;
+	struct nm_copy_ctx cc;
+
+	/* nothing left, e.g. on a retry after the last packets were
+	 * for groups dst_na is not subscribed to
+	 */
+	if (NM_BDG_Q_EMPTY(next, brd_next) &&
+	    NM_BDG_Q_EMPTY(hi_next, hi_brd_next))
+		return;
+	/* the SIMD section, if any, is opened by the first bulk copy
+	 * and then covers the following ones; the mismatch and GRO
+	 * paths use the plain routines
+	 */
+	nm_copy_ctx_init(&cc);
+	while (howmany > 0) {
+		struct netmap_slot *slot;
+		struct nm_bdg_fwd *ft_p, *ft_end;
+		u_int cnt, *qnext;
+		int unicast;
+
+		/* find the queue from which we pick next packet.
+		 * The high priority lists go first, up to weight
+		 * packets for each normal one (or all of them if
+		 * weight is 0); they are empty without NM_BDG_PRIO.
+		 * NM_FT_NULL is always higher than valid indexes
+		 * so we never dereference it if the other list
+		 * has packets (and if both are empty we never
+		 * get here).
+		 */
+		if (unlikely(hi_next != NM_FT_NULL ||
+		    hi_brd_next != NM_FT_NULL) && (weight == 0 ||
+		    credit > 0 || NM_BDG_Q_EMPTY(next, brd_next))) {
+			credit--;
+			if (hi_next < hi_brd_next) {
+				ft_p = ft + hi_next;
+				hi_next = ft_p->ft_next;
+				qnext = &hi_next;
+				unicast = 1;
+			} else {
+				ft_p = ft + hi_brd_next;
+				hi_brd_next = ft_p->ft_next;
+				unicast = 0;
+			}
+		} else if (next < brd_next) {
+			credit = weight;
+			ft_p = ft + next;
+			next = ft_p->ft_next;
+			qnext = &next;
+			unicast = 1;
+		} else { /* insert broadcast */
+			credit = weight;
+			ft_p = ft + brd_next;
+			brd_next = ft_p->ft_next;
+			unicast = 0;
+		}
+		if (!unicast && ft_p->ft_group &&
+		    !nm_bdg_mcast_member(mc, ft_p->ft_group - 1,
+				dst_na->bdg_port)) {
+			/* not subscribed to the group, the frame
+			 * does not need slots here
+			 */
+			cnt = ft_p->ft_frags;
+			needed = needed > cnt ? needed - cnt : 0;
+			if (NM_BDG_Q_EMPTY(next, brd_next) &&
+			    NM_BDG_Q_EMPTY(hi_next, hi_brd_next))
+				break;
+			continue;
+		}
+		cnt = ft_p->ft_frags; // cnt > 0
+		if (unlikely(cnt > howmany))
+		    break; /* no more space */
+		if (netmap_verbose && cnt > 1)
+			RD(5, "rx %d frags to %d", cnt, j);
+		ft_end = ft_p + cnt;
+		if (unlikely(virt_hdr_mismatch)) {
+			/* coalesce unicast TCP segments if possible */
+			if (!x->gro || !unicast ||
+			    !bdg_gro_datapath(dst_na, ft, ft_p, qnext,
+					x->gro, ring, &j, lim, &howmany, &cc))
+				bdg_mismatch_datapath(na, dst_na, ft_p, ring,
+					&j, lim, &howmany, &cc);
+		} else if (zcopy && unicast &&
+			   nm_bdg_zcopy_ok(ft_p, na)) {
+			u_int src_j = start + (ft_p - ft);
+
+			if (src_j > src_lim)
+				src_j -= src_lim + 1;
+			howmany -= cnt;
+			needed -= cnt;
+			nm_bdg_swap_slots(src_kring, src_j, ring, &j,
+					lim, ft_p);
+		} else {
+			howmany -= cnt;
+			if (!cc.simd)
+				nm_copy_begin(&cc);
+			do {
+				char *dst, *src = ft_p->ft_buf;
+				size_t copy_len = ft_p->ft_len, dst_len = copy_len;
+
+				slot = &ring->slot[j];
+				dst = NMB(&dst_na->up, slot);
+
+				ND("send [%d] %d(%d) bytes at %s:%d",
+						(int)(ft_p - ft), (int)copy_len, (int)dst_len,
+						NM_IFPNAME(dst_ifp), j);
+				/* round to a multiple of 64 */
+				copy_len = (copy_len + 63) & ~63;
+
+				if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
+					     copy_len > NETMAP_BUF_SIZE(&na->up))) {
+					RD(5, "invalid len %d, down to 64", (int)copy_len);
+					copy_len = dst_len = 64; // XXX
+				}
+				if (ft_p->ft_flags & NS_INDIRECT) {
+					nm_copy_end(&cc); /* copyin may sleep */
+					if (copyin(src, dst, copy_len)) {
+						// invalid user pointer, pretend len is 0
+						dst_len = 0;
+					}
+				} else {
+					nm_copy(&cc, src, dst, (int)copy_len);
+				}
+				slot->len = dst_len;
+				slot->flags = (cnt << 8)| NS_MOREFRAG;
+				j = nm_next(j, lim);
+				needed--;
+				ft_p++;
+			} while (ft_p != ft_end);
+			slot->flags = (cnt << 8); /* clear flag on last entry */
+		}
+		/* are we done ? */
+		if (NM_BDG_Q_EMPTY(next, brd_next) &&
+		    NM_BDG_Q_EMPTY(hi_next, hi_brd_next))
+			break;
+	}
+	nm_copy_end(&cc);
+	x->next = next;
+	x->brd_next = brd_next;
+	x->hi_next = hi_next;
+	x->hi_brd_next = hi_brd_next;
+	x->needed = needed;
+	x->credit = credit;
+	*pj = j;
+	*phowmany = howmany;
+}
+
+/*
+ * Complete the lease lease_idx on kring, which started at my_start and
+ * is filled up to j, with howmany slots left unused (given back to sh,
+ * if any). If all the previous leases are complete, advance nr_hwtail
+ * and notify the ring. Return nonzero if the ring was notified.
+ */
+static int
+nm_kr_lease_done(struct netmap_kring *kring, uint32_t lease_idx,
+		u_int my_start, u_int j, u_int howmany,
+		struct nm_bdg_shaper *sh, u_int dst_nr)
+{
+	struct netmap_ring *ring = kring->ring;
+	u_int lim = kring->nkr_num_slots - 1;
+	/* current position */
+	uint32_t *p = kring->nkr_leases; /* shorthand */
+	uint32_t update_pos;
+
+	mtx_lock(&kring->q_lock);
+	if (unlikely(howmany > 0)) {
+		/* not used all bufs. If i am the last one
+		 * i can recover the slots, otherwise must
+		 * fill them with 0 to mark empty packets.
+		 */
+		ND("leftover %d bufs", howmany);
+		if (unlikely(sh != NULL))
+			nm_bdg_unshape(sh, dst_nr, howmany);
+		if (nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
+			/* yes i am the last one */
+			ND("roll back nkr_hwlease to %d", j);
+			kring->nkr_hwlease = j;
+		} else {
+			while (howmany-- > 0) {
+				ring->slot[j].len = 0;
+				ring->slot[j].flags = 0;
+				j = nm_next(j, lim);
+			}
+		}
+	}
+	p[lease_idx] = j; /* report I am done */
+
+	update_pos = kring->nr_hwtail;
+
+	if (my_start == update_pos) {
+		/* all slots before my_start have been reported,
+		 * so scan subsequent leases to see if other ranges
+		 * have been completed, and to a selwakeup or txsync.
+		 */
+		while (lease_idx != kring->nkr_lease_idx &&
+			p[lease_idx] != NR_NOSLOT) {
+			j = p[lease_idx];
+			p[lease_idx] = NR_NOSLOT;
+			lease_idx = nm_next(lease_idx, lim);
+		}
+		/* j is the new 'write' position. j != my_start
+		 * means there are new buffers to report
+		 */
+		if (likely(j != my_start)) {
+			kring->nr_hwtail = j;
+			mtx_unlock(&kring->q_lock);
+			kring->nm_notify(kring, 0);
+			/* this is netmap_notify for VALE ports and
+			 * netmap_bwrap_notify for bwrap. The latter will
+			 * trigger a txsync on the underlying hwna
+			 */
+			return 1;
+		}
+	}
+	mtx_unlock(&kring->q_lock);
+	return 0;
+}
+
+/*
+ * Deliver the transfers in list (most recent first) to kring with
+ * a single lease and a single notification.
+ */
+static void
+nm_bdg_fanin_drain(struct netmap_kring *kring, struct nm_bdg_xfer *list)
+{
+	struct netmap_vp_adapter *dst_na = (struct netmap_vp_adapter *)kring->na;
+	struct nm_bdg_xfer *x, *first = NULL;
+	u_int needed = 0, howmany, j, my_start;
+	uint32_t lease_idx;
+
+	/* restore the arrival order, and count the slots */
+	while (list != NULL) {
+		x = list;
+		list = x->fi_next;
+		x->fi_next = first;
+		first = x;
+		needed += x->needed;
+	}
+
+	mtx_lock(&kring->q_lock);
+	if (kring->nkr_stopped) {
+		mtx_unlock(&kring->q_lock);
+		goto done;
+	}
+	my_start = j = kring->nkr_hwlease;
+	howmany = nm_kr_space(kring, 1);
+	if (needed < howmany)
+		howmany = needed;
+	lease_idx = nm_kr_lease(kring, howmany, 1);
+	mtx_unlock(&kring->q_lock);
+
+	for (x = first; x != NULL && howmany > 0; x = x->fi_next)
+		nm_bdg_deliver(x, dst_na, kring->ring, &j,
+				kring->nkr_num_slots - 1, &howmany);
+
+	nm_kr_lease_done(kring, lease_idx, my_start, j, howmany, NULL, 0);
+done:
+	/* the senders own their x again as soon as they see fi_done */
+	mb();
+	while (first != NULL) {
+		x = first;
+		first = x->fi_next;
+		x->fi_done = 1;
+	}
+}
+
+/*
+ * Deliver x to kring together with the transfers of the other senders
+ * to the same ring. Senders push their transfer on the lock-free
+ * nkr_fanin stack; whoever gets nkr_fanin_busy delivers everything
+ * that has been pushed, and the others wait for their transfer to be
+ * marked done (or for their turn to deliver). This turns the two lock
+ * round-trips per sender into two per group of senders.
+ * Waiting for another sender is only safe if it cannot be preempted
+ * by us, so the whole thing runs with the forwarding path kept out
+ * of this CPU; where the OS cannot do that we return 0, and the
+ * caller delivers x on its own.
+ */
+static int
+nm_bdg_fanin(struct netmap_kring *kring, struct nm_bdg_xfer *x)
+{
+	struct nm_bdg_xfer *list;
+	u_long s;
+
+	if (!nm_os_intr_disable(&s))
+		return 0;
+	x->fi_done = 0;
+	do {
+		list = kring->nkr_fanin;
+		x->fi_next = list;
+	} while (!NM_ATOMIC_CAS_PTR(&kring->nkr_fanin, list, x));
+
+	while (!x->fi_done) {
+		if (NM_ATOMIC_TEST_AND_SET(&kring->nkr_fanin_busy)) {
+			nm_os_pause();
+			continue;
+		}
+		for (;;) {
+			do {
+				list = kring->nkr_fanin;
+			} while (list != NULL &&
+				!NM_ATOMIC_CAS_PTR(&kring->nkr_fanin, list, NULL));
+			if (list == NULL)
+				break;
+			nm_bdg_fanin_drain(kring, list);
+		}
+		mb();
+		NM_ATOMIC_CLEAR(&kring->nkr_fanin_busy);
+	}
+	mb(); /* the deliverer's writes to x come before fi_done */
+	nm_os_intr_restore(s);
+	return 1;
+}
+
 /*
  *
- * This flush routine supports only unicast and broadcast but a large
+ * This flush routine supports unicast, broadcast and, with the
+ * learning bridge, multicast to the subscribed ports, and a large
  * number of ports, and lets us replace the learn and dispatch functions.
+ * 'start' is the position in the source kring of ft[0].
  */
 int
 nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
-		u_int ring_nr)
+		struct netmap_kring *src_kring, u_int start)
 {
-	struct nm_bdg_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
+	struct nm_bdg_q *dst_ents, *brd_ents;
+	uint16_t num_dsts = 0, *dsts, *lk_ports;
+	uint8_t *lk_rings;
 	struct nm_bridge *b = na->na_bdg;
+	struct nm_bdg_dp *dp = b->bdg_dp;
+	struct nm_bdg_mcast *mc = b->bdg_mcast;
+	u_int nports = dp->max_ports;
+	u_int ft_ports = NM_BDG_FWD_PORTS(ft); /* at least nports */
 	u_int i, me = na->bdg_port;
+	uint32_t brd_rings = 0; /* rings used by broadcast traffic */
+	int brd_all = 0; /* broadcast traffic for all ports */
+	uint32_t *mc_ports, mc_seen[NM_BDG_MCAST_GROUPS / 32];
+	u_int mc_nwords = 0; /* words of mc_ports in use */
+	int indirect = 0; /* NS_INDIRECT slots in the batch */
+	uint64_t now = 0; /* for the shapers, read when first needed */
+	int prio = b->bdg_flags & NM_BDG_PRIO;
+	u_int prio_pcp = bridge_prio_pcp, prio_dscp = bridge_prio_dscp;
+	int weight = b->bdg_prio_weight;
+	u_int ring_nr = src_kring->ring_id;
+	bdg_lookup_batch_fn_t lookup_batch = dp->ops.lookup_batch;
 
 	/*
 	 * The work area (pointed by ft) is followed by an array of
 	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * queues per port, and as many for the broadcast traffic.
+	 * Then we have an array of destination indexes, the
+	 * per-slot results of the batched lookup, and the bitmap
+	 * of the ports subscribed to the multicast groups in the batch.
+	 * The layout follows the size of the area, ft_ports, which may
+	 * be larger than the bridge: the area may have been allocated
+	 * for another bridge, or for the next size of this one.
 	 */
-	dst_ents = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
+	dst_ents = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX) + 1;
+	brd_ents = dst_ents + ft_ports * NM_BDG_MAXRINGS;
+	dsts = (uint16_t *)(dst_ents + NM_BDG_NUM_DSTQ(ft_ports));
+	lk_ports = dsts + NM_BDG_NUM_DSTQ(ft_ports);
+	lk_rings = (uint8_t *)(lk_ports + NM_BDG_BATCH_MAX);
+	mc_ports = (uint32_t *)(lk_rings + NM_BDG_BATCH_MAX);
+
+	if (lookup_batch) {
+		for (i = 0; likely(i < n); i += ft[i].ft_frags)
+			lk_rings[i] = ring_nr;
+		lookup_batch(ft, n, lk_ports, lk_rings, na);
+	}
 
 	/* first pass: find a destination for each packet in the batch */
 	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
 		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
 		uint16_t dst_port, d_i;
 		struct nm_bdg_q *d;
+		u_int k;
 
 		ND("slot %d frags %d", i, ft[i].ft_frags);
+		for (k = i; k < i + ft[i].ft_frags; k++)
+			indirect |= ft[k].ft_flags & NS_INDIRECT;
 		/* Drop the packet if the virtio-net header is not into the first
 		   fragment nor at the very beginning of the second. */
 		if (unlikely(na->up.virt_hdr_len > ft[i].ft_len))
 			continue;
-		dst_port = b->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		if (lookup_batch) {
+			dst_port = lk_ports[i];
+			dst_ring = lk_rings[i];
+		} else {
+			dst_port = dp->ops.lookup(&ft[i], &dst_ring, na);
+		}
 		if (netmap_verbose > 255)
 			RD(5, "slot %d port %d -> %d", i, me, dst_port);
 		if (dst_port == NM_BDG_NOPORT)
 			continue; /* this packet is identified to be dropped */
-		else if (unlikely(dst_port > NM_BDG_MAXPORTS))
+		else if (dst_port == NM_BDG_BROADCAST ||
+				NM_BDG_IS_MCAST(dst_port)) {
+			if (dst_port == NM_BDG_BROADCAST) {
+				ft[i].ft_group = 0;
+				brd_all = 1;
+			} else {
+				u_int g = dst_port - NM_BDG_MCAST(0), w;
+				struct nm_bdg_mgroup *mg;
+
+				if (unlikely(mc == NULL ||
+				    (mg = mc->mc_grp[g]) == NULL))
+					continue;
+				ft[i].ft_group = g + 1;
+				/* collect the subscribers of the group */
+				if (mc_nwords == 0) {
+					mc_nwords = NM_BDG_MCAST_NWORDS(nports);
+					bzero(mc_ports, mc_nwords * sizeof(*mc_ports));
+					bzero(mc_seen, sizeof(mc_seen));
+				}
+				if (!(mc_seen[g / 32] & (1U << (g % 32)))) {
+					mc_seen[g / 32] |= 1U << (g % 32);
+					for (w = 0; w < mc_nwords; w++)
+						mc_ports[w] |= mg->mg_ports[w];
+				}
+			}
+			/* broadcasts go to ring 0, unless the lookup
+			 * function spreads them over the rx rings
+			 */
+			if (b->bdg_flags & NM_BDG_RXHASH)
+				dst_ring &= NM_BDG_MAXRINGS - 1;
+			else
+				dst_ring = 0;
+			brd_rings |= (1U << dst_ring);
+			/* the broadcast queues follow the ports */
+			dst_port = ft_ports;
+		} else if (unlikely(dst_port >= nports))
 			continue;
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
 		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
+		    !dp->ports[dst_port]))
 			continue;
 
 		/* get a position in the scratch pad */
 		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
 		d = dst_ents + d_i;
 
+		/* remember a new destination to be scanned later */
+		if (d->bq_len == 0 && dst_port != ft_ports)
+			dsts[num_dsts++] = d_i;
 		/* append the first fragment to the list */
-		if (d->bq_head == NM_FT_NULL) { /* new destination */
+		if (unlikely(prio) && nm_bdg_prio_high(&ft[i], na,
+					prio_pcp, prio_dscp)) {
+			if (d->bq_hi_head == NM_FT_NULL) {
+				d->bq_hi_head = d->bq_hi_tail = i;
+			} else {
+				ft[d->bq_hi_tail].ft_next = i;
+				d->bq_hi_tail = i;
+			}
+		} else if (d->bq_head == NM_FT_NULL) {
 			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
 		} else {
 			ft[d->bq_tail].ft_next = i;
 			d->bq_tail = i;
@@ -1810,23 +4893,41 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 	}
 
 	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
+	 * Broadcast traffic goes to the same ring (ring 0, unless
+	 * NM_BDG_RXHASH is set) on all destinations.
 	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * Only the ports which can receive are in live_index, so
+	 * idle ports cost nothing here and in the second pass.
+	 * If there is only multicast traffic, we only add the ports
+	 * subscribed to its groups.
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
-	if (brddst->bq_head != NM_FT_NULL) {
+	if (brd_all) {
 		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
-			i = b->bdg_port_index[j];
+		for (j = 0; likely(j < dp->live_ports); j++) {
+			uint32_t r, m;
+			i = dp->live_index[j];
 			if (unlikely(i == me))
 				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
+			for (r = 0, m = brd_rings; m; r++, m >>= 1) {
+				uint16_t d_i = i * NM_BDG_MAXRINGS + r;
+				if ((m & 1) && dst_ents[d_i].bq_len == 0)
+					dsts[num_dsts++] = d_i;
+			}
+		}
+	} else if (brd_rings) {
+		u_int w;
+		for (w = 0; w < mc_nwords; w++) {
+			uint32_t r, m, bits = mc_ports[w];
+			for (; bits; bits &= bits - 1) {
+				i = w * 32 + ffs(bits) - 1;
+				if (unlikely(i == me || i >= nports))
+					continue;
+				for (r = 0, m = brd_rings; m; r++, m >>= 1) {
+					uint16_t d_i = i * NM_BDG_MAXRINGS + r;
+					if ((m & 1) && dst_ents[d_i].bq_len == 0)
+						dsts[num_dsts++] = d_i;
+				}
+			}
 		}
 	}
 
@@ -1836,19 +4937,23 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		struct netmap_vp_adapter *dst_na;
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
-		u_int dst_nr, lim, j, d_i, next, brd_next;
+		u_int dst_nr, lim, j, d_i;
 		u_int needed, howmany;
+		struct nm_bdg_xfer x;
 		int retry = netmap_txsync_retry;
-		struct nm_bdg_q *d;
+		struct nm_bdg_q *d, *brddst;
+		struct nm_bdg_shaper *sh;
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
 		int virt_hdr_mismatch = 0;
+		int zcopy;
 
 		d_i = dsts[i];
 		ND("second pass %d port %d", i, d_i);
 		d = dst_ents + d_i;
+		brddst = brd_ents + (d_i & (NM_BDG_MAXRINGS - 1));
 		// XXX fix the division
-		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
+		dst_na = dp->ports[d_i/NM_BDG_MAXRINGS];
 		/* protect from the lookup function returning an inactive
 		 * destination port
 		 */
@@ -1867,8 +4972,10 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		}
 
 		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
-		next = d->bq_head;
+		x.brd_next = brddst->bq_head;
+		x.next = d->bq_head;
+		x.hi_brd_next = brddst->bq_hi_head;
+		x.hi_next = d->bq_hi_head;
 		/* we need to reserve this many slots. If fewer are
 		 * available, some packets will be dropped.
 		 * Packets may have multiple fragments, so we may not use
@@ -1905,6 +5012,24 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			}
 		}
 
+		/* unicast packets can be moved without copying them
+		 * if the destination uses the same buffers as the source
+		 */
+		zcopy = bridge_zcopy && !virt_hdr_mismatch &&
+			dst_na->up.nm_mem == na->up.nm_mem;
+
+		x.na = na;
+		x.src_kring = src_kring;
+		x.ft = ft;
+		x.start = start;
+		x.mc = mc;
+		x.weight = x.credit = weight;
+		x.needed = needed;
+		x.virt_hdr_mismatch = virt_hdr_mismatch;
+		x.gro = (virt_hdr_mismatch && !na->up.virt_hdr_len) ?
+			bridge_gro_segs : 0;
+		x.zcopy = zcopy;
+
 		ND(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
 		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
@@ -1914,6 +5039,18 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		kring = &dst_na->up.rx_rings[dst_nr];
 		ring = kring->ring;
 		lim = kring->nkr_num_slots - 1;
+		sh = dst_na->bdg_shaper;
+		if (unlikely(sh != NULL) && now == 0)
+			now = nm_os_cycles();
+
+		/* aggregate with the other senders to this ring, unless
+		 * we need the per-sender retry, mismatch or shaping logic.
+		 * Indirect buffers are in the address space of the sender,
+		 * and copyin() may sleep, so only the sender can copy them.
+		 */
+		if (bridge_fanin && !indirect && !dst_na->retry &&
+		    !virt_hdr_mismatch && sh == NULL && nm_bdg_fanin(kring, &x))
+			goto cleanup;
 
 retry:
 
@@ -1936,152 +5073,39 @@ retry:
 		}
 		my_start = j = kring->nkr_hwlease;
 		howmany = nm_kr_space(kring, 1);
-		if (needed < howmany)
-			howmany = needed;
+		if (x.needed < howmany)
+			howmany = x.needed;
+		if (unlikely(sh != NULL))
+			howmany = nm_bdg_shape(sh, dst_nr, howmany, now);
 		lease_idx = nm_kr_lease(kring, howmany, 1);
 		mtx_unlock(&kring->q_lock);
 
 		/* only retry if we need more than available slots */
-		if (retry && needed <= howmany)
+		if (retry && x.needed <= howmany)
 			retry = 0;
 
 		/* copy to the destination queue */
-		while (howmany > 0) {
-			struct netmap_slot *slot;
-			struct nm_bdg_fwd *ft_p, *ft_end;
-			u_int cnt;
-
-			/* find the queue from which we pick next packet.
-			 * NM_FT_NULL is always higher than valid indexes
-			 * so we never dereference it if the other list
-			 * has packets (and if both are empty we never
-			 * get here).
-			 */
-			if (next < brd_next) {
-				ft_p = ft + next;
-				next = ft_p->ft_next;
-			} else { /* insert broadcast */
-				ft_p = ft + brd_next;
-				brd_next = ft_p->ft_next;
-			}
-			cnt = ft_p->ft_frags; // cnt > 0
-			if (unlikely(cnt > howmany))
-			    break; /* no more space */
-			if (netmap_verbose && cnt > 1)
-				RD(5, "rx %d frags to %d", cnt, j);
-			ft_end = ft_p + cnt;
-			if (unlikely(virt_hdr_mismatch)) {
-				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
-			} else {
-				howmany -= cnt;
-				do {
-					char *dst, *src = ft_p->ft_buf;
-					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
-
-					slot = &ring->slot[j];
-					dst = NMB(&dst_na->up, slot);
-
-					ND("send [%d] %d(%d) bytes at %s:%d",
-							i, (int)copy_len, (int)dst_len,
-							NM_IFPNAME(dst_ifp), j);
-					/* round to a multiple of 64 */
-					copy_len = (copy_len + 63) & ~63;
-
-					if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
-						     copy_len > NETMAP_BUF_SIZE(&na->up))) {
-						RD(5, "invalid len %d, down to 64", (int)copy_len);
-						copy_len = dst_len = 64; // XXX
-					}
-					if (ft_p->ft_flags & NS_INDIRECT) {
-						if (copyin(src, dst, copy_len)) {
-							// invalid user pointer, pretend len is 0
-							dst_len = 0;
-						}
-					} else {
-						//memcpy(dst, src, copy_len);
-						pkt_copy(src, dst, (int)copy_len);
-					}
-					slot->len = dst_len;
-					slot->flags = (cnt << 8)| NS_MOREFRAG;
-					j = nm_next(j, lim);
-					needed--;
-					ft_p++;
-				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
-			}
-			/* are we done ? */
-			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
-				break;
-		}
-		{
-		    /* current position */
-		    uint32_t *p = kring->nkr_leases; /* shorthand */
-		    uint32_t update_pos;
-		    int still_locked = 1;
-
-		    mtx_lock(&kring->q_lock);
-		    if (unlikely(howmany > 0)) {
-			/* not used all bufs. If i am the last one
-			 * i can recover the slots, otherwise must
-			 * fill them with 0 to mark empty packets.
-			 */
-			ND("leftover %d bufs", howmany);
-			if (nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
-			    /* yes i am the last one */
-			    ND("roll back nkr_hwlease to %d", j);
-			    kring->nkr_hwlease = j;
-			} else {
-			    while (howmany-- > 0) {
-				ring->slot[j].len = 0;
-				ring->slot[j].flags = 0;
-				j = nm_next(j, lim);
-			    }
-			}
-		    }
-		    p[lease_idx] = j; /* report I am done */
-
-		    update_pos = kring->nr_hwtail;
-
-		    if (my_start == update_pos) {
-			/* all slots before my_start have been reported,
-			 * so scan subsequent leases to see if other ranges
-			 * have been completed, and to a selwakeup or txsync.
-		         */
-			while (lease_idx != kring->nkr_lease_idx &&
-				p[lease_idx] != NR_NOSLOT) {
-			    j = p[lease_idx];
-			    p[lease_idx] = NR_NOSLOT;
-			    lease_idx = nm_next(lease_idx, lim);
-			}
-			/* j is the new 'write' position. j != my_start
-			 * means there are new buffers to report
+		nm_bdg_deliver(&x, dst_na, ring, &j, lim, &howmany);
+		if (nm_kr_lease_done(kring, lease_idx, my_start, j, howmany,
+				sh, dst_nr) && dst_na->retry && retry--) {
+			/* XXX this is going to call nm_notify again.
+			 * Only useful for bwrap in virtual machines
 			 */
-			if (likely(j != my_start)) {
-				kring->nr_hwtail = j;
-				still_locked = 0;
-				mtx_unlock(&kring->q_lock);
-				kring->nm_notify(kring, 0);
-				/* this is netmap_notify for VALE ports and
-				 * netmap_bwrap_notify for bwrap. The latter will
-				 * trigger a txsync on the underlying hwna
-				 */
-				if (dst_na->retry && retry--) {
-					/* XXX this is going to call nm_notify again.
-					 * Only useful for bwrap in virtual machines
-					 */
-					goto retry;
-				}
-			}
-		    }
-		    if (still_locked)
-			mtx_unlock(&kring->q_lock);
+			goto retry;
 		}
 cleanup:
 		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
+		d->bq_hi_head = d->bq_hi_tail = NM_FT_NULL;
 		d->bq_len = 0;
 	}
-	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
-	brddst->bq_len = 0;
+	for (i = 0; brd_rings; i++, brd_rings >>= 1) {
+		if (brd_rings & 1) {
+			brd_ents[i].bq_head = brd_ents[i].bq_tail = NM_FT_NULL;
+			brd_ents[i].bq_hi_head = NM_FT_NULL;
+			brd_ents[i].bq_hi_tail = NM_FT_NULL;
+			brd_ents[i].bq_len = 0; /* cleanup */
+		}
+	}
 	return 0;
 }
 
@@ -2365,13 +5389,14 @@ netmap_bwrap_dtor(struct netmap_adapter *na)
  * The bridge wrapper then sends the packets through the bridge.
  */
 static int
-netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
+netmap_bwrap_forward(struct netmap_kring *kring, int flags)
 {
 	struct netmap_adapter *na = kring->na;
 	struct netmap_bwrap_adapter *bna = na->na_private;
 	struct netmap_kring *bkring;
 	struct netmap_vp_adapter *vpna = &bna->up;
 	u_int ring_nr = kring->ring_id;
+	u_int budget = bridge_intr_budget, head;
 	int ret = NM_IRQ_COMPLETED;
 	int error;
 
@@ -2404,19 +5429,33 @@ netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
 
 	/* new packets are kring->rcur to kring->nr_hwtail, and the bkring
 	 * had hwcur == bkring->rhead. So advance bkring->rhead to kring->nr_hwtail
-	 * to push all packets out.
+	 * (or less, if there are more than budget) to push the packets out.
 	 */
-	bkring->rhead = bkring->rcur = kring->nr_hwtail;
+	head = kring->nr_hwtail;
+	if (budget) {
+		int n = head - kring->rcur;
+
+		if (n < 0)
+			n += kring->nkr_num_slots;
+		if ((u_int)n > budget) {
+			head = kring->rcur + budget;
+			if (head >= kring->nkr_num_slots)
+				head -= kring->nkr_num_slots;
+		}
+	}
+	bkring->rhead = bkring->rcur = head;
 
 	netmap_vp_txsync(bkring, flags);
 
-	/* mark all buffers as released on this ring */
-	kring->rhead = kring->rcur = kring->rtail = kring->nr_hwtail;
+	/* mark the forwarded buffers as released on this ring */
+	kring->rhead = kring->rcur = head;
+	kring->rtail = kring->nr_hwtail;
 	/* another call to actually release the buffers */
 	error = kring->nm_sync(kring, 0);
 
-	/* The second rxsync may have further advanced hwtail. If this happens,
-	 *  return NM_IRQ_RESCHED, otherwise just return NM_IRQ_COMPLETED. */
+	/* Packets may be left over because of the budget, or the second
+	 * rxsync may have further advanced hwtail. If this happens,
+	 * return NM_IRQ_RESCHED, otherwise just return NM_IRQ_COMPLETED. */
 	if (kring->rcur != kring->nr_hwtail) {
 		ret = NM_IRQ_RESCHED;
 	}
@@ -2426,6 +5465,26 @@ put_out:
 	return error ? error : ret;
 }
 
+static int
+netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
+{
+	struct netmap_bwrap_adapter *bna = kring->na->na_private;
+	int error;
+
+	if (bna->na_defer) {
+		/* make sure the ring is not disabled, and that
+		 * nm_bdg_defer_purge() waits for us
+		 */
+		if (nm_kr_tryget(kring, 0 /* can't sleep */, NULL))
+			return EIO;
+		error = bna->na_defer ? nm_bdg_defer(kring) : EBUSY;
+		nm_kr_put(kring);
+		if (!error)
+			return NM_IRQ_COMPLETED;
+	}
+	return netmap_bwrap_forward(kring, flags);
+}
+
 
 /* nm_register callback for bwrap */
 static int
@@ -2611,6 +5670,8 @@ netmap_bwrap_krings_delete(struct netmap_adapter *na)
 
 	hwna->nm_krings_delete(hwna);
 	netmap_vp_krings_delete(na);
+	/* the host port used our host krings, which are now gone */
+	bna->host.up.tx_rings = bna->host.up.rx_rings = NULL;
 }
 
 
@@ -2812,6 +5873,17 @@ err_free:
 
 }
 
+/* number of bridges to create, from bridge_num */
+u_int
+netmap_bdg_num_bridges(void)
+{
+	if (bridge_num < 1)
+		bridge_num = 1;
+	else if (bridge_num > NM_BRIDGES_MAX)
+		bridge_num = NM_BRIDGES_MAX;
+	return bridge_num;
+}
+
 struct nm_bridge *
 netmap_init_bridges2(u_int n)
 {
@@ -2834,22 +5906,42 @@ netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
 	if (b == NULL)
 		return;
 
-	for (i = 0; i < n; i++)
+	for (i = 0; i < n; i++) {
+		nm_bdg_lpm_free(&b[i]);
+		nm_bdg_flow_free(&b[i]);
+		nm_bdg_fdb_free(&b[i]);
+		nm_bdg_tables_free(&b[i]);
 		BDG_RWDESTROY(&b[i]);
+	}
 	nm_os_free(b);
 }
 
 int
 netmap_init_bridges(void)
 {
+	int error = 0;
+
+	/* must be decided before any forwarding table is used */
+	nm_bdg_use_crc32c = nm_cpu_has_sse42();
+	nm_bdg_npollers = nm_os_ncpus();
+	nm_bdg_pollers = nm_os_malloc(sizeof(*nm_bdg_pollers) *
+		nm_bdg_npollers);
+	if (nm_bdg_pollers == NULL)
+		return ENOMEM;
+	NM_MTX_INIT(nm_bdg_poll_lock);
 #ifdef CONFIG_NET_NS
-	return netmap_bns_register();
+	error = netmap_bns_register();
 #else
-	nm_bridges = netmap_init_bridges2(NM_BRIDGES);
+	nm_num_bridges = netmap_bdg_num_bridges();
+	nm_bridges = netmap_init_bridges2(nm_num_bridges);
 	if (nm_bridges == NULL)
-		return ENOMEM;
-	return 0;
+		error = ENOMEM;
 #endif
+	if (error) {
+		NM_MTX_DESTROY(nm_bdg_poll_lock);
+		nm_os_free(nm_bdg_pollers);
+	}
+	return error;
 }
 
 void
@@ -2858,7 +5950,9 @@ netmap_uninit_bridges(void)
 #ifdef CONFIG_NET_NS
 	netmap_bns_unregister();
 #else
-	netmap_uninit_bridges2(nm_bridges, NM_BRIDGES);
+	netmap_uninit_bridges2(nm_bridges, nm_num_bridges);
 #endif
+	NM_MTX_DESTROY(nm_bdg_poll_lock);
+	nm_os_free(nm_bdg_pollers);
 }
 #endif /* WITH_VALE */
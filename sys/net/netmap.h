@@ -39,7 +39,7 @@
 #ifndef _NET_NETMAP_H_
 #define _NET_NETMAP_H_
 
-#define	NETMAP_API	11		/* current API version */
+#define	NETMAP_API	12		/* current API version */
 
 #define	NETMAP_MIN_API	11		/* min and max versions accepted */
 #define	NETMAP_MAX_API	15
@@ -138,6 +138,12 @@
  *	netmap:foo{k			PIPE ring pair k, master side
  *	netmap:foo}k			PIPE ring pair k, slave side
  *
+ * Added in NETMAP_API 12:
+ *
+ * + struct netmap_pools_info (NETMAP_POOLS_INFO_GET) has the
+ *   numa_node and buf_pool_maxtotal fields. Callers with an older
+ *   nr_version only get the fields before them.
+ *
  * Some notes about host rings:
  *
  * + The RX host ring is used to store those packets that the host network
@@ -442,7 +448,8 @@ struct netmap_if {
  *		the first invocation for the same basename/allocator
  *		should specify a suitable number. Memory cannot be
  *		extended after the first allocation without closing
- *		all ports on the same region.
+ *		all ports on the same region (only the buffers can,
+ *		see NETMAP_MEM_RESIZE).
  *
  * nr_arg2 (in/out) The identity of the memory region used.
  *		On input, 0 means the system decides autonomously,
@@ -481,6 +488,93 @@ struct netmap_if {
  *	NETMAP_BDG_DELIF
  *		delete a persistent VALE port. Used by vale-ctl -d ...
  *
+ *	NETMAP_BDG_RXHASH	and nr_name = vale*: (or any port of it)
+ *		nr_arg1 = 1 spreads the traffic of the learning switch
+ *		over the rx rings of the destinations using a hash of
+ *		the flow, nr_arg1 = 0 restores the default.
+ *		Used by vale-ctl -s/-S ...
+ *
+ *	NETMAP_BDG_MCAST	and nr_name = vale*:port
+ *		with nr_arg1 = NETMAP_BDG_MCAST_JOIN or NETMAP_BDG_MCAST_LEAVE
+ *		subscribes the port to a multicast group of the learning
+ *		switch, or removes it. The group address a:b:c:d:e:f is
+ *		passed as nr_arg2 = (a << 8) | b and
+ *		nr_arg3 = (c << 24) | (d << 16) | (e << 8) | f.
+ *		Traffic to a group with subscribers is only forwarded
+ *		to them, the other multicast traffic is flooded.
+ *		With nr_name = vale*: (or any port of it) and
+ *		nr_arg1 = NETMAP_BDG_MCAST_SNOOP or NETMAP_BDG_MCAST_NOSNOOP
+ *		turns on or off the IGMP/MLD snooping, which updates the
+ *		groups from the reports of the hosts.
+ *		Used by vale-ctl -j/-J/-i/-I ...
+ *
+ *	NETMAP_BDG_SHAPE	and nr_name = vale*:port
+ *		limits the rate at which the switch fills the rx rings
+ *		of the port to nr_arg3 slots per second (0 removes the
+ *		limit), with bursts of up to nr_arg2 slots (0 for the
+ *		default). The limit applies to all the rings together
+ *		with nr_flags = NR_REG_ALL_NIC, or to ring nr_ringid
+ *		with NR_REG_ONE_NIC. Excess packets are dropped.
+ *		Used by vale-ctl -t ...
+ *
+ *	NETMAP_BDG_PRIO	and nr_name = vale*: (or any port of it)
+ *		nr_arg1 = 1 makes the switch deliver the high priority
+ *		frames of a batch (see the bridge_prio_pcp and
+ *		bridge_prio_dscp sysctls) before the others, so that
+ *		they are the last ones dropped when a destination ring
+ *		is short of room. nr_arg2 is the number of high
+ *		priority frames delivered for each normal one,
+ *		0 for strict priority.
+ *		nr_arg1 = 0 restores FIFO delivery.
+ *		Used by vale-ctl -q/-Q ...
+ *
+ *	NETMAP_BDG_DEFER	and nr_name = vale*:nic (attached NIC)
+ *		nr_arg1 = 1 makes the NIC forward from per-cpu worker
+ *		threads instead of its rx notifications (see the
+ *		bridge_intr_budget sysctl), nr_arg1 = 0 restores the
+ *		default. Not available in polling mode.
+ *		Used by vale-ctl -e/-E ...
+ *
+ *	NETMAP_BDG_FDB		and nr_name = vale*:port
+ *		with nr_arg1 = NETMAP_BDG_FDB_ADD installs a static entry
+ *		of the learning switch for the address a:b:c:d:e:f
+ *		(passed as for NETMAP_BDG_MCAST), which sends it to the
+ *		port; the entry never ages and is not changed by learning.
+ *		NETMAP_BDG_FDB_DEL removes it (nr_name = vale*: or any
+ *		port of the switch). NETMAP_BDG_FDB_NOLEARN stops learning
+ *		the source addresses of the port, NETMAP_BDG_FDB_LEARN
+ *		restores the default.
+ *		Used by vale-ctl -f/-F/-k/-K ...
+ *
+ *	NETMAP_BDG_LPM		and nr_name = vale*: (or any port of it)
+ *		nr_arg1 = 1 makes the switch forward IPv4 and IPv6 unicast
+ *		frames according to a table of routes (longest prefix
+ *		match), and the other frames, or those without a route,
+ *		as a learning switch. nr_arg1 = 0 drops the routes and
+ *		restores the learning switch. Routes are added and
+ *		removed with NIOCCONFIG and a struct nm_lpm_req.
+ *		Used by vale-ctl -u/-U/-R/-X ...
+ *
+ *	NETMAP_BDG_FLOW		and nr_name = vale*: (or any port of it)
+ *		nr_arg1 = 1 makes the switch look up IPv4 and IPv6 frames
+ *		in a table of flows (exact match on addresses, protocol
+ *		and ports) whose actions are forward, drop or mirror, and
+ *		forward the other frames as a learning switch. nr_arg1 = 0
+ *		drops the flows and restores the learning switch. Flows
+ *		are loaded with NIOCCONFIG and a struct nm_flow_req.
+ *		Used by vale-ctl -w/-W ...
+ *
+ *	NETMAP_MEM_RESIZE	on a file descriptor bound to a port
+ *		grows or shrinks the buffer pool of the memory region of
+ *		the port to nr_arg3 buffers (0 leaves it as it is), while
+ *		it is in use. The pool grows up to the buf_max_num (or
+ *		priv_buf_max_num) sysctl in force when the region was
+ *		created, and only shrinks by releasing the free buffers
+ *		at its end. On return nr_arg3 is the actual number of
+ *		buffers, and nr_memsize the size of the region, which
+ *		always includes the room for growth, so that the mapping
+ *		of every process covers the buffers added later.
+ *
  * nr_arg1, nr_arg2, nr_arg3  (in/out)		command specific
  *
  *
@@ -514,7 +608,8 @@ struct nmreq {
 	uint16_t	nr_cmd;
 #define NETMAP_BDG_ATTACH	1	/* attach the NIC */
 #define NETMAP_BDG_DETACH	2	/* detach the NIC */
-#define NETMAP_BDG_REGOPS	3	/* register bridge callbacks */
+#define NETMAP_BDG_REGOPS	3	/* register bridge callbacks, in-kernel only,
+				 * nr_arg3 = NM_BDG_OPS_VERSION */
 #define NETMAP_BDG_LIST		4	/* get bridge's info */
 #define NETMAP_BDG_VNET_HDR     5       /* set the port virtio-net-hdr length */
 #define NETMAP_BDG_OFFSET	NETMAP_BDG_VNET_HDR	/* deprecated alias */
@@ -522,12 +617,29 @@ struct nmreq {
 #define NETMAP_BDG_DELIF	7	/* destroy a virtual port */
 #define NETMAP_PT_HOST_CREATE	8	/* create ptnetmap kthreads */
 #define NETMAP_PT_HOST_DELETE	9	/* delete ptnetmap kthreads */
-#define NETMAP_BDG_POLLING_ON	10	/* delete polling kthread */
+#define NETMAP_BDG_POLLING_ON	10	/* create polling kthread, nr_arg3 idle polls before backoff */
 #define NETMAP_BDG_POLLING_OFF	11	/* delete polling kthread */
 #define NETMAP_VNET_HDR_GET	12      /* get the port virtio-net-hdr length */
 #define NETMAP_POOLS_INFO_GET	13	/* get memory allocator pools info */
+#define NETMAP_BDG_RXHASH	14	/* flow hash to select rx rings */
+#define NETMAP_BDG_MCAST	15	/* multicast groups */
+#define NETMAP_BDG_SHAPE	16	/* egress rate limit of a port */
+#define NETMAP_BDG_PRIO		17	/* priority forwarding */
+#define NETMAP_BDG_DEFER	18	/* deferred forwarding from a NIC */
+#define NETMAP_BDG_FDB		19	/* static fdb entries, learning */
+#define NETMAP_BDG_LPM		20	/* longest prefix match lookup */
+#define NETMAP_BDG_FLOW		21	/* 5-tuple flow lookup */
+#define NETMAP_MEM_RESIZE	22	/* grow/shrink the buffer pool */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
+#define NETMAP_BDG_MCAST_LEAVE		0	/* for NETMAP_BDG_MCAST */
+#define NETMAP_BDG_MCAST_JOIN		1
+#define NETMAP_BDG_MCAST_SNOOP		2
+#define NETMAP_BDG_MCAST_NOSNOOP	3
+#define NETMAP_BDG_FDB_DEL		0	/* for NETMAP_BDG_FDB */
+#define NETMAP_BDG_FDB_ADD		1
+#define NETMAP_BDG_FDB_LEARN		2
+#define NETMAP_BDG_FDB_NOLEARN		3
 
 	uint16_t	nr_arg2;
 	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF */
@@ -562,6 +674,12 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
  * to use those headers. If the flag is set, the application can use the
  * NETMAP_VNET_HDR_GET command to figure out the header length. */
 #define NR_ACCEPT_VNET_HDR	0x8000
+/* Allocate the memory of the port on the NUMA node stored in the
+ * top byte of nr_flags (NIOCREGIF and NETMAP_BDG_NEWIF). The default
+ * is the node of the device, if any. */
+#define NR_NUMA_NODE		0x10000
+#define NR_NUMA_NODE_SHIFT	24
+#define NR_NUMA_NODE_GET(f)	(((f) >> NR_NUMA_NODE_SHIFT) & 0xff)
 
 #define	NM_BDG_NAME		"vale"	/* prefix for bridge port name */
 
@@ -645,4 +763,61 @@ struct nm_ifreq {
 	char data[NM_IFRDATA_LEN];
 };
 
+/*
+ * Route for a switch with NETMAP_BDG_LPM, in the data of a struct
+ * nm_ifreq passed with NIOCCONFIG and nifr_name = vale*: (or any port
+ * of it). Frames to lr_addr/lr_plen go to port lr_port (e.g.
+ * vale0:vm1), on rx ring lr_ring or, with NM_LPM_ANY_RING, on the
+ * ring the switch would use anyway. Adding an existing prefix
+ * replaces its route.
+ */
+struct nm_lpm_req {
+	uint8_t		lr_cmd;
+#define NM_LPM_ADD	1
+#define NM_LPM_DEL	2
+	uint8_t		lr_af;		/* 4 (IPv4) or 6 (IPv6) */
+	uint8_t		lr_plen;	/* prefix length */
+	uint8_t		lr_ring;
+#define NM_LPM_ANY_RING	0xff
+	uint8_t		lr_addr[16];	/* network byte order */
+	char		lr_port[IFNAMSIZ];
+};
+
+/*
+ * Batch of flows for a switch with NETMAP_BDG_FLOW, in the data of a
+ * struct nm_ifreq passed with NIOCCONFIG and nifr_name = vale*: (or
+ * any port of it). fq_rules points to fq_count struct nm_flow_rule,
+ * which are added or removed; on return fq_count is the number of
+ * rules processed. NM_FLOW_FWD rules forward to port fq_port (e.g.
+ * vale0:vm1), on rx ring fr_ring unless it is NM_FLOW_ANY_RING;
+ * NM_FLOW_MIRROR rules forward to fq_port and fq_mirror.
+ * Adding an existing flow replaces its action.
+ */
+struct nm_flow_rule {
+	uint8_t		fr_af;		/* 4 (IPv4) or 6 (IPv6) */
+	uint8_t		fr_proto;	/* IP protocol */
+	uint16_t	fr_sport;	/* network byte order, TCP/UDP/SCTP */
+	uint16_t	fr_dport;
+	uint8_t		fr_action;
+#define NM_FLOW_FWD	0
+#define NM_FLOW_DROP	1
+#define NM_FLOW_MIRROR	2
+	uint8_t		fr_ring;
+#define NM_FLOW_ANY_RING	0xff
+	uint8_t		fr_src[16];	/* network byte order */
+	uint8_t		fr_dst[16];
+};
+
+struct nm_flow_req {
+	uint8_t		fq_cmd;
+#define NM_FLOW_ADD	1
+#define NM_FLOW_DEL	2
+#define NM_FLOW_FLUSH	3	/* remove all the flows */
+	uint8_t		fq_pad[3];
+	uint32_t	fq_count;
+	uint64_t	fq_rules;	/* struct nm_flow_rule * */
+	char		fq_port[IFNAMSIZ];
+	char		fq_mirror[IFNAMSIZ];
+};
+
 #endif /* _NET_NETMAP_H_ */
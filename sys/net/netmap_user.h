@@ -272,9 +272,13 @@ struct nm_desc {
  * in the source and destination buffers.
  *
  * XXX only for multiples of 64 bytes, non overlapped.
+ *
+ * On x86_64 the copy uses AVX2 (or AVX-512, if NETMAP_SIMD_AVX512
+ * is defined) when the cpu supports it; the routine is chosen on
+ * the first call. Define NETMAP_NO_SIMD to always use the scalar one.
  */
 static inline void
-nm_pkt_copy(const void *_src, void *_dst, int l)
+nm_pkt_copy_scalar(const void *_src, void *_dst, int l)
 {
 	const uint64_t *src = (const uint64_t *)_src;
 	uint64_t *dst = (uint64_t *)_dst;
@@ -295,6 +299,67 @@ nm_pkt_copy(const void *_src, void *_dst, int l)
 	}
 }
 
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NETMAP_NO_SIMD)
+static void
+nm_pkt_copy_avx2(const void *src, void *dst, int l)
+{
+	for (; likely(l > 0); l -= 64) {
+		__asm__ __volatile__(
+			"vmovdqu (%0), %%ymm0\n\t"
+			"vmovdqu 32(%0), %%ymm1\n\t"
+			"vmovdqu %%ymm0, (%1)\n\t"
+			"vmovdqu %%ymm1, 32(%1)\n\t"
+			: : "r" (src), "r" (dst) : "xmm0", "xmm1", "memory");
+		src = (const char *)src + 64;
+		dst = (char *)dst + 64;
+	}
+	/* avoid the penalty of mixing with SSE code */
+	__asm__ __volatile__("vzeroupper" : : : "xmm0", "xmm1");
+}
+
+#ifdef NETMAP_SIMD_AVX512
+static void
+nm_pkt_copy_avx512(const void *src, void *dst, int l)
+{
+	for (; likely(l > 0); l -= 64) {
+		__asm__ __volatile__(
+			"vmovdqu64 (%0), %%zmm0\n\t"
+			"vmovdqu64 %%zmm0, (%1)\n\t"
+			: : "r" (src), "r" (dst) : "xmm0", "memory");
+		src = (const char *)src + 64;
+		dst = (char *)dst + 64;
+	}
+	__asm__ __volatile__("vzeroupper" : : : "xmm0");
+}
+#endif /* NETMAP_SIMD_AVX512 */
+
+static void nm_pkt_copy_select(const void *, void *, int);
+
+static void (*nm_pkt_copy_fn)(const void *, void *, int) = nm_pkt_copy_select;
+
+static void
+nm_pkt_copy_select(const void *src, void *dst, int l)
+{
+	__builtin_cpu_init();
+	nm_pkt_copy_fn = nm_pkt_copy_scalar;
+#ifdef NETMAP_SIMD_AVX512
+	if (__builtin_cpu_supports("avx512f"))
+		nm_pkt_copy_fn = nm_pkt_copy_avx512;
+	else
+#endif /* NETMAP_SIMD_AVX512 */
+	if (__builtin_cpu_supports("avx2"))
+		nm_pkt_copy_fn = nm_pkt_copy_avx2;
+	nm_pkt_copy_fn(src, dst, l);
+}
+
+static inline void
+nm_pkt_copy(const void *src, void *dst, int l)
+{
+	nm_pkt_copy_fn(src, dst, l);
+}
+#else /* !SIMD */
+#define nm_pkt_copy	nm_pkt_copy_scalar
+#endif /* !SIMD */
 
 /*
  * The callback, invoked on each received packet. Same as libpcap
@@ -321,6 +386,8 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *		r		monitor rx side (copy monitor)
  *		R		bind only RX ring(s)
  *		T		bind only TX ring(s)
+ *		a suffix @NN uses the memory region NN, and
+ *		@NN:MM or @:MM allocate the memory on NUMA node MM
  *
  * req		provides the initial values of nmreq before parsing ifname.
  *		Remember that the ifname parsing will override the ring
@@ -632,9 +699,10 @@ nm_open(const char *ifname, const struct nmreq *req,
 	uint32_t nr_ringid = 0, nr_flags, nr_reg;
 	const char *port = NULL;
 	const char *vpname = NULL;
+	const char *nump;
 #define MAXERRMSG 80
 	char errmsg[MAXERRMSG] = "";
-	enum { P_START, P_RNGSFXOK, P_GETNUM, P_FLAGS, P_FLAGSOK, P_MEMID } p_state;
+	enum { P_START, P_RNGSFXOK, P_GETNUM, P_FLAGS, P_FLAGSOK, P_MEMID, P_NUMA } p_state;
 	int is_vale;
 	long num;
 	uint16_t nr_arg2 = 0;
@@ -732,7 +800,12 @@ nm_open(const char *ifname, const struct nmreq *req,
 			port++;
 			break;
 		case P_GETNUM:
+			nump = port;
 			num = strtol(port, (char **)&port, 10);
+			if (port == nump) {
+				snprintf(errmsg, MAXERRMSG, "missing ring number");
+				goto fail;
+			}
 			if (num < 0 || num >= NETMAP_RING_MASK) {
 				snprintf(errmsg, MAXERRMSG, "'%ld' out of range [0, %d)",
 						num, NETMAP_RING_MASK);
@@ -779,12 +852,33 @@ nm_open(const char *ifname, const struct nmreq *req,
 				snprintf(errmsg, MAXERRMSG, "double setting of memid");
 				goto fail;
 			}
+			if (*port != ':') {
+				num = strtol(port, (char **)&port, 10);
+				if (num <= 0) {
+					snprintf(errmsg, MAXERRMSG, "invalid memid %ld, must be >0", num);
+					goto fail;
+				}
+				nr_arg2 = num;
+			}
+			if (*port == ':') {
+				port++;
+				p_state = P_NUMA;
+				break;
+			}
+			p_state = P_RNGSFXOK;
+			break;
+		case P_NUMA:
+			nump = port;
 			num = strtol(port, (char **)&port, 10);
-			if (num <= 0) {
-				snprintf(errmsg, MAXERRMSG, "invalid memid %ld, must be >0", num);
+			if (port == nump) {
+				snprintf(errmsg, MAXERRMSG, "invalid numa node");
+				goto fail;
+			}
+			if (num < 0 || num > 255) {
+				snprintf(errmsg, MAXERRMSG, "invalid numa node %ld", num);
 				goto fail;
 			}
-			nr_arg2 = num;
+			nr_flags |= NR_NUMA_NODE | (num << NR_NUMA_NODE_SHIFT);
 			p_state = P_RNGSFXOK;
 			break;
 		}
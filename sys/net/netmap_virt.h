@@ -125,6 +125,9 @@ struct netmap_pools_info {
 	uint32_t buf_pool_offset;
 	uint32_t buf_pool_objtotal;
 	uint32_t buf_pool_objsize;
+	/* the fields below were added in NETMAP_API 12 */
+	int32_t numa_node;	/* NUMA node of the memory, -1 if any */
+	uint32_t buf_pool_maxtotal; /* bufs the pool can grow to */
 };
 
 /*
@@ -816,6 +816,7 @@ nmr_pools_info_get()
 	printf("    buf off:    %"PRIu32"\n", upi->buf_pool_offset);
 	printf("    buf tot:    %"PRIu32"\n", upi->buf_pool_objtotal);
 	printf("    buf siz:    %"PRIu32"\n", upi->buf_pool_objsize);
+	printf("    buf max:    %"PRIu32"\n", upi->buf_pool_maxtotal);
 }
 
 void